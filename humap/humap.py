@@ -3,7 +3,9 @@
 # License: BSD 3 clause
 
 import _hierarchical_umap
+import os
 import numpy as np 
+import scipy.sparse
 
 from scipy.optimize import curve_fit
 
@@ -30,6 +32,8 @@ class HUMAP(object):
 		The kNN algorithm used for affinity computation. Options include:
 			* NNDescent
 			* KDTree_NNDescent
+			* Exact (brute force, for ground truth and small datasets)
+			* HNSW (hierarchical navigable small world graph)
 			* ANNOY (Python instalation required)
 			* FLANN (Python instalation required)
 
@@ -40,13 +44,25 @@ class HUMAP(object):
 			* random
 
 	reproducible (bool): (optional, default 'False')
-		If the results among different runs need to be reproducible. It affects the runtime execution.
+		If the results among different runs need to be reproducible. The layout optimization stays parallel
+		and gives the same embedding for any number of threads.
 
 	verbose (bool): (optional, default True)
 		Controls logging.
 
+	metric (str): (optional, default 'euclidean')
+		The distance used for the kNN graph. Options include:
+			* euclidean
+			* cosine (1 - cosine similarity; rows are normalized internally)
+			* inner_product (1 - <x, y>, clamped at zero)
+			* manhattan
+		ANNOY and FLANN support only euclidean.
+
 	"""
-	def __init__(self, levels=np.array([0.2, 0.2]), n_neighbors=100, min_dist=0.15, knn_algorithm='NNDescent', init="Spectral", verbose=True, reproducible=False):
+	def __init__(self, levels=np.array([0.2, 0.2]), n_neighbors=100, min_dist=0.15, knn_algorithm='NNDescent', init="Spectral", verbose=True, reproducible=False, metric='euclidean'):
+		if metric not in ('euclidean', 'cosine', 'inner_product', 'manhattan'):
+			raise ValueError("Unknown metric {}; use euclidean, cosine, inner_product or manhattan".format(metric))
+
 		self.levels = levels
 		self.n_levels = len(levels)+1
 		self.n_neighbors = n_neighbors
@@ -55,8 +71,9 @@ class HUMAP(object):
 		self.verbose = verbose
 		self.init = init
 		self.reproducible = reproducible
+		self.metric = metric
 
-		self.h_umap = _hierarchical_umap.HUMAP('precomputed', self.levels, self.n_neighbors, self.min_dist, self.knn_algorithm, self.init, self.verbose, self.reproducible)
+		self.h_umap = _hierarchical_umap.HUMAP(self.metric, self.levels, self.n_neighbors, self.min_dist, self.knn_algorithm, self.init, self.verbose, self.reproducible)
 
 
 	def fit(self, X, y=None):
@@ -65,8 +82,11 @@ class HUMAP(object):
 		
 		Parameters
 		----------
-		X (np.array): shape (n_samples, n_features)
-			The dataset consisting of n data points by m features
+		X (np.array or scipy.sparse matrix): shape (n_samples, n_features)
+			The dataset consisting of n data points by m features. 
+			C-contiguous float32 and float64 arrays are read without copies.
+			Sparse matrices are converted to CSR and never densified; their 
+			kNN graph is computed with NNDescent.
 
 		y (np.array): shape (n_samples) (optinal, default None)
 			The dataset labels
@@ -76,15 +96,19 @@ class HUMAP(object):
 		ValueError
 			If X:
 				* is None 
-				* is not a Numpy array
+				* is not a Numpy array or a scipy sparse matrix
 				* is not a two-dimensional array
+				* is sparse and knn_algorithm is not NNDescent
 		"""
 
 		if X is None:
 			raise ValueError("X must be a valid array")
 
-		if not isinstance(X, np.ndarray):
-			raise ValueError("X must be a numpy array")
+		if not isinstance(X, np.ndarray) and not scipy.sparse.issparse(X):
+			raise ValueError("X must be a numpy array or a scipy sparse matrix")
+
+		if scipy.sparse.issparse(X) and self.knn_algorithm != 'NNDescent':
+			raise ValueError("Sparse input requires knn_algorithm='NNDescent'")
 
 		if len(X.shape) != 2:
 			raise ValueError("X must be a two-dimensional array")
@@ -102,11 +126,20 @@ class HUMAP(object):
 			N *= pct_level
 
 
-		X = check_array(X, dtype=np.float32, accept_sparse='csr', order='C')
+		# float32 and float64 arrays are passed without copies; other types are converted to float32
+		X = check_array(X, dtype=[np.float32, np.float64], accept_sparse='csr', order='C')
 		a, b = self.find_ab_params(1.0, self.min_dist)
 		self.h_umap.set_ab_parameters(a, b)
 
-		self.h_umap.fit(X, y)
+		if scipy.sparse.issparse(X):
+			# the sparse distance kernels merge rows by sorted, unique column indices; check_array may return the
+			# caller's matrix, so a non-canonical one is fixed on a copy
+			if not X.has_canonical_format:
+				X = X.copy()
+				X.sum_duplicates()
+			self.h_umap.fit_csr(X.data, X.indices, X.indptr, X.shape[1], y)
+		else:
+			self.h_umap.fit(X, y)
 
 	def set_focus_context(self, focus_context):
 		r"""
@@ -274,6 +307,300 @@ class HUMAP(object):
 	def set_n_epochs(self, epochs):
 		self.h_umap.set_n_epochs(epochs)
 
+	def set_fast_gradient(self, fast_gradient=True):
+		r"""
+		Chooses between exact and fast x^b in the gradients of the layout optimization
+
+		Parameters
+		----------
+		fast_gradient (bool): If True, x^b is approximated from table-driven log2/exp2 (relative error below 1e-7) instead of calling pow.
+		
+		"""
+		self.h_umap.set_fast_gradient(fast_gradient)
+
+	def set_reorder(self, reorder=True):
+		r"""
+		Reorders the data points (Reverse Cuthill-McKee on the neighborhood graph) before the random walks and the layout optimization
+
+		Parameters
+		----------
+		reorder (bool): If True, graph neighbors get close positions in memory, which speeds up large datasets. Results are returned in the original order.
+		
+		"""
+		self.h_umap.set_reorder(reorder)
+
+	def set_convergence_tolerance(self, tolerance=1e-3, patience=10):
+		r"""
+		Stops the layout optimization once the embedding stops moving
+
+		After each epoch, the mean displacement of a sample of points is divided by the spread of the sample. 
+		The optimization ends when this value stays below tolerance for patience consecutive epochs.
+
+		Parameters
+		----------
+		tolerance (float): Relative displacement below which an epoch counts as converged (0 disables early stopping).
+		patience (int): Number of consecutive converged epochs needed to stop.
+
+		Raises
+		------
+		ValueError 
+			If tolerance < 0 or patience < 1
+		
+		"""
+		if tolerance < 0:
+			raise ValueError("Tolerance must be non-negative")
+		if patience < 1:
+			raise ValueError("Patience must be at least 1")
+
+		self.h_umap.set_convergence_tolerance(tolerance, patience)
+
+	def set_repulsion(self, method="BarnesHut", theta=0.5):
+		r"""
+		Chooses how the repulsive forces of the layout optimization are computed
+
+		Parameters
+		----------
+		method (str): 'NegativeSampling' estimates the repulsion from random samples. 'BarnesHut' computes the repulsion of all points with a quadtree (octree in 3-D) built once per epoch; it only applies to 2 or 3 components.
+		theta (float): Opening angle of 'BarnesHut'. Larger values are faster and less accurate (0 computes the exact repulsion).
+
+		Raises
+		------
+		ValueError 
+			If the method is unknown or theta < 0
+		
+		"""
+		if method not in ("NegativeSampling", "BarnesHut"):
+			raise ValueError("Repulsion method must be 'NegativeSampling' or 'BarnesHut'")
+		if theta < 0:
+			raise ValueError("Theta must be non-negative")
+
+		self.h_umap.set_repulsion(method, theta)
+
+	def set_warm_start(self, warm_start=True, epochs_fraction=0.3):
+		r"""
+		Initializes a level from the last embedding of the level above (coarse-to-fine)
+
+		Every point starts at the position of its landmark in the last embedding of the level above (from transform or a projection), plus a small jitter, and the layout runs a fraction of the epochs. 
+		Levels whose level above was not embedded yet start from a random layout, as usual.
+
+		Parameters
+		----------
+		warm_start (bool): If True, transform and projections start from the level above.
+		epochs_fraction (float): Fraction of the epochs that are run from a warm start.
+
+		Raises
+		------
+		ValueError 
+			If epochs_fraction is not in (0, 1]
+		
+		"""
+		if epochs_fraction <= 0 or epochs_fraction > 1:
+			raise ValueError("Epochs fraction must be in (0, 1]")
+
+		self.h_umap.set_warm_start(warm_start, epochs_fraction)
+
+	def transform_new(self, X, level=0):
+		r"""
+		Places new data points into the embedding of a hierarchy level without refitting
+
+		The new points are searched on the kNN graph of the fitted data and start at the weighted mean of the positions of their neighbors. 
+		A short optimization (a third of the epochs) then refines them, while the fitted points stay where transform placed them. 
+		On levels above 0, a neighbor counts for the landmark that owns it.
+
+		Parameters
+		----------
+		X (np.array): shape (n_new, n_features)
+			The new data points, with the features of the fitted data. Only dense fits are supported.
+
+		level (int): (optional, default 0)
+			The hierarchy level, which must have been embedded by transform beforehand.
+
+		Raises
+		------
+		ValueError
+			If X:
+				* is None 
+				* is not a Numpy array
+				* is not a two-dimensional array
+
+		Returns
+		-------
+		np.array: The positions of the new data points
+		"""
+		if X is None or not isinstance(X, np.ndarray):
+			raise ValueError("X must be a numpy array")
+
+		if len(X.shape) != 2:
+			raise ValueError("X must be a two-dimensional array")
+
+		X = check_array(X, dtype=[np.float32, np.float64], order='C')
+		return self.h_umap.transform_new(X, level)
+
+	def insert(self, X, y=None):
+		r"""
+		Appends new data points to the fitted hierarchy without refitting it
+
+		The points join the first level: its kNN graph is extended to them, and each one is associated to the landmark of one of its neighbors, which updates the influence of the landmarks. 
+		The landmarks are kept until the inserted points drift (see set_drift_threshold); then the levels above the first one are built again from the updated kNN graph. 
+		Embeddings computed before the insertion do not contain the new points, so transform must be called again.
+
+		Parameters
+		----------
+		X (np.array): shape (n_new, n_features)
+			The new data points, with the features of the fitted data. Only dense fits are supported.
+
+		y (np.array): shape (n_new) (optional, default None)
+			The labels of the new data points.
+
+		Raises
+		------
+		ValueError
+			If X:
+				* is None 
+				* is not a Numpy array
+				* is not a two-dimensional array
+
+		Returns
+		-------
+		bool: Whether the landmarks were selected again
+		"""
+		if X is None or not isinstance(X, np.ndarray):
+			raise ValueError("X must be a numpy array")
+
+		if len(X.shape) != 2:
+			raise ValueError("X must be a two-dimensional array")
+
+		if y is None:
+			y = np.zeros(X.shape[0])
+
+		X = check_array(X, dtype=[np.float32, np.float64], order='C')
+		return self.h_umap.insert(X, y)
+
+	def set_drift_threshold(self, threshold=0.1):
+		r"""
+		Defines how much the inserted data points may drift before the landmarks are selected again
+
+		An inserted point drifts when its closest point of the last landmark selection is farther than 90% of those points are from their closest neighbors. 
+		The drift is the number of such points over the size of the first level at the selection; insert selects the landmarks again once it exceeds the threshold.
+
+		Parameters
+		----------
+		threshold (float): Share of drifted points (default 0.1). Zero selects the landmarks again on every insertion with a drifted point.
+		
+		"""
+		self.h_umap.set_drift_threshold(threshold)
+
+	def drift(self):
+		r"""
+		Reports the drift of the inserted data points since the landmarks were selected
+
+		Returns
+		-------
+		float: The number of drifted points over the size of the first level at the selection
+		
+		"""
+		return self.h_umap.get_drift()
+
+	def set_knn_cache(self, directory):
+		r"""
+		Caches the kNN graph of the first level in a directory
+
+		The graph is stored under a fingerprint of the data and of the kNN parameters (algorithm, n_neighbors), so refitting the same data with other levels, min_dist or walk parameters skips the kNN computation. 
+		Files are memory-mapped when loaded. Passing None or an empty string disables the cache.
+
+		Parameters
+		----------
+		directory (str): Cache directory, created if it does not exist.
+		
+		"""
+		if directory:
+			os.makedirs(directory, exist_ok=True)
+		else:
+			directory = ""
+
+		self.h_umap.set_knn_cache(directory)
+
+	def set_knn_quantization(self, mode):
+		r"""
+		Compresses the rows NNDescent compares while it builds the kNN graph of the first level
+
+		With 'int8', every value is stored as an 8-bit code (one scale for all features), so candidate distances read a quarter of the memory of float32 rows. 
+		The candidates found this way are re-ranked with exact distances before the neighbors are kept. 
+		Applies to the NNDescent and KDTree_NNDescent algorithms on dense input.
+
+		Parameters
+		----------
+		mode (str): 'none' (default) or 'int8'
+
+		Raises
+		------
+		ValueError
+			If mode is not 'none' or 'int8'
+		"""
+		if mode not in ('none', 'int8'):
+			raise ValueError("Unknown knn quantization {}; use none or int8".format(mode))
+
+		self.h_umap.set_knn_quantization(mode)
+
+	def set_knn_target_recall(self, target):
+		r"""
+		Tunes the NNDescent parameters (L, S and R) of the first level for a target recall
+
+		Candidate settings build the kNN graph of a sample of at most 10000 rows, and the cheapest one whose estimated recall reaches the target is used (the most accurate one if none does). The cost is the number of pool updates over all the rounds times the pool size L; the time only breaks ties. 
+		The choice is kept by data shape (metric, size, dimension, n_neighbors) for the process, and in the kNN cache directory when one is set. 
+		Applies to the NNDescent and KDTree_NNDescent algorithms on dense input, and not in reproducible mode.
+
+		Parameters
+		----------
+		target (float): Recall between 0 and 1 (default 0, which keeps the defaults derived from n_neighbors)
+
+		Raises
+		------
+		ValueError
+			If target is not in [0, 1]
+		"""
+		if target < 0.0 or target > 1.0:
+			raise ValueError("knn target recall must be in [0, 1]")
+
+		self.h_umap.set_knn_target_recall(target)
+
+	def convergence(self):
+		r"""
+		Reports the convergence of the last embedding (fit, transform, or projection)
+
+		Returns
+		-------
+		Tuple with the number of epochs that were run and the relative displacement of every epoch (empty if not monitored)
+		
+		"""
+		return self.h_umap.get_stopping_epoch(), self.h_umap.get_convergence_curve()
+
+
+	def knn_convergence(self):
+		r"""
+		Reports how NNDescent converged while it built the kNN graph of the first level
+
+		NNDescent stops once a round changes fewer than 0.1% of the neighbor lists' entries (at most 30 rounds). 
+		After each round, the recall of the graph is estimated on 100 sampled points whose exact neighbors are computed, so the quality of the graph is known without an exact kNN pass.
+
+		Returns
+		-------
+		Tuple with the number of neighbor updates and the estimated recall of every round (empty if another kNN algorithm or the kNN cache gave the graph)
+		
+		"""
+		return self.h_umap.get_knn_updates(), self.h_umap.get_knn_recall()
+
+	def knn_graph(self):
+		r"""
+		Gets the kNN graph of the first level
+
+		Returns
+		-------
+		Tuple with the indices and the distances of the n_neighbors nearest neighbors of every data point (each point is its own first neighbor)
+		
+		"""
+		return self.h_umap.get_knn_indices(), self.h_umap.get_knn_dists()
+
 
 	def influence(self, level):
 		r"""
@@ -335,6 +662,8 @@ class UMAP(HUMAP):
 		The kNN algorithm used for affinity computation. Options include:
 			* NNDescent
 			* KDTree_NNDescent
+			* Exact (brute force, for ground truth and small datasets)
+			* HNSW (hierarchical navigable small world graph)
 			* ANNOY (Python instalation required)
 			* FLANN (Python instalation required)
 
@@ -346,9 +675,12 @@ class UMAP(HUMAP):
 	verbose (bool): (optional, default True)
 		Controls logging.
 
+	metric (str): (optional, default 'euclidean')
+		The distance used for the kNN graph: euclidean, cosine, inner_product or manhattan.
+
 	"""
-	def __init__(self, n_neighbors=100, min_dist=0.15, knn_algorithm='NNDescent', init="Spectral", verbose=True, reproducible=False):
-		super().__init__(np.array([]), n_neighbors, min_dist, knn_algorithm, init, verbose, reproducible)
+	def __init__(self, n_neighbors=100, min_dist=0.15, knn_algorithm='NNDescent', init="Spectral", verbose=True, reproducible=False, metric='euclidean'):
+		super().__init__(np.array([]), n_neighbors, min_dist, knn_algorithm, init, verbose, reproducible, metric)
 
 	def fit_transform(self, X):
 		"""
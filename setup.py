@@ -20,7 +20,7 @@ if sys.platform == 'win32':
     print("Compiling for Windows")
     ext_modules = [
     	Pybind11Extension("_hierarchical_umap",
-    		["src/cpp/external/efanna/index.cpp", "src/cpp/external/efanna/index_graph.cpp", "src/cpp/external/efanna/index_kdtree.cpp", "src/cpp/external/efanna/index_random.cpp", "src/cpp/utils.cpp", "src/cpp/umap.cpp", "src/cpp/hierarchical_umap.cpp", "src/cpp/humap_binding.cpp"],
+    		["src/cpp/external/efanna/index.cpp", "src/cpp/external/efanna/distance.cpp", "src/cpp/external/efanna/index_graph.cpp", "src/cpp/external/efanna/index_kdtree.cpp", "src/cpp/external/efanna/index_random.cpp", "src/cpp/external/efanna/index_rpforest.cpp", "src/cpp/external/efanna/index_hnsw.cpp", "src/cpp/external/efanna/sparse.cpp", "src/cpp/external/efanna/quantized.cpp", "src/cpp/utils.cpp", "src/cpp/umap.cpp", "src/cpp/hierarchical_umap.cpp", "src/cpp/humap_binding.cpp"],
     		language='c++',
     		extra_compile_args = [ '/openmp', '/DEIGEN_DONT_PARALLELIZE',  '/DINFO', '-IC:/Eigen'],
             extra_link_args = [ '/openmp', '/DEIGEN_DONT_PARALLELIZE', '/DINFO', '-IC:/Eigen'],
@@ -32,7 +32,7 @@ elif sys.platform == 'darwin':
     print("Compiling for MacOS")
     ext_modules = [
     Pybind11Extension("_hierarchical_umap",
-        ["src/cpp/external/efanna/index.cpp", "src/cpp/external/efanna/index_graph.cpp", "src/cpp/external/efanna/index_kdtree.cpp", "src/cpp/external/efanna/index_random.cpp", "src/cpp/utils.cpp", "src/cpp/umap.cpp", "src/cpp/hierarchical_umap.cpp", "src/cpp/humap_binding.cpp"],
+        ["src/cpp/external/efanna/index.cpp", "src/cpp/external/efanna/distance.cpp", "src/cpp/external/efanna/index_graph.cpp", "src/cpp/external/efanna/index_kdtree.cpp", "src/cpp/external/efanna/index_random.cpp", "src/cpp/external/efanna/index_rpforest.cpp", "src/cpp/external/efanna/index_hnsw.cpp", "src/cpp/external/efanna/sparse.cpp", "src/cpp/external/efanna/quantized.cpp", "src/cpp/utils.cpp", "src/cpp/umap.cpp", "src/cpp/hierarchical_umap.cpp", "src/cpp/humap_binding.cpp"],
         language='c++',
         extra_compile_args = ['-O3', '-std=c++11', '-fPIC', '-fopenmp', '-DEIGEN_DONT_PARALLELIZE', '-DINFO'],
         extra_link_args = ['-O3', '-std=c++11', '-fPIC', '-fopenmp', '-DEIGEN_DONT_PARALLELIZE', '-DINFO'],
@@ -44,7 +44,7 @@ else:
     print("Compiling for Linux")
     ext_modules = [
     Pybind11Extension("_hierarchical_umap",
-        ["src/cpp/external/efanna/index.cpp", "src/cpp/external/efanna/index_graph.cpp", "src/cpp/external/efanna/index_kdtree.cpp", "src/cpp/external/efanna/index_random.cpp", "src/cpp/utils.cpp", "src/cpp/umap.cpp", "src/cpp/hierarchical_umap.cpp", "src/cpp/humap_binding.cpp"],
+        ["src/cpp/external/efanna/index.cpp", "src/cpp/external/efanna/distance.cpp", "src/cpp/external/efanna/index_graph.cpp", "src/cpp/external/efanna/index_kdtree.cpp", "src/cpp/external/efanna/index_random.cpp", "src/cpp/external/efanna/index_rpforest.cpp", "src/cpp/external/efanna/index_hnsw.cpp", "src/cpp/external/efanna/sparse.cpp", "src/cpp/external/efanna/quantized.cpp", "src/cpp/utils.cpp", "src/cpp/umap.cpp", "src/cpp/hierarchical_umap.cpp", "src/cpp/humap_binding.cpp"],
         language='c++',
         extra_compile_args = ['-O3', '-shared', '-std=c++11', '-fPIC', '-fopenmp',  '-DEIGEN_DONT_PARALLELIZE', '-DINFO'],
         extra_link_args = ['-O3', '-shared', '-std=c++11', '-fPIC', '-fopenmp',  '-DEIGEN_DONT_PARALLELIZE', '-DINFO'],
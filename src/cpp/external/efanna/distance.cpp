@@ -0,0 +1,511 @@
+//
+// Distance kernels with runtime instruction set dispatch.
+//
+// This source code is licensed under the MIT license.
+//
+
+#include "distance.h"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  #define EFANNA_X86
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #endif
+#endif
+
+// kernels for newer instruction sets are compiled per function, so the binary
+// does not need -mavx2 or -mavx512f and still runs on older CPUs
+#if defined(__GNUC__) || defined(__clang__)
+  #define EFANNA_TARGET(isa) __attribute__((target(isa)))
+#else
+  #define EFANNA_TARGET(isa)
+#endif
+
+namespace efanna2e {
+
+// four independent sums, so the compiler can vectorize without reassociating
+static float l2sqr_scalar(const float *a, const float *b, unsigned size) {
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  unsigned i = 0;
+  for (; i + 4 <= size; i += 4) {
+    float d0 = a[i] - b[i], d1 = a[i + 1] - b[i + 1], d2 = a[i + 2] - b[i + 2], d3 = a[i + 3] - b[i + 3];
+    s0 += d0 * d0;
+    s1 += d1 * d1;
+    s2 += d2 * d2;
+    s3 += d3 * d3;
+  }
+  for (; i < size; i++) {
+    float d = a[i] - b[i];
+    s0 += d * d;
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+static float dot_scalar(const float *a, const float *b, unsigned size) {
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  unsigned i = 0;
+  for (; i + 4 <= size; i += 4) {
+    s0 += a[i] * b[i];
+    s1 += a[i + 1] * b[i + 1];
+    s2 += a[i + 2] * b[i + 2];
+    s3 += a[i + 3] * b[i + 3];
+  }
+  for (; i < size; i++) s0 += a[i] * b[i];
+  return (s0 + s1) + (s2 + s3);
+}
+
+static float l1_scalar(const float *a, const float *b, unsigned size) {
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  unsigned i = 0;
+  for (; i + 4 <= size; i += 4) {
+    s0 += std::fabs(a[i] - b[i]);
+    s1 += std::fabs(a[i + 1] - b[i + 1]);
+    s2 += std::fabs(a[i + 2] - b[i + 2]);
+    s3 += std::fabs(a[i + 3] - b[i + 3]);
+  }
+  for (; i < size; i++) s0 += std::fabs(a[i] - b[i]);
+  return (s0 + s1) + (s2 + s3);
+}
+
+static float l2sqr_i8_scalar(const int8_t *a, const int8_t *b, unsigned size) {
+  int64_t sum = 0;
+  for (unsigned i = 0; i < size; i++) {
+    int d = (int)a[i] - (int)b[i];
+    sum += d * d;
+  }
+  return (float)sum;
+}
+
+static float dot_i8_scalar(const int8_t *a, const int8_t *b, unsigned size) {
+  int64_t sum = 0;
+  for (unsigned i = 0; i < size; i++) sum += (int)a[i] * (int)b[i];
+  return (float)sum;
+}
+
+static float l1_i8_scalar(const int8_t *a, const int8_t *b, unsigned size) {
+  int64_t sum = 0;
+  for (unsigned i = 0; i < size; i++) sum += std::abs((int)a[i] - (int)b[i]);
+  return (float)sum;
+}
+
+#ifdef EFANNA_X86
+
+// the int8 kernels sum pairs of int16 products into int32 lanes (at most 4 * 254^2 per
+// lane and step), which are flushed to a wider total every INT8_BLOCK values
+static const unsigned INT8_BLOCK = 32768;
+
+// adds the int32 lanes of a 128-bit register
+static inline int64_t horizontal_sum_epi32(__m128i v) {
+  int32_t unpack[4];
+  _mm_storeu_si128((__m128i *)unpack, v);
+  return ((int64_t)unpack[0] + unpack[1]) + ((int64_t)unpack[2] + unpack[3]);
+}
+
+// sign-extends the low and high 8 int8 values of a register to int16
+EFANNA_TARGET("sse2")
+static inline void widen_i8_sse2(__m128i v, __m128i &lo, __m128i &hi) {
+  lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+  hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+}
+
+EFANNA_TARGET("sse2")
+static float l2sqr_i8_sse2(const int8_t *a, const int8_t *b, unsigned size) {
+  int64_t total = 0;
+  unsigned i = 0;
+  while (i + 16 <= size) {
+    unsigned end = std::min(size & ~15u, i + INT8_BLOCK);
+    __m128i sum = _mm_setzero_si128();
+    for (; i < end; i += 16) {
+      __m128i alo, ahi, blo, bhi;
+      widen_i8_sse2(_mm_loadu_si128((const __m128i *)(a + i)), alo, ahi);
+      widen_i8_sse2(_mm_loadu_si128((const __m128i *)(b + i)), blo, bhi);
+      __m128i dlo = _mm_sub_epi16(alo, blo), dhi = _mm_sub_epi16(ahi, bhi);
+      sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(dlo, dlo), _mm_madd_epi16(dhi, dhi)));
+    }
+    total += horizontal_sum_epi32(sum);
+  }
+  return (float)total + l2sqr_i8_scalar(a + i, b + i, size - i);
+}
+
+EFANNA_TARGET("sse2")
+static float dot_i8_sse2(const int8_t *a, const int8_t *b, unsigned size) {
+  int64_t total = 0;
+  unsigned i = 0;
+  while (i + 16 <= size) {
+    unsigned end = std::min(size & ~15u, i + INT8_BLOCK);
+    __m128i sum = _mm_setzero_si128();
+    for (; i < end; i += 16) {
+      __m128i alo, ahi, blo, bhi;
+      widen_i8_sse2(_mm_loadu_si128((const __m128i *)(a + i)), alo, ahi);
+      widen_i8_sse2(_mm_loadu_si128((const __m128i *)(b + i)), blo, bhi);
+      sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(alo, blo), _mm_madd_epi16(ahi, bhi)));
+    }
+    total += horizontal_sum_epi32(sum);
+  }
+  return (float)total + dot_i8_scalar(a + i, b + i, size - i);
+}
+
+EFANNA_TARGET("sse2")
+static float l1_i8_sse2(const int8_t *a, const int8_t *b, unsigned size) {
+  const __m128i ones = _mm_set1_epi16(1);
+  int64_t total = 0;
+  unsigned i = 0;
+  while (i + 16 <= size) {
+    unsigned end = std::min(size & ~15u, i + INT8_BLOCK);
+    __m128i sum = _mm_setzero_si128();
+    for (; i < end; i += 16) {
+      __m128i alo, ahi, blo, bhi;
+      widen_i8_sse2(_mm_loadu_si128((const __m128i *)(a + i)), alo, ahi);
+      widen_i8_sse2(_mm_loadu_si128((const __m128i *)(b + i)), blo, bhi);
+      __m128i dlo = _mm_sub_epi16(alo, blo), dhi = _mm_sub_epi16(ahi, bhi);
+      dlo = _mm_max_epi16(dlo, _mm_sub_epi16(_mm_setzero_si128(), dlo));
+      dhi = _mm_max_epi16(dhi, _mm_sub_epi16(_mm_setzero_si128(), dhi));
+      sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(dlo, ones), _mm_madd_epi16(dhi, ones)));
+    }
+    total += horizontal_sum_epi32(sum);
+  }
+  return (float)total + l1_i8_scalar(a + i, b + i, size - i);
+}
+
+// adds the lanes of a 128-bit register
+static inline float horizontal_sum(__m128 v) {
+  float unpack[4];
+  _mm_storeu_ps(unpack, v);
+  return (unpack[0] + unpack[1]) + (unpack[2] + unpack[3]);
+}
+
+EFANNA_TARGET("sse2")
+static float l2sqr_sse2(const float *a, const float *b, unsigned size) {
+  __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+  unsigned i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+  }
+  float result = horizontal_sum(_mm_add_ps(sum0, sum1));
+  for (; i < size; i++) {
+    float d = a[i] - b[i];
+    result += d * d;
+  }
+  return result;
+}
+
+EFANNA_TARGET("sse2")
+static float dot_sse2(const float *a, const float *b, unsigned size) {
+  __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+  unsigned i = 0;
+  for (; i + 8 <= size; i += 8) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  float result = horizontal_sum(_mm_add_ps(sum0, sum1));
+  for (; i < size; i++) result += a[i] * b[i];
+  return result;
+}
+
+EFANNA_TARGET("sse2")
+static float l1_sse2(const float *a, const float *b, unsigned size) {
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+  unsigned i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    sum0 = _mm_add_ps(sum0, _mm_and_ps(d0, abs_mask));
+    sum1 = _mm_add_ps(sum1, _mm_and_ps(d1, abs_mask));
+  }
+  float result = horizontal_sum(_mm_add_ps(sum0, sum1));
+  for (; i < size; i++) result += std::fabs(a[i] - b[i]);
+  return result;
+}
+
+// adds the lanes of a 256-bit register
+EFANNA_TARGET("avx2,fma")
+static inline float horizontal_sum256(__m256 v) {
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+  return _mm_cvtss_f32(half);
+}
+
+EFANNA_TARGET("avx2,fma")
+static float l2sqr_avx2(const float *a, const float *b, unsigned size) {
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+  }
+  if (i + 8 <= size) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    i += 8;
+  }
+  float result = horizontal_sum256(_mm256_add_ps(sum0, sum1));
+  for (; i < size; i++) {
+    float d = a[i] - b[i];
+    result += d * d;
+  }
+  return result;
+}
+
+EFANNA_TARGET("avx2,fma")
+static float dot_avx2(const float *a, const float *b, unsigned size) {
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+  }
+  if (i + 8 <= size) {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    i += 8;
+  }
+  float result = horizontal_sum256(_mm256_add_ps(sum0, sum1));
+  for (; i < size; i++) result += a[i] * b[i];
+  return result;
+}
+
+EFANNA_TARGET("avx2,fma")
+static float l1_avx2(const float *a, const float *b, unsigned size) {
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+    sum0 = _mm256_add_ps(sum0, _mm256_and_ps(d0, abs_mask));
+    sum1 = _mm256_add_ps(sum1, _mm256_and_ps(d1, abs_mask));
+  }
+  if (i + 8 <= size) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    sum0 = _mm256_add_ps(sum0, _mm256_and_ps(d0, abs_mask));
+    i += 8;
+  }
+  float result = horizontal_sum256(_mm256_add_ps(sum0, sum1));
+  for (; i < size; i++) result += std::fabs(a[i] - b[i]);
+  return result;
+}
+
+// adds the int32 lanes of a 256-bit register
+EFANNA_TARGET("avx2,fma")
+static inline int64_t horizontal_sum256_epi32(__m256i v) {
+  int32_t unpack[8];
+  _mm256_storeu_si256((__m256i *)unpack, v);
+  int64_t result = 0;
+  for (int i = 0; i < 8; i++) result += unpack[i];
+  return result;
+}
+
+EFANNA_TARGET("avx2,fma")
+static float l2sqr_i8_avx2(const int8_t *a, const int8_t *b, unsigned size) {
+  int64_t total = 0;
+  unsigned i = 0;
+  while (i + 32 <= size) {
+    unsigned end = std::min(size & ~31u, i + INT8_BLOCK);
+    __m256i sum = _mm256_setzero_si256();
+    for (; i < end; i += 32) {
+      __m256i d0 = _mm256_sub_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i))),
+                                    _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i))));
+      __m256i d1 = _mm256_sub_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i + 16))),
+                                    _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i + 16))));
+      sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_madd_epi16(d0, d0), _mm256_madd_epi16(d1, d1)));
+    }
+    total += horizontal_sum256_epi32(sum);
+  }
+  return (float)total + l2sqr_i8_scalar(a + i, b + i, size - i);
+}
+
+EFANNA_TARGET("avx2,fma")
+static float dot_i8_avx2(const int8_t *a, const int8_t *b, unsigned size) {
+  int64_t total = 0;
+  unsigned i = 0;
+  while (i + 32 <= size) {
+    unsigned end = std::min(size & ~31u, i + INT8_BLOCK);
+    __m256i sum = _mm256_setzero_si256();
+    for (; i < end; i += 32) {
+      __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+      __m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i + 16)));
+      __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+      __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i + 16)));
+      sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_madd_epi16(a0, b0), _mm256_madd_epi16(a1, b1)));
+    }
+    total += horizontal_sum256_epi32(sum);
+  }
+  return (float)total + dot_i8_scalar(a + i, b + i, size - i);
+}
+
+EFANNA_TARGET("avx2,fma")
+static float l1_i8_avx2(const int8_t *a, const int8_t *b, unsigned size) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  int64_t total = 0;
+  unsigned i = 0;
+  while (i + 32 <= size) {
+    unsigned end = std::min(size & ~31u, i + INT8_BLOCK);
+    __m256i sum = _mm256_setzero_si256();
+    for (; i < end; i += 32) {
+      __m256i d0 = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i))),
+                                                     _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i)))));
+      __m256i d1 = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i + 16))),
+                                                     _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i + 16)))));
+      sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_madd_epi16(d0, ones), _mm256_madd_epi16(d1, ones)));
+    }
+    total += horizontal_sum256_epi32(sum);
+  }
+  return (float)total + l1_i8_scalar(a + i, b + i, size - i);
+}
+
+// adds the lanes of a 512-bit register
+EFANNA_TARGET("avx512f")
+static inline float horizontal_sum512(__m512 v) {
+  float unpack[16];
+  _mm512_storeu_ps(unpack, v);
+  float result = 0;
+  for (int i = 0; i < 16; i += 4) result += (unpack[i] + unpack[i + 1]) + (unpack[i + 2] + unpack[i + 3]);
+  return result;
+}
+
+// mask of the lanes of the last (partial) block of 16 floats
+static inline __mmask16 tail_mask(unsigned remaining) {
+  return remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+}
+
+EFANNA_TARGET("avx512f")
+static float l2sqr_avx512(const float *a, const float *b, unsigned size) {
+  __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+    sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+    sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+  }
+  for (; i < size; i += 16) {
+    // the tail is read with a mask, so no load goes past the end of the vectors
+    __mmask16 mask = tail_mask(size - i);
+    __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+    sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+  }
+  return horizontal_sum512(_mm512_add_ps(sum0, sum1));
+}
+
+EFANNA_TARGET("avx512f")
+static float dot_avx512(const float *a, const float *b, unsigned size) {
+  __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + 32 <= size; i += 32) {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+    sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+  }
+  for (; i < size; i += 16) {
+    __mmask16 mask = tail_mask(size - i);
+    sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum0);
+  }
+  return horizontal_sum512(_mm512_add_ps(sum0, sum1));
+}
+
+EFANNA_TARGET("avx512f")
+static float l1_avx512(const float *a, const float *b, unsigned size) {
+  __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + 32 <= size; i += 32) {
+    sum0 = _mm512_add_ps(sum0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i))));
+    sum1 = _mm512_add_ps(sum1, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16))));
+  }
+  for (; i < size; i += 16) {
+    __mmask16 mask = tail_mask(size - i);
+    sum0 = _mm512_add_ps(sum0, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i))));
+  }
+  return horizontal_sum512(_mm512_add_ps(sum0, sum1));
+}
+
+enum SimdLevel { SIMD_SCALAR = 0, SIMD_SSE2 = 1, SIMD_AVX2 = 2, SIMD_AVX512 = 3 };
+
+static SimdLevel cpu_simd_level() {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+  return SIMD_SCALAR;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+
+  __cpuid(info, 1);
+  bool sse2 = (info[3] & (1 << 26)) != 0;
+  bool fma = (info[2] & (1 << 12)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  // the OS must save the AVX (bits 1-2) and AVX-512 (bits 5-7) registers
+  unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+  bool avx_state = (xcr0 & 0x6) == 0x6;
+  bool avx512_state = (xcr0 & 0xE6) == 0xE6;
+
+  bool avx2 = false, avx512f = false;
+  if (max_leaf >= 7) {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+    avx512f = (info[1] & (1 << 16)) != 0;
+  }
+
+  if (avx512f && avx512_state) return SIMD_AVX512;
+  if (avx2 && fma && avx_state) return SIMD_AVX2;
+  if (sse2) return SIMD_SSE2;
+  return SIMD_SCALAR;
+#else
+  return SIMD_SCALAR;
+#endif
+}
+
+#endif
+
+static SimdKernels select_kernels() {
+  SimdKernels scalar = {"scalar", l2sqr_scalar, dot_scalar, l1_scalar, l2sqr_i8_scalar, dot_i8_scalar, l1_i8_scalar};
+
+#ifdef EFANNA_X86
+  // 512-bit int16 arithmetic needs AVX-512BW, so the avx512 level keeps the avx2 int8 kernels
+  SimdKernels kernels[] = {scalar,
+                           {"sse2", l2sqr_sse2, dot_sse2, l1_sse2, l2sqr_i8_sse2, dot_i8_sse2, l1_i8_sse2},
+                           {"avx2", l2sqr_avx2, dot_avx2, l1_avx2, l2sqr_i8_avx2, dot_i8_avx2, l1_i8_avx2},
+                           {"avx512", l2sqr_avx512, dot_avx512, l1_avx512, l2sqr_i8_avx2, dot_i8_avx2, l1_i8_avx2}};
+
+  int level = cpu_simd_level();
+  const char *cap = std::getenv("HUMAP_SIMD");
+  if (cap != nullptr) {
+    for (int l = 0; l < 4; l++) {
+      if (std::strcmp(cap, kernels[l].name) == 0 && l < level) level = l;
+    }
+  }
+  return kernels[level];
+#else
+  return scalar;
+#endif
+}
+
+void normalize_rows(float *data, size_t n, unsigned dim) {
+  DistanceKernel dot = simd_kernels().dot;
+#pragma omp parallel for
+  for (long long i = 0; i < (long long)n; i++) {
+    float *row = data + (size_t)i * dim;
+    float norm = std::sqrt(dot(row, row, dim));
+    if (norm > 0) {
+      for (unsigned j = 0; j < dim; j++) row[j] /= norm;
+    }
+  }
+}
+
+const SimdKernels &simd_kernels() {
+  static const SimdKernels kernels = select_kernels();
+  return kernels;
+}
+
+}
@@ -5,18 +5,9 @@
 #ifndef EFANNA2E_DISTANCE_H
 #define EFANNA2E_DISTANCE_H
 
-#define COMPATIBILITY_MODE
-
-#ifndef COMPATIBILITY_MODE
-
-  #include <xmmintrin.h>
-  #include <mmintrin.h>
-  #include <immintrin.h>
-
-#endif
-
 #include <iostream>
 #include <cmath>
+#include <cstdint>
 
 
 
@@ -25,67 +16,89 @@ namespace efanna2e{
       L2 = 0,
       INNER_PRODUCT = 1,
       FAST_L2 = 2,
-      PQ = 3
+      PQ = 3,
+      COSINE = 4,
+      L1 = 5
     };
+
+    // distance kernel over two float vectors of the given length
+    typedef float (*DistanceKernel)(const float* a, const float* b, unsigned size);
+
+    // the same over int8 codes; the integer sum is returned as a float
+    typedef float (*Int8Kernel)(const int8_t* a, const int8_t* b, unsigned size);
+
+    // kernels for the instruction sets of the running CPU, selected once at runtime (see distance.cpp)
+    struct SimdKernels {
+        const char* name;       // "avx512", "avx2", "sse2" or "scalar"
+        DistanceKernel l2sqr;   // squared euclidean distance
+        DistanceKernel dot;     // inner product
+        DistanceKernel l1;      // manhattan distance
+        Int8Kernel l2sqr_i8;    // squared euclidean distance of int8 codes
+        Int8Kernel dot_i8;      // inner product of int8 codes
+        Int8Kernel l1_i8;       // manhattan distance of int8 codes
+    };
+
+    // the HUMAP_SIMD environment variable (avx512, avx2, sse2, scalar) caps the level that is used
+    const SimdKernels& simd_kernels();
+
     class Distance {
     public:
         virtual float compare(const float* a, const float* b, unsigned length) const = 0;
         virtual ~Distance() {}
     };
 
+    // distance between two rows of a dataset an index keeps in another form than float rows
+    class RowDistance {
+    public:
+        virtual float compare(unsigned a, unsigned b) const = 0;
+        virtual ~RowDistance() {}
+    };
+
     class DistanceL2 : public Distance{
     public:
+        DistanceL2() : l2sqr_(simd_kernels().l2sqr) {}
+
+        // euclidean distance (the knn distances are reported unsquared)
+        float compare(const float* a, const float* b, unsigned size) const {
+            return std::sqrt(l2sqr_(a, b, size));
+        }
+
+    private:
+        DistanceKernel l2sqr_;
+    };
+
+    // 1 - <a, b>, so larger inner products are closer (can be negative for vectors longer than 1)
+    class DistanceInnerProduct : public Distance{
+    public:
+        DistanceInnerProduct() : dot_(simd_kernels().dot) {}
+
         float compare(const float* a, const float* b, unsigned size) const {
-            float result = 0;
-
-            #ifndef COMPATIBILITY_MODE
-
-              #define AVX_L2SQR(addr1, addr2, dest, tmp1, tmp2) \
-                  tmp1 = _mm256_loadu_ps(addr1);\
-                  tmp2 = _mm256_loadu_ps(addr2);\
-                  tmp1 = _mm256_sub_ps(tmp1, tmp2); \
-                  tmp1 = _mm256_mul_ps(tmp1, tmp1); \
-                  dest = _mm256_add_ps(dest, tmp1);
-                  __m256 sum;
-                  __m256 l0, l1;
-                  __m256 r0, r1;
-                  unsigned D = (size + 7) & ~7U;
-                  unsigned DR = D % 16;
-                  unsigned DD = D - DR;
-                  const float *l = a;
-                  const float *r = b;
-                  const float *e_l = l + DD;
-                  const float *e_r = r + DD;
-                  // float unpack[8] __attribute__ ((aligned (32))) = {0, 0, 0, 0, 0, 0, 0, 0};
-                  float unpack[8]  = {0, 0, 0, 0, 0, 0, 0, 0};
-                  // __declspec(align(32)) float unpack[8]   = {0, 0, 0, 0, 0, 0, 0, 0};
-
-              sum = _mm256_loadu_ps(unpack);
-              if(DR){AVX_L2SQR(e_l, e_r, sum, l0, r0);}
-
-              for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-                AVX_L2SQR(l, r, sum, l0, r0);
-                AVX_L2SQR(l + 8, r + 8, sum, l1, r1);
-              }
-              _mm256_storeu_ps(unpack, sum);
-              result = unpack[0] + unpack[1] + unpack[2] + unpack[3] + unpack[4] + unpack[5] + unpack[6] + unpack[7];
-
-            
-            #endif
-
-            #ifdef COMPATIBILITY_MODE
-              #pragma omp parallel for
-              for( int i = 0; i < size; ++i ) {
-                result += (*(a+i) - *(b+i))*(*(a+i) - *(b+i));
-              }
-              result = std::sqrt(result);
-            #endif
-
-
-            return result;
+            return 1.0f - dot_(a, b, size);
         }
+
+    private:
+        DistanceKernel dot_;
+    };
+
+    // cosine distance 1 - cos(a, b); the rows must be normalized beforehand (see normalize_rows)
+    class DistanceCosine : public DistanceInnerProduct{
     };
 
+    class DistanceL1 : public Distance{
+    public:
+        DistanceL1() : l1_(simd_kernels().l1) {}
+
+        float compare(const float* a, const float* b, unsigned size) const {
+            return l1_(a, b, size);
+        }
+
+    private:
+        DistanceKernel l1_;
+    };
+
+    // scales every row of a row-major n x dim array to unit length (zero rows are left as they are)
+    void normalize_rows(float* data, size_t n, unsigned dim);
+
 //   class DistanceInnerProduct : public Distance{
 //   public:
 //     float compare(const float* a, const float* b, unsigned size) const {
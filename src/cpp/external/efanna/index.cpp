@@ -6,13 +6,19 @@
 #include "index.h"
 namespace efanna2e {
 Index::Index(const size_t dimension, const size_t n, Metric metric = L2)
-  : dimension_ (dimension), nd_(n), has_built(false) {
+  : dimension_ (dimension), nd_(n), has_built(false), rows_(nullptr) {
     switch (metric) {
       case L2:distance_ = new DistanceL2();
         break;
+      case INNER_PRODUCT:distance_ = new DistanceInnerProduct();
+        break;
+      case COSINE:distance_ = new DistanceCosine();
+        break;
+      case L1:distance_ = new DistanceL1();
+        break;
       default:distance_ = new DistanceL2();
         break;
     }
 }
-Index::~Index() {}
+Index::~Index() { delete distance_; }
 }
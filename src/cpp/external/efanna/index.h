@@ -43,12 +43,23 @@ class Index {
   inline size_t GetSizeOfDataset() const { return nd_; }
 
   inline const float *GetDataset() const { return data_; }
+
+  // compares rows in another form (CSR, quantized codes) instead of data_;
+  // only the id-to-id distances of IndexGraph use it
+  inline void SetRows(const RowDistance *rows) { rows_ = rows; }
  protected:
+  // distance between two indexed points
+  inline float PointDistance(unsigned a, unsigned b) const {
+    if (rows_) return rows_->compare(a, b);
+    return distance_->compare(data_ + (size_t)a * dimension_, data_ + (size_t)b * dimension_, (unsigned)dimension_);
+  }
+
   const size_t dimension_;
   const float *data_;
   size_t nd_;
   bool has_built;
   Distance* distance_;
+  const RowDistance *rows_;
 };
 
 }
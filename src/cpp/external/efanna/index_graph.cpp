@@ -9,27 +9,30 @@
 #include "parameters.h"
 #include <omp.h>
 #include <set>
+#include <algorithm>
 
 namespace efanna2e {
 #define _CONTROL_NUM 100
 IndexGraph::IndexGraph(const size_t dimension, const size_t n, Metric m, Index *initializer)
     : Index(dimension, n, m),
-      initializer_{initializer} {
+      initializer_{initializer}, search_entry_(nullptr) {
   assert(dimension == initializer->GetDimension());
 }
 IndexGraph::~IndexGraph() {}
 
-void IndexGraph::join() {
-#pragma omp parallel for default(shared) schedule(dynamic, 100)
+size_t IndexGraph::join() {
+  size_t updates = 0;
+#pragma omp parallel for default(shared) schedule(dynamic, 100) reduction(+:updates)
   for (int n = 0; n < nd_; n++) {
     graph_[n].join([&](unsigned i, unsigned j) {
       if(i != j){
-        float dist = distance_->compare(data_ + i * dimension_, data_ + j * dimension_, dimension_);
-        graph_[i].insert(j, dist);
-        graph_[j].insert(i, dist);
+        float dist = PointDistance(i, j);
+        updates += graph_[i].insert(j, dist);
+        updates += graph_[j].insert(i, dist);
       }
     });
   }
+  return updates;
 }
 void IndexGraph::update(const Parameters &parameters) {
   unsigned S = parameters.Get<unsigned>("S");
@@ -131,52 +134,63 @@ void IndexGraph::update(const Parameters &parameters) {
 
 void IndexGraph::NNDescent(const Parameters &parameters) {
   unsigned iter = parameters.Get<unsigned>("iter");
+  unsigned L = parameters.Get<unsigned>("L");
+  // the recall and the stop rule are measured on the K neighbors that are kept
+  unsigned K = std::min(L, parameters.Get<unsigned>("K", L));
+  // iter is an upper bound: the rounds stop once fewer than delta * N * K pool entries change
+  float delta = parameters.Get<float>("delta", 0.0f);
+
   std::mt19937 rng(rand());
-  std::vector<unsigned> control_points(_CONTROL_NUM);
-  std::vector<std::vector<unsigned> > acc_eval_set(_CONTROL_NUM);
+  unsigned n_control = std::min((unsigned)_CONTROL_NUM, (unsigned)nd_ - 1);
+  std::vector<unsigned> control_points(n_control);
+  std::vector<std::vector<unsigned> > acc_eval_set(n_control);
   GenRandom(rng, &control_points[0], control_points.size(), nd_);
-  generate_control_set(control_points, acc_eval_set, nd_);
-  float recall_before = -1.0;
+  generate_control_set(control_points, acc_eval_set, nd_, K);
+
+  update_counts_.clear();
+  recall_estimates_.clear();
   for (unsigned it = 0; it < iter; it++) {
-    join();
+    size_t updates = join();
     update(parameters);
     //checkDup();
-    float current_recall  = eval_recall(control_points, acc_eval_set);
-
-    if( fabs(recall_before-current_recall) <= 1e-6 ) {
-      // std::cout << "Finishing earlier, recall: " << current_recall << std::endl;
-      break;
-    }
-    recall_before = current_recall;
+    update_counts_.push_back(updates);
+    recall_estimates_.push_back(eval_recall(control_points, acc_eval_set));
 
-
-    // std::cout << "\titeration " << it << " / " << iter << std::endl;
+    if (updates <= delta * nd_ * K) break;
   }
 }
 
+// the exact K nearest neighbors of every control point, without the point itself
 void IndexGraph::generate_control_set(std::vector<unsigned> &c,
                                       std::vector<std::vector<unsigned> > &v,
-                                      unsigned N){
+                                      unsigned N, unsigned K){
+  K = std::min(K, N - 1);
 #pragma omp parallel for
   for(int i=0; i<c.size(); i++){
     std::vector<Neighbor> tmp;
     for(unsigned j=0; j<N; j++){
-      float dist = distance_->compare(data_ + c[i] * dimension_, data_ + j * dimension_, dimension_);
+      if(j == c[i])continue;
+      float dist = PointDistance(c[i], j);
       tmp.push_back(Neighbor(j, dist, true));
     }
-    std::partial_sort(tmp.begin(), tmp.begin() + _CONTROL_NUM, tmp.end());
-    for(unsigned j=0; j<_CONTROL_NUM; j++){
+    std::partial_sort(tmp.begin(), tmp.begin() + K, tmp.end());
+    for(unsigned j=0; j<K; j++){
       v[i].push_back(tmp[j].id);
     }
   }
 }
 
+// share of the exact neighbors of the control points among the closest entries of their pools
 float IndexGraph::eval_recall(std::vector<unsigned>& ctrl_points, std::vector<std::vector<unsigned> > &acc_eval_set){
   float mean_acc=0;
   for(unsigned i=0; i<ctrl_points.size(); i++){
     float acc = 0;
-    auto &g = graph_[ctrl_points[i]].pool;
     auto &v = acc_eval_set[i];
+    std::vector<Neighbor> g(graph_[ctrl_points[i]].pool);
+    if(g.size() > v.size()){
+      std::partial_sort(g.begin(), g.begin() + v.size(), g.end());
+      g.resize(v.size());
+    }
     for(unsigned j=0; j<g.size(); j++){
       for(unsigned k=0; k<v.size(); k++){
         if(g[j].id == v[k]){
@@ -196,10 +210,24 @@ float IndexGraph::eval_recall(std::vector<unsigned>& ctrl_points, std::vector<st
 }
 
 
+// candidates found on quantized codes are ordered by their exact distance before the
+// K best are kept (the pools are sorted by the callers)
+void IndexGraph::RerankPools() {
+  if (rows_ == nullptr || data_ == nullptr) return;
+
+#pragma omp parallel for schedule(dynamic, 100)
+  for (int i = 0; i < nd_; i++) {
+    for (Neighbor &nn : graph_[i].pool)
+      nn.distance = distance_->compare(data_ + (size_t)i * dimension_, data_ + (size_t)nn.id * dimension_, (unsigned)dimension_);
+  }
+}
+
 void IndexGraph::InitializeGraph(const Parameters &parameters) {
 
   const unsigned L = parameters.Get<unsigned>("L");
   const unsigned S = parameters.Get<unsigned>("S");
+  // an initializer that returns true neighbors (not random points) can fill more of the pool
+  const unsigned init = std::min(L, std::max(S, parameters.Get<unsigned>("initPool", S)));
 
   graph_.reserve(nd_);
   std::mt19937 rng(rand());
@@ -208,14 +236,14 @@ void IndexGraph::InitializeGraph(const Parameters &parameters) {
   }
 #pragma omp parallel for
   for (int i = 0; i < nd_; i++) {
-    const float *query = data_ + i * dimension_;
-    std::vector<unsigned> tmp(S + 1);
-    initializer_->Search(query, data_, S + 1, parameters, tmp.data());
+    const float *query = data_ ? data_ + i * dimension_ : nullptr;
+    std::vector<unsigned> tmp(init + 1);
+    initializer_->Search(query, data_, init + 1, parameters, tmp.data());
 
-    for (unsigned j = 0; j < S; j++) {
+    for (unsigned j = 0; j < init; j++) {
       unsigned id = tmp[j];
       if (id == i)continue;
-      float dist = distance_->compare(data_ + i * dimension_, data_ + id * dimension_, (unsigned) dimension_);
+      float dist = PointDistance(i, id);
 
       graph_[i].pool.push_back(Neighbor(id, dist, true));
     }
@@ -224,8 +252,8 @@ void IndexGraph::InitializeGraph(const Parameters &parameters) {
   }
 }
 
-void IndexGraph::InitializeGraph_Refine(const Parameters &parameters) {
-  assert(final_graph_.size() == nd_);
+void IndexGraph::InitializeGraph_Refine(std::vector<unsigned> &init_graph, unsigned width, const Parameters &parameters) {
+  assert(init_graph.size() == nd_ * width);
 
   const unsigned L = parameters.Get<unsigned>("L");
   const unsigned S = parameters.Get<unsigned>("S");
@@ -237,31 +265,31 @@ void IndexGraph::InitializeGraph_Refine(const Parameters &parameters) {
   }
 #pragma omp parallel for
   for (int i = 0; i < nd_; i++) {
-    auto& ids = final_graph_[i];
-    std::sort(ids.begin(), ids.end());
+    unsigned *ids = &init_graph[(size_t)i * width];
+    std::sort(ids, ids + width);
 
-    size_t K = ids.size();
-
-    for (unsigned j = 0; j < K; j++) {
+    for (unsigned j = 0; j < width; j++) {
       unsigned id = ids[j];
       if (id == i || (j>0 &&id == ids[j-1]))continue;
-      float dist = distance_->compare(data_ + i * dimension_, data_ + id * dimension_, (unsigned) dimension_);
+      float dist = PointDistance(i, id);
       graph_[i].pool.push_back(Neighbor(id, dist, true));
     }
     std::make_heap(graph_[i].pool.begin(), graph_[i].pool.end());
     graph_[i].pool.reserve(L);
-    // std::vector<unsigned>().swap(ids);
   }
-  // CompactGraph().swap(final_graph_);
 }
 
 
-void IndexGraph::RefineGraph(const float* data, const Parameters &parameters) {
+void IndexGraph::RefineGraph(const float* data, std::vector<unsigned> &&init_graph, unsigned width, const Parameters &parameters) {
   data_ = data;
   assert(initializer_->HasBuilt());
 
-  InitializeGraph_Refine(parameters);
+  // take over the caller's buffer and free it as soon as the pools hold the ids
+  std::vector<unsigned> ids(std::move(init_graph));
+  InitializeGraph_Refine(ids, width, parameters);
+  std::vector<unsigned>().swap(ids);
   NNDescent(parameters);
+  RerankPools();
 
   final_graph_.reserve(nd_);
 
@@ -295,6 +323,7 @@ void IndexGraph::Build(size_t n, const float *data, const Parameters &parameters
 
   InitializeGraph(parameters);
   NNDescent(parameters);
+  RerankPools();
   //RefineGraph(parameters);
 
   final_graph_.reserve(nd_);
@@ -328,13 +357,18 @@ void IndexGraph::Search(
 
   std::vector<Neighbor> retset(L+1);
   std::vector<unsigned> init_ids(L);
-  std::mt19937 rng(rand());
-  GenRandom(rng, init_ids.data(), L, (unsigned)nd_);
+  if (search_entry_) {
+    search_entry_->Search(query, x, L, parameter, init_ids.data());
+  } else {
+    std::mt19937 rng(rand());
+    GenRandom(rng, init_ids.data(), L, (unsigned)nd_);
+  }
 
   std::vector<char> flags(nd_);
   memset(flags.data(), 0, nd_ * sizeof(char));
   for(unsigned i=0; i<L; i++){
     unsigned id = init_ids[i];
+    flags[id] = 1;
     float dist = distance_->compare(data_ + dimension_*id, query, (unsigned)dimension_);
     retset[i]=Neighbor(id, dist, true);
   }
@@ -409,7 +443,7 @@ void IndexGraph::parallel_graph_insert(unsigned id, Neighbor nn, LockGraph& g, s
     g[id].pool.resize(l+1);
     g[id].pool.reserve(l+1);
     InsertIntoPool(g[id].pool.data(), (unsigned)l, nn);
-    if(g[id].pool.size() > K)g[id].pool.reserve(K);
+    if(g[id].pool.size() > K)g[id].pool.resize(K);
   }
 
 }
@@ -434,9 +468,13 @@ void IndexGraph::GraphAdd(const float* data, unsigned n_new, unsigned dim, const
       std::vector<Neighbor> res;
       get_neighbor_to_add(data + i * dim, parameters, graph_tmp, rng, res, n_new);
 
-      for(unsigned j=0; j<K; j++){
-        parallel_graph_insert(i + (unsigned)nd_, res[j], graph_tmp, K);
-        parallel_graph_insert(res[j].id, Neighbor(i + (unsigned)nd_, res[j].distance, true), graph_tmp, K);
+      // the point can be one of its own entry points
+      unsigned id = i + (unsigned)nd_;
+      for(unsigned j=0, added=0; j<res.size() - 1 && added<K; j++){
+        if(res[j].id == id)continue;
+        parallel_graph_insert(id, res[j], graph_tmp, K);
+        parallel_graph_insert(res[j].id, Neighbor(id, res[j].distance, true), graph_tmp, K);
+        added++;
       }
 
     }
@@ -448,7 +486,7 @@ void IndexGraph::GraphAdd(const float* data, unsigned n_new, unsigned dim, const
   nd_ = total;
   final_graph_.resize(total);
   for(unsigned i=0; i<total; i++){
-    for(unsigned m=0; m<K; m++){
+    for(unsigned m=0; m<K && m<graph_tmp[i].pool.size(); m++){
       final_graph_[i].push_back(graph_tmp[i].pool[m].id);
     }
   }
@@ -465,16 +503,21 @@ void IndexGraph::get_neighbor_to_add(const float* point,
 
   retset.resize(L+1);
   std::vector<unsigned> init_ids(L);
-  GenRandom(rng, init_ids.data(), L/2, n_new);
-  for(unsigned i=0; i<L/2; i++)init_ids[i] += nd_;
+  // half of the entry points are new points, unless the batch is too small to sample them
+  unsigned n_init_new = n_new > L ? L/2 : 0;
+  GenRandom(rng, init_ids.data(), n_init_new, n_new);
+  for(unsigned i=0; i<n_init_new; i++)init_ids[i] += nd_;
 
-  GenRandom(rng, init_ids.data() + L/2, L - L/2, (unsigned)nd_);
+  if(search_entry_)
+    search_entry_->Search(point, data_, L - n_init_new, parameters, init_ids.data() + n_init_new);
+  else
+    GenRandom(rng, init_ids.data() + n_init_new, L - n_init_new, (unsigned)nd_);
 
   unsigned n_total = (unsigned)nd_ + n_new;
-  std::vector<char> flags(n_new + n_total);
-  memset(flags.data(), 0, n_total * sizeof(char));
+  std::vector<char> flags(n_total, 0);
   for(unsigned i=0; i<L; i++){
     unsigned id = init_ids[i];
+    flags[id] = 1;
     float dist = distance_->compare(data_ + dimension_*id, point, (unsigned)dimension_);
     retset[i]=Neighbor(id, dist, true);
   }
@@ -516,8 +559,7 @@ void IndexGraph::compact_to_Lockgraph(LockGraph &g){
   for(unsigned i=0; i<final_graph_.size(); i++){
     g[i].pool.reserve(final_graph_[i].size()+1);
     for(unsigned j=0; j<final_graph_[i].size(); j++){
-      float dist = distance_->compare(data_ + i*dimension_,
-                                      data_ + final_graph_[i][j]*dimension_, (unsigned)dimension_);
+      float dist = PointDistance(i, final_graph_[i][j]);
       g[i].pool.push_back(Neighbor(final_graph_[i][j], dist, true));
     }
     std::vector<unsigned>().swap(final_graph_[i]);
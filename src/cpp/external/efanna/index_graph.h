@@ -40,8 +40,10 @@ class IndexGraph : public Index {
       const Parameters &parameters,
       unsigned *indices) override;
 
+  // appends the n rows that follow the nd_ indexed ones in data (L_ADD: candidate pool of a new row)
   void GraphAdd(const float* data, unsigned n, unsigned dim, const Parameters &parameters);
-  void RefineGraph(const float* data, const Parameters &parameters);
+  // runs NNDescent from init_graph, width ids per point (e.g. IndexKDtree::final_graph_, moved in)
+  void RefineGraph(const float* data, std::vector<unsigned> &&init_graph, unsigned width, const Parameters &parameters);
 
   typedef std::vector<nhood> KNNGraph;
   typedef std::vector<std::vector<unsigned > > CompactGraph;
@@ -51,19 +53,40 @@ class IndexGraph : public Index {
   KNNGraph graph_;
   CompactGraph final_graph_;
 
+  // adopts a neighbor graph over data computed elsewhere, so that Search runs without Build
+  void SetGraph(const float *data, CompactGraph &&graph) {
+    data_ = data;
+    final_graph_ = std::move(graph);
+    has_built = true;
+  }
+
+  // pool entries changed by each NNDescent round, and the recall of the pools on control points after it
+  const std::vector<size_t> &UpdateCounts() const { return update_counts_; }
+  const std::vector<float> &RecallEstimates() const { return recall_estimates_; }
+
+  // index whose Search gives the entry points of Search and GraphAdd (thread-safe, e.g. IndexRPForest); nullptr: random points
+  inline void SetSearchEntry(Index *entry) { search_entry_ = entry; }
+
  protected:
 
 
 
  private:
+  Index *search_entry_;
+  std::vector<size_t> update_counts_;
+  std::vector<float> recall_estimates_;
+
   void InitializeGraph(const Parameters &parameters);
-  void InitializeGraph_Refine(const Parameters &parameters);
+  void InitializeGraph_Refine(std::vector<unsigned> &init_graph, unsigned width, const Parameters &parameters);
   void NNDescent(const Parameters &parameters);
-  void join();
+  // recomputes the pool distances exactly from data_ after a build on approximate rows
+  void RerankPools();
+  // returns the number of pool entries that changed
+  size_t join();
   void update(const Parameters &parameters);
   void generate_control_set(std::vector<unsigned> &c,
                                       std::vector<std::vector<unsigned> > &v,
-                                      unsigned N);
+                                      unsigned N, unsigned K);
   float eval_recall(std::vector<unsigned>& ctrl_points, std::vector<std::vector<unsigned> > &acc_eval_set);
   void get_neighbor_to_add(const float* point, const Parameters &parameters, LockGraph& g,
                            std::mt19937& rng, std::vector<Neighbor>& retset, unsigned n_total);
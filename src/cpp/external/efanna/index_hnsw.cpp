@@ -0,0 +1,317 @@
+//
+// Hierarchical Navigable Small World graph index (Malkov & Yashunin, 2016).
+//
+// This source code is licensed under the MIT license.
+//
+
+#include "index_hnsw.h"
+#include "exceptions.h"
+#include "parameters.h"
+#include <omp.h>
+#include <cmath>
+#include <queue>
+#include <algorithm>
+#include <functional>
+
+namespace efanna2e {
+
+// orders a priority queue of Neighbor by increasing distance
+struct FartherFirst {
+  bool operator()(const Neighbor &a, const Neighbor &b) const { return a.distance > b.distance; }
+};
+
+IndexHNSW::IndexHNSW(const size_t dimension, const size_t n, Metric m)
+    : Index(dimension, n, m), M_(16), M0_(32), ef_construction_(100), max_level_(-1), enterpoint_(0) {}
+
+IndexHNSW::~IndexHNSW() {}
+
+void IndexHNSW::Build(size_t n, const float *data, const Parameters &parameters) {
+  data_ = data;
+  nd_ = n;
+
+  M_ = std::max(2u, parameters.Get<unsigned>("M", 16));
+  M0_ = 2 * M_;
+  ef_construction_ = std::max(M_, parameters.Get<unsigned>("efConstruction", 100));
+  unsigned seed = parameters.Get<unsigned>("seed", 0);
+
+  // levels are drawn up front, so the hierarchy does not depend on the number of threads
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  double level_mult = 1.0 / std::log((double)M_);
+
+  levels_.resize(nd_);
+  links_.assign(nd_, std::vector<LinkList>());
+  for (size_t i = 0; i < nd_; i++) {
+    levels_[i] = (int)(-std::log(std::max(uniform(rng), 1e-12)) * level_mult);
+    links_[i].resize(levels_[i] + 1);
+    links_[i][0].reserve(M0_ + 1);
+  }
+  std::vector<std::mutex> locks(nd_);
+  locks_.swap(locks);
+
+  if (nd_ == 0) {
+    has_built = true;
+    return;
+  }
+
+  enterpoint_ = 0;
+  max_level_ = levels_[0];
+
+#pragma omp parallel
+  {
+    VisitedList visited(nd_);
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 1; i < (int)nd_; i++) {
+      Insert((unsigned)i, visited);
+    }
+  }
+
+  has_built = true;
+}
+
+void IndexHNSW::Insert(unsigned id, VisitedList &visited) {
+  int level = levels_[id];
+
+  // a point above the current top layer becomes the entry point, so it holds the lock until it is linked
+  std::unique_lock<std::mutex> top_lock(enterpoint_lock_);
+  int max_level = max_level_;
+  unsigned ep = enterpoint_;
+  if (level <= max_level) top_lock.unlock();
+
+  const float *query = point(id);
+  ep = GreedyClosest(query, ep, max_level, level, true);
+
+  std::vector<Neighbor> candidates;
+  for (int l = std::min(level, max_level); l >= 0; l--) {
+    SearchLayer(query, ep, ef_construction_, l, visited, candidates, true);
+    ep = candidates[0].id;
+
+    SelectNeighbors(candidates, M_);
+    {
+      LockGuard guard(locks_[id]);
+      links_[id][l].clear();
+      for (const Neighbor &c : candidates) links_[id][l].push_back(c.id);
+    }
+
+    for (const Neighbor &c : candidates) Connect(c.id, id, l);
+  }
+
+  if (level > max_level) {
+    enterpoint_ = id;
+    max_level_ = level;
+  }
+}
+
+void IndexHNSW::CopyLinks(unsigned id, int level, LinkList &links, bool locked) {
+  if (locked) {
+    LockGuard guard(locks_[id]);
+    links = links_[id][level];
+  } else {
+    links = links_[id][level];
+  }
+}
+
+unsigned IndexHNSW::GreedyClosest(const float *query, unsigned ep, int from_level, int to_level, bool locked) {
+  float best = distance_->compare(query, point(ep), (unsigned)dimension_);
+  LinkList links;
+
+  for (int l = from_level; l > to_level; l--) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      CopyLinks(ep, l, links, locked);
+      for (unsigned candidate : links) {
+        float dist = distance_->compare(query, point(candidate), (unsigned)dimension_);
+        if (dist < best) {
+          best = dist;
+          ep = candidate;
+          changed = true;
+        }
+      }
+    }
+  }
+  return ep;
+}
+
+void IndexHNSW::SearchLayer(const float *query, unsigned ep, unsigned ef, int level, VisitedList &visited,
+                            std::vector<Neighbor> &result, bool locked) {
+  std::priority_queue<Neighbor, std::vector<Neighbor>, FartherFirst> candidates;
+  std::priority_queue<Neighbor> nearest;
+  LinkList links;
+
+  visited.reset();
+  visited.visit(ep);
+  float dist = distance_->compare(query, point(ep), (unsigned)dimension_);
+  candidates.push(Neighbor(ep, dist, true));
+  nearest.push(Neighbor(ep, dist, true));
+
+  while (!candidates.empty()) {
+    Neighbor current = candidates.top();
+    if (current.distance > nearest.top().distance && nearest.size() >= ef) break;
+    candidates.pop();
+
+    CopyLinks(current.id, level, links, locked);
+    for (unsigned candidate : links) {
+      if (!visited.visit(candidate)) continue;
+
+      dist = distance_->compare(query, point(candidate), (unsigned)dimension_);
+      if (nearest.size() < ef || dist < nearest.top().distance) {
+        candidates.push(Neighbor(candidate, dist, true));
+        nearest.push(Neighbor(candidate, dist, true));
+        if (nearest.size() > ef) nearest.pop();
+      }
+    }
+  }
+
+  result.resize(nearest.size());
+  for (size_t i = nearest.size(); i > 0; i--) {
+    result[i - 1] = nearest.top();
+    nearest.pop();
+  }
+}
+
+// keeps a candidate only if it is closer to the query than to every neighbor already kept
+void IndexHNSW::SelectNeighbors(std::vector<Neighbor> &candidates, unsigned M) {
+  if (candidates.size() <= M) return;
+
+  std::vector<Neighbor> selected;
+  selected.reserve(M);
+  for (const Neighbor &c : candidates) {
+    if (selected.size() >= M) break;
+
+    bool diverse = true;
+    for (const Neighbor &s : selected) {
+      if (distance_->compare(point(c.id), point(s.id), (unsigned)dimension_) < c.distance) {
+        diverse = false;
+        break;
+      }
+    }
+    if (diverse) selected.push_back(c);
+  }
+  candidates.swap(selected);
+}
+
+void IndexHNSW::Connect(unsigned id, unsigned neighbor, int level) {
+  unsigned max_links = level == 0 ? M0_ : M_;
+
+  LockGuard guard(locks_[id]);
+  LinkList &links = links_[id][level];
+  if (std::find(links.begin(), links.end(), neighbor) != links.end()) return;
+
+  if (links.size() < max_links) {
+    links.push_back(neighbor);
+    return;
+  }
+
+  std::vector<Neighbor> candidates;
+  candidates.reserve(links.size() + 1);
+  candidates.push_back(Neighbor(neighbor, distance_->compare(point(id), point(neighbor), (unsigned)dimension_), true));
+  for (unsigned link : links)
+    candidates.push_back(Neighbor(link, distance_->compare(point(id), point(link), (unsigned)dimension_), true));
+  std::sort(candidates.begin(), candidates.end());
+
+  SelectNeighbors(candidates, max_links);
+  links.clear();
+  for (const Neighbor &c : candidates) links.push_back(c.id);
+}
+
+void IndexHNSW::Search(const float *query, const float *x, size_t k, const Parameters &parameters, unsigned *indices) {
+  if (nd_ == 0) return;
+  if (x != nullptr) data_ = x;
+
+  unsigned ef = std::max((unsigned)k, parameters.Get<unsigned>("efSearch", 64));
+
+  VisitedList visited(nd_);
+  std::vector<Neighbor> result;
+  unsigned ep = GreedyClosest(query, enterpoint_, max_level_, 0, false);
+  SearchLayer(query, ep, ef, 0, visited, result, false);
+
+  for (size_t i = 0; i < k && i < result.size(); i++) indices[i] = result[i].id;
+}
+
+void IndexHNSW::SearchKnnGraph(size_t k, const Parameters &parameters, std::vector<std::vector<Neighbor> > &knn) {
+  unsigned ef = std::max((unsigned)k + 1, parameters.Get<unsigned>("efSearch", 64));
+
+  knn.assign(nd_, std::vector<Neighbor>());
+  if (nd_ == 0 || k == 0) return;
+
+#pragma omp parallel
+  {
+    VisitedList visited(nd_);
+    std::vector<Neighbor> result;
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < (int)nd_; i++) {
+      const float *query = point((unsigned)i);
+      unsigned ep = GreedyClosest(query, enterpoint_, max_level_, 0, false);
+      SearchLayer(query, ep, ef, 0, visited, result, false);
+
+      knn[i].reserve(k);
+      knn[i].push_back(Neighbor((unsigned)i, 0.0f, true));
+      for (size_t j = 0; j < result.size() && knn[i].size() < k; j++) {
+        if (result[j].id != (unsigned)i) knn[i].push_back(result[j]);
+      }
+
+      // a search that reaches fewer than k points (a disconnected bottom layer) is completed by a scan of every point
+      if (knn[i].size() < k && knn[i].size() < nd_) {
+        std::vector<char> seen(nd_, 0);
+        for (const Neighbor &n : knn[i]) seen[n.id] = 1;
+        std::vector<Neighbor> rest;
+        for (unsigned j = 0; j < nd_; j++) {
+          if (!seen[j]) rest.push_back(Neighbor(j, distance_->compare(query, point(j), (unsigned)dimension_), true));
+        }
+        size_t missing = std::min(k - knn[i].size(), rest.size());
+        std::partial_sort(rest.begin(), rest.begin() + missing, rest.end());
+        knn[i].insert(knn[i].end(), rest.begin(), rest.begin() + missing);
+      }
+    }
+  }
+}
+
+void IndexHNSW::Save(const char *filename) {
+  std::ofstream out(filename, std::ios::binary | std::ios::out);
+  unsigned n = (unsigned)nd_;
+  out.write((char *)&n, sizeof(unsigned));
+  out.write((char *)&M_, sizeof(unsigned));
+  out.write((char *)&max_level_, sizeof(int));
+  out.write((char *)&enterpoint_, sizeof(unsigned));
+  for (unsigned i = 0; i < n; i++) {
+    out.write((char *)&levels_[i], sizeof(int));
+    for (int l = 0; l <= levels_[i]; l++) {
+      unsigned size = (unsigned)links_[i][l].size();
+      out.write((char *)&size, sizeof(unsigned));
+      out.write((char *)links_[i][l].data(), size * sizeof(unsigned));
+    }
+  }
+  out.close();
+}
+
+// loads the graph only; the dataset is passed to Search as x
+void IndexHNSW::Load(const char *filename) {
+  std::ifstream in(filename, std::ios::binary);
+  unsigned n;
+  in.read((char *)&n, sizeof(unsigned));
+  in.read((char *)&M_, sizeof(unsigned));
+  in.read((char *)&max_level_, sizeof(int));
+  in.read((char *)&enterpoint_, sizeof(unsigned));
+  M0_ = 2 * M_;
+
+  nd_ = n;
+  levels_.resize(n);
+  links_.assign(n, std::vector<LinkList>());
+  for (unsigned i = 0; i < n; i++) {
+    in.read((char *)&levels_[i], sizeof(int));
+    links_[i].resize(levels_[i] + 1);
+    for (int l = 0; l <= levels_[i]; l++) {
+      unsigned size;
+      in.read((char *)&size, sizeof(unsigned));
+      links_[i][l].resize(size);
+      in.read((char *)links_[i][l].data(), size * sizeof(unsigned));
+    }
+  }
+  std::vector<std::mutex> locks(n);
+  locks_.swap(locks);
+  in.close();
+  has_built = true;
+}
+
+}
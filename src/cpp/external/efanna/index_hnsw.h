@@ -0,0 +1,93 @@
+//
+// Hierarchical Navigable Small World graph index (Malkov & Yashunin, 2016).
+//
+// This source code is licensed under the MIT license.
+//
+
+#ifndef EFANNA2E_INDEX_HNSW_H
+#define EFANNA2E_INDEX_HNSW_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <random>
+#include "util.h"
+#include "parameters.h"
+#include "neighbor.h"
+#include "index.h"
+
+
+namespace efanna2e {
+
+class IndexHNSW : public Index {
+ public:
+  explicit IndexHNSW(const size_t dimension, const size_t n, Metric m);
+
+
+  virtual ~IndexHNSW();
+
+  virtual void Save(const char *filename)override;
+  virtual void Load(const char *filename)override;
+
+  // parameters: M (links per node, 2*M on the bottom layer), efConstruction, seed
+  virtual void Build(size_t n, const float *data, const Parameters &parameters) override;
+
+  // parameters: efSearch (x is the indexed dataset, required after Load)
+  virtual void Search(
+      const float *query,
+      const float *x,
+      size_t k,
+      const Parameters &parameters,
+      unsigned *indices) override;
+
+  // k nearest neighbors of every indexed point (the point itself first), searched in parallel
+  void SearchKnnGraph(size_t k, const Parameters &parameters, std::vector<std::vector<Neighbor> > &knn);
+
+  typedef std::vector<unsigned> LinkList;
+
+ private:
+  // marks visited points without clearing a flag array on every search
+  struct VisitedList {
+    std::vector<unsigned> tags;
+    unsigned mark;
+
+    VisitedList(size_t n) : tags(n, 0), mark(0) {}
+    void reset() {
+      if (++mark == 0) {
+        std::fill(tags.begin(), tags.end(), 0);
+        mark = 1;
+      }
+    }
+    bool visit(unsigned id) {
+      if (tags[id] == mark) return false;
+      tags[id] = mark;
+      return true;
+    }
+  };
+
+  unsigned M_;
+  unsigned M0_;
+  unsigned ef_construction_;
+  int max_level_;
+  unsigned enterpoint_;
+
+  std::vector<int> levels_;
+  std::vector<std::vector<LinkList> > links_;   // links_[i][l]: neighbors of point i on layer l
+  std::vector<std::mutex> locks_;
+  std::mutex enterpoint_lock_;
+
+  inline const float *point(unsigned id) const { return data_ + (size_t)id * dimension_; }
+
+  void Insert(unsigned id, VisitedList &visited);
+  unsigned GreedyClosest(const float *query, unsigned ep, int from_level, int to_level, bool locked);
+  void SearchLayer(const float *query, unsigned ep, unsigned ef, int level, VisitedList &visited,
+                   std::vector<Neighbor> &result, bool locked);
+  void SelectNeighbors(std::vector<Neighbor> &candidates, unsigned M);
+  void Connect(unsigned id, unsigned neighbor, int level);
+  void CopyLinks(unsigned id, int level, LinkList &links, bool locked);
+};
+
+}
+
+#endif //EFANNA2E_INDEX_HNSW_H
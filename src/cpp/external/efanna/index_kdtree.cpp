@@ -7,6 +7,7 @@
 #include "index_kdtree.h"
 #include "exceptions.h"
 #include "parameters.h"
+#include <numeric>
 
 
 namespace efanna2e {
@@ -167,45 +168,19 @@ IndexKDtree::IndexKDtree(const size_t dimension, const size_t n, Metric m, Index
 	  }
   }
 
-	void IndexKDtree::DFStest(unsigned level, unsigned dim, Node* node){
-		if(node->Lchild !=NULL){
-			DFStest(++level, node->DivDim, node->Lchild);
-			//if(level > 15)
-			std::cout<<"dim: "<<node->DivDim<<"--cutval: "<<node->DivVal<<"--S: "<<node->StartIdx<<"--E: "<<node->EndIdx<<" TREE: "<<node->treeid<<std::endl;
-			if(node->Lchild->Lchild ==NULL){
-				std::vector<unsigned>& tmp = LeafLists[node->treeid];
-				for(unsigned i = node->Rchild->StartIdx; i < node->Rchild->EndIdx; i++){
-					const float* tmpfea =data_ + tmp[i] * dimension_+ node->DivDim;
-					std::cout<< *tmpfea <<" ";
-				}
-				std::cout<<std::endl;
-			}
-		}
-		else if(node->Rchild !=NULL){
-			DFStest(++level, node->DivDim, node->Rchild);
-		}
-		else{
-			std::cout<<"dim: "<<dim<<std::endl;
-			std::vector<unsigned>& tmp = LeafLists[node->treeid];
-			for(unsigned i = node->StartIdx; i < node->EndIdx; i++){
-				const float* tmpfea =data_ + tmp[i] * dimension_+ dim;
-				std::cout<< *tmpfea <<" ";
-			}
-			std::cout<<std::endl;
-		}
-	}
-
-
-  void IndexKDtree::getMergeLevelNodeList(Node* node, size_t treeid, int deepth){
+  void IndexKDtree::getMergeLevelNodeList(Node* node, int deepth, std::vector<Node*>& list){
 	  if(node->Lchild != NULL && node->Rchild != NULL && deepth < ml){
 		  deepth++;
-		  getMergeLevelNodeList(node->Lchild, treeid, deepth);
-		  getMergeLevelNodeList(node->Rchild, treeid, deepth);
+		  getMergeLevelNodeList(node->Lchild, deepth, list);
+		  getMergeLevelNodeList(node->Rchild, deepth, list);
 	  }else if(deepth == ml){
-		  mlNodeList.push_back(std::make_pair(node,treeid));
+		  list.push_back(node);
 	  }else{
+#pragma omp critical
+		  {
 		  error_flag = true;
 		  if(deepth < max_deepth)max_deepth = deepth;
+		  }
 	  }
   }
 
@@ -222,11 +197,29 @@ IndexKDtree::IndexKDtree(const size_t dimension, const size_t n, Metric m, Index
   }
 
 
-  void IndexKDtree::mergeSubGraphs(size_t treeid, Node* node){
+  void IndexKDtree::addNeighbor(unsigned point, unsigned id, float dist){
+	  LockGuard guard(locks_[point % LOCK_STRIPES]);
+	  Neighbor* heap = &knn_pool_[(size_t)point * K];
+	  unsigned& count = knn_count_[point];
+	  if(count == K && !(dist < heap[0].distance)) return;
+	  for(unsigned i = 0; i < count; i++){
+		  if(heap[i].id == id) return;
+	  }
+	  if(count < K){
+		  heap[count++] = Neighbor(id, dist, true);
+		  std::push_heap(heap, heap + count);
+	  }else{
+		  std::pop_heap(heap, heap + K);
+		  heap[K-1] = Neighbor(id, dist, true);
+		  std::push_heap(heap, heap + K);
+	  }
+  }
+
+  void IndexKDtree::mergeSubGraphs(const std::vector<unsigned>& ids, Node* node){
 
 	  if(node->Lchild != NULL && node->Rchild != NULL){
-		  mergeSubGraphs(treeid, node->Lchild);
-		  mergeSubGraphs(treeid, node->Rchild);
+		  mergeSubGraphs(ids, node->Lchild);
+		  mergeSubGraphs(ids, node->Rchild);
 
 		  size_t numL = node->Lchild->EndIdx - node->Lchild->StartIdx;
 		  size_t numR = node->Rchild->EndIdx - node->Rchild->StartIdx;
@@ -244,31 +237,15 @@ IndexKDtree::IndexKDtree(const size_t dimension, const size_t n, Metric m, Index
 
 		  for(;start < end; start++){
 
-			  size_t feature_id = LeafLists[treeid][start];
+			  unsigned feature_id = ids[start];
 
 			  Node* leaf = SearchToLeaf(root, feature_id);
 			  for(size_t i = leaf->StartIdx; i < leaf->EndIdx; i++){
-				  size_t tmpfea = LeafLists[treeid][i];
-				  float dist = distance_->compare(data_ + tmpfea * dimension_, data_ + feature_id * dimension_, dimension_);
-
-				  {LockGuard guard(graph_[tmpfea].lock);
-				  if(knn_graph[tmpfea].size() < K || dist < knn_graph[tmpfea].begin()->distance){
-					  Candidate c1(feature_id, dist);
-					  knn_graph[tmpfea].insert(c1);
-					  if(knn_graph[tmpfea].size() > K)
-						  knn_graph[tmpfea].erase(knn_graph[tmpfea].begin());
-				  }
-				  }
-
-				  {LockGuard guard(graph_[feature_id].lock);
-				  if(knn_graph[feature_id].size() < K || dist < knn_graph[feature_id].begin()->distance){
-					  Candidate c1(tmpfea, dist);
-					  knn_graph[feature_id].insert(c1);
-					  if(knn_graph[feature_id].size() > K)
-						  knn_graph[feature_id].erase(knn_graph[feature_id].begin());
-
-				  }
-				  }
+				  unsigned tmpfea = ids[i];
+				  float dist = distance_->compare(data_ + (size_t)tmpfea * dimension_, data_ + (size_t)feature_id * dimension_, dimension_);
+
+				  addNeighbor(tmpfea, feature_id, dist);
+				  addNeighbor(feature_id, tmpfea, dist);
 			  }
 		  }
 	  }
@@ -286,165 +263,73 @@ IndexKDtree::IndexKDtree(const size_t dimension, const size_t n, Metric m, Index
 	  unsigned N = n;
 	  unsigned seed = 1998;
 
-	  graph_.resize(N);
-	  knn_graph.resize(N);
-
-	  /*std::cout<<"TNS "<< TNS <<std::endl;
-	  std::cout<<"N "<< N <<std::endl;
-
-	  for (unsigned j = 0; j < 5; ++j) {
-		  const float* v = data_ + j * dimension_;
-		  for (size_t k=0; k<10; ++k) {
-			  std::cout<<v[k] << " ";
-		  }
-		  std::cout<<std::endl;;
-	  }*/
-
-	  //build tree
 	  unsigned TreeNum = parameters.Get<unsigned>("nTrees");
-	  unsigned TreeNumBuild = parameters.Get<unsigned>("nTrees");
 	  ml = parameters.Get<unsigned>("mLevel");
 	  K = parameters.Get<unsigned>("K");
 
-	  //std::cout<<"ml "<< ml <<std::endl;
-	  //std::cout<<"K "<< K <<std::endl;
-	  //std::cout<<"dimension "<< dimension_ <<std::endl;
+	  knn_pool_.assign((size_t)N * K, Neighbor(0, 0, true));
+	  knn_count_.assign(N, 0);
+	  std::vector<std::mutex>(LOCK_STRIPES).swap(locks_);
 
-	  std::vector<int> indices(N);
-	  LeafLists.resize(TreeNum);
-	  std::vector<Node*> ActiveSet;
-	  std::vector<Node*> NewSet;
-	  for(unsigned i = 0; i < (unsigned)TreeNum; i++){
-		  Node* node = new Node;
-		  node->DivDim = -1;
-		  node->Lchild = NULL;
-		  node->Rchild = NULL;
-		  node->StartIdx = 0;
-		  node->EndIdx = N;
-		  node->treeid = i;
-		  tree_roots_.push_back(node);
-		  ActiveSet.push_back(node);
-	  }
-
-#pragma omp parallel for
-	  for(int i = 0; i < N; i++)indices[i] = i;
-#pragma omp parallel for
-	  for(int i = 0; i < (unsigned)TreeNum; i++){
-		  std::vector<unsigned>& myids = LeafLists[i];
-		  myids.resize(N);
-		  std::copy(indices.begin(), indices.end(),myids.begin());
-		  // std::random_shuffle(myids.begin(), myids.end());
+	  // a thread builds, joins and frees one whole tree at a time, so at most one tree
+	  // per thread is alive instead of the whole forest
+#pragma omp parallel for schedule(dynamic, 1)
+	  for(int t = 0; t < (int)TreeNum; t++){
+		  std::vector<unsigned> myids(N);
+		  std::iota(myids.begin(), myids.end(), 0u);
 		  std::random_device rd;
-	      std::mt19937 g(rd());
-	      std::shuffle(myids.begin(), myids.end(), g);
-	  }
-	  omp_init_lock(&rootlock);
-	  while(!ActiveSet.empty() && ActiveSet.size() < 1100){
-#pragma omp parallel for
-		  for(int i = 0; i < ActiveSet.size(); i++){
-			  Node* node = ActiveSet[i];
-			  unsigned mid;
-			  unsigned cutdim;
-			  float cutval;
-			  std::mt19937 rng(seed ^ omp_get_thread_num());
-			  std::vector<unsigned>& myids = LeafLists[node->treeid];
-
-			  meanSplit(rng, &myids[0]+node->StartIdx, node->EndIdx - node->StartIdx, mid, cutdim, cutval);
-
-			  node->DivDim = cutdim;
-			  node->DivVal = cutval;
-			  //node->StartIdx = offset;
-			  //node->EndIdx = offset + count;
-			  Node* nodeL = new Node(); Node* nodeR = new Node();
-			  nodeR->treeid = nodeL->treeid = node->treeid;
-			  nodeL->StartIdx = node->StartIdx;
-			  nodeL->EndIdx = node->StartIdx+mid;
-			  nodeR->StartIdx = nodeL->EndIdx;
-			  nodeR->EndIdx = node->EndIdx;
-			  node->Lchild = nodeL;
-			  node->Rchild = nodeR;
-			  omp_set_lock(&rootlock);
-			  if(mid>K)NewSet.push_back(nodeL);
-			  if(nodeR->EndIdx - nodeR->StartIdx > K)NewSet.push_back(nodeR);
-			  omp_unset_lock(&rootlock);
+		  std::mt19937 g(rd());
+		  std::shuffle(myids.begin(), myids.end(), g);
+
+		  Node* root = new Node();
+		  root->treeid = t;
+		  std::mt19937 rng(seed + t);
+		  DFSbuild(root, rng, myids.data(), N, 0);
+
+		  std::vector<Node*> merge_nodes;
+		  getMergeLevelNodeList(root, 0, merge_nodes);
+		  for(size_t i = 0; i < merge_nodes.size(); i++){
+			  mergeSubGraphs(myids, merge_nodes[i]);
 		  }
-		  ActiveSet.resize(NewSet.size());
-		  std::copy(NewSet.begin(), NewSet.end(),ActiveSet.begin());
-		  NewSet.clear();
-	  }
-
-#pragma omp parallel for
-	  for(int i = 0; i < ActiveSet.size(); i++){
-		  Node* node = ActiveSet[i];
-		  //omp_set_lock(&rootlock);
-		  //std::cout<<i<<":"<<node->EndIdx-node->StartIdx<<std::endl;
-		  //omp_unset_lock(&rootlock);
-		  std::mt19937 rng(seed ^ omp_get_thread_num());
-		  std::vector<unsigned>& myids = LeafLists[node->treeid];
-		  DFSbuild(node, rng, &myids[0]+node->StartIdx, node->EndIdx-node->StartIdx, node->StartIdx);
+		  delete root;
 	  }
-	  //DFStest(0,0,tree_roots_[0]);
-	  std::cout<<"build tree completed"<<std::endl;
 
-	  for(size_t i = 0; i < (unsigned)TreeNumBuild; i++){
-		  getMergeLevelNodeList(tree_roots_[i], i ,0);
-	  }
-
-	  std::cout << "merge node list size: " << mlNodeList.size() << std::endl;
 	  if(error_flag){
 		  std::cout << "merge level deeper than tree, max merge deepth is " << max_deepth-1<<std::endl;
 	  }
-
-#pragma omp parallel for
-	  for(int i = 0; i < mlNodeList.size(); i++){
-		  mergeSubGraphs(mlNodeList[i].second, mlNodeList[i].first);
-	  }
-
-
 	  std::cout << "merge tree completed" << std::endl;
 
-	  final_graph_.reserve(nd_);
-	  std::mt19937 rng(seed ^ omp_get_thread_num());
-	  std::set<unsigned> result;
-	  for (unsigned i = 0; i < nd_; i++) {
-		  std::vector<unsigned> tmp;
-		  typename CandidateHeap::reverse_iterator it = knn_graph[i].rbegin();
-		  for(;it!= knn_graph[i].rend();it++ ){
-			  tmp.push_back(it->row_id);
-		  }
-		  if(tmp.size() < K){
-			  //std::cout << "node "<< i << " only has "<< tmp.size() <<" neighbors!" << std::endl;
-			  result.clear();
-			  size_t vlen = tmp.size();
-			  for(size_t j=0; j<vlen;j++){
-				  result.insert(tmp[j]);
-			  }
-			  while(result.size() < K){
-				  unsigned id = rng() % N;
-				  result.insert(id);
-			  }
-			  tmp.clear();
-			  std::set<unsigned>::iterator it;
-			  for(it=result.begin();it!=result.end();it++){
-				  tmp.push_back(*it);
-			  }
-			  //std::copy(result.begin(),result.end(),tmp.begin());
+	  final_graph_.assign((size_t)N * K, 0);
+#pragma omp parallel for
+	  for(int i = 0; i < (int)N; i++){
+		  Neighbor* heap = &knn_pool_[(size_t)i * K];
+		  unsigned count = knn_count_[i];
+		  unsigned* ids = &final_graph_[(size_t)i * K];
+		  std::sort_heap(heap, heap + count);
+		  for(unsigned j = 0; j < count; j++) ids[j] = heap[j].id;
+
+		  // too few leaf neighbors: pad with distinct random points (and the point itself if N < K)
+		  std::mt19937 rng(seed ^ i);
+		  while(count < K && count < N){
+			  unsigned id = rng() % N;
+			  if(std::find(ids, ids + count, id) == ids + count) ids[count++] = id;
 		  }
-		  tmp.reserve(K);
-		  final_graph_.push_back(tmp);
+		  for(; count < K; count++) ids[count] = i;
 	  }
-	  // std::vector<nhood>().swap(graph_);
+	  std::vector<Neighbor>().swap(knn_pool_);
+	  std::vector<unsigned>().swap(knn_count_);
+	  std::vector<std::mutex>().swap(locks_);
 	  has_built = true;
   }
 
 
   void IndexKDtree::Save(const char *filename) {
 	  std::ofstream out(filename, std::ios::binary | std::ios::out);
-	  assert(final_graph_.size() == nd_);
-	  unsigned GK = (unsigned) final_graph_[0].size();
+	  assert(final_graph_.size() == nd_ * K);
+	  unsigned GK = K;
 	  for (unsigned i = 0; i < nd_; i++) {
 		  out.write((char *) &GK, sizeof(unsigned));
-		  out.write((char *) final_graph_[i].data(), GK * sizeof(unsigned));
+		  out.write((char *) &final_graph_[(size_t)i * K], GK * sizeof(unsigned));
 	  }
 	  out.close();
   }
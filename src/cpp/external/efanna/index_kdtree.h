@@ -10,7 +10,7 @@
 #include <cstddef>
 #include <string>
 #include <vector>
-#include <set>
+#include <mutex>
 #include <cassert>
 #include <algorithm>
 #include <omp.h>
@@ -32,31 +32,12 @@ struct Node
 	  Node* Lchild, * Rchild;
 
 	  ~Node() {
-		  if (Lchild!=NULL) Lchild->~Node();
-		  if (Rchild!=NULL) Rchild->~Node();
+		  delete Lchild;
+		  delete Rchild;
 	  }
 
 };
 
-struct Candidate {
-    size_t row_id;
-    float distance;
-    Candidate(const size_t row_id, const float distance): row_id(row_id), distance(distance) { }
-
-    bool operator >(const Candidate& rhs) const {
-        if (this->distance == rhs.distance) {
-            return this->row_id > rhs.row_id;
-        }
-        return this->distance > rhs.distance;
-    }
-    bool operator <(const Candidate& rhs) const {
-        if (this->distance == rhs.distance) {
-            return this->row_id < rhs.row_id;
-        }
-        return this->distance < rhs.distance;
-    }
-};
-
 
 
 
@@ -80,14 +61,13 @@ class IndexKDtree : public Index {
       const Parameters &parameters,
       unsigned *indices) override;
 
- typedef std::vector<nhood> KNNGraph;
-  typedef std::vector<std::vector<unsigned > > CompactGraph;
-  typedef std::set<Candidate, std::greater<Candidate> > CandidateHeap;
+  // K neighbor ids per point, closest first (point i owns [i*K, (i+1)*K))
+  typedef std::vector<unsigned> FlatGraph;
 
   Index *initializer_;
-  KNNGraph graph_;
-  CompactGraph final_graph_;
-  std::vector<CandidateHeap> knn_graph;
+  FlatGraph final_graph_;
+
+  inline unsigned GraphWidth() const { return K; }
 
 
  protected:
@@ -110,10 +90,11 @@ class IndexKDtree : public Index {
 	  RAND_DIM=5
   };
 
-  std::vector<Node*> tree_roots_;
-  std::vector< std::pair<Node*,size_t> > mlNodeList;
-  std::vector<std::vector<unsigned>> LeafLists;
-  omp_lock_t rootlock;
+  // candidate heaps of the leaf joins, K slots per point; points share LOCK_STRIPES locks
+  enum { LOCK_STRIPES = 4096 };
+  std::vector<Neighbor> knn_pool_;
+  std::vector<unsigned> knn_count_;
+  std::vector<std::mutex> locks_;
   bool error_flag;
 
   int ml;   //merge_level
@@ -126,11 +107,11 @@ class IndexKDtree : public Index {
   void meanSplit(std::mt19937& rng, unsigned* indices, unsigned count, unsigned& index, unsigned& cutdim, float& cutval);
   void planeSplit(unsigned* indices, unsigned count, unsigned cutdim, float cutval, unsigned& lim1, unsigned& lim2);
   int selectDivision(std::mt19937& rng, float* v);
-  void getMergeLevelNodeList(Node* node, size_t treeid, int deepth);
+  void getMergeLevelNodeList(Node* node, int deepth, std::vector<Node*>& list);
   Node* SearchToLeaf(Node* node, size_t id);
-  void mergeSubGraphs(size_t treeid, Node* node);
+  void mergeSubGraphs(const std::vector<unsigned>& ids, Node* node);
+  void addNeighbor(unsigned point, unsigned id, float dist);
   void DFSbuild(Node* node, std::mt19937& rng, unsigned* indices, unsigned count, unsigned offset);
-  void DFStest(unsigned level, unsigned dim, Node* node);
 };
 
 }
@@ -0,0 +1,138 @@
+//
+// Random projection forest, used to seed the NNDescent graph with leaf neighbors.
+//
+// This source code is licensed under the MIT license.
+//
+
+#include "index_rpforest.h"
+#include "neighbor.h"
+#include <omp.h>
+#include <numeric>
+#include <algorithm>
+
+namespace efanna2e {
+
+IndexRPForest::IndexRPForest(const size_t dimension, const size_t n, Metric m)
+    : Index(dimension, n, m), leaf_size_(30) {}
+
+IndexRPForest::~IndexRPForest() {}
+
+void IndexRPForest::Build(size_t n, const float *data, const Parameters &parameters) {
+  data_ = data;
+  nd_ = n;
+
+  unsigned n_trees = std::max(1u, parameters.Get<unsigned>("nTrees", 8));
+  leaf_size_ = std::max(2u, parameters.Get<unsigned>("leafSize", 30));
+  unsigned seed = parameters.Get<unsigned>("seed", 0);
+
+  // every tree has its own stream, so the forest does not depend on the number of threads
+  trees_.assign(n_trees, Tree());
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int t = 0; t < (int)n_trees; t++) {
+    std::mt19937 rng(seed * 7919u + (unsigned)t);
+    BuildTree(trees_[t], rng);
+  }
+
+  has_built = true;
+}
+
+void IndexRPForest::BuildTree(Tree &tree, std::mt19937 &rng) {
+  tree.points.resize(nd_);
+  std::iota(tree.points.begin(), tree.points.end(), 0u);
+
+  Node root;
+  root.begin = 0;
+  root.end = (unsigned)nd_;
+  root.leaf = true;
+  tree.nodes.assign(1, root);
+
+  unsigned *points = tree.points.data();
+  std::vector<unsigned> stack(1, 0);
+  while (!stack.empty()) {
+    unsigned id = stack.back();
+    stack.pop_back();
+
+    unsigned begin = tree.nodes[id].begin, end = tree.nodes[id].end;
+    if (end - begin <= leaf_size_) continue;
+
+    unsigned a = points[begin + rng() % (end - begin)];
+    unsigned b = points[begin + rng() % (end - begin)];
+    for (int retry = 0; a == b && retry < 8; retry++) b = points[begin + rng() % (end - begin)];
+
+    unsigned split = (unsigned)(std::partition(points + begin, points + end, [&](unsigned p) {
+      return distance_->compare(point(p), point(a), (unsigned)dimension_) <
+             distance_->compare(point(p), point(b), (unsigned)dimension_);
+    }) - points);
+
+    // the pivots do not separate the points (duplicates): halve the range instead
+    if (split == begin || split == end) {
+      std::shuffle(points + begin, points + end, rng);
+      split = begin + (end - begin) / 2;
+    }
+
+    Node left, right;
+    left.begin = begin;
+    left.end = split;
+    left.leaf = true;
+    right.begin = split;
+    right.end = end;
+    right.leaf = true;
+
+    Node &node = tree.nodes[id];
+    node.pivot[0] = a;
+    node.pivot[1] = b;
+    node.child[0] = (unsigned)tree.nodes.size();
+    node.child[1] = node.child[0] + 1;
+    node.leaf = false;
+
+    stack.push_back(node.child[0]);
+    stack.push_back(node.child[1]);
+    tree.nodes.push_back(left);
+    tree.nodes.push_back(right);
+  }
+}
+
+const IndexRPForest::Node &IndexRPForest::Descend(const Tree &tree, const float *query) const {
+  const Node *node = &tree.nodes[0];
+  while (!node->leaf) {
+    bool closer_to_a = distance_->compare(query, point(node->pivot[0]), (unsigned)dimension_) <
+                       distance_->compare(query, point(node->pivot[1]), (unsigned)dimension_);
+    node = &tree.nodes[node->child[closer_to_a ? 0 : 1]];
+  }
+  return *node;
+}
+
+void IndexRPForest::Search(const float *query, const float *x, size_t k, const Parameters &parameters, unsigned *indices) {
+  if (nd_ == 0 || k == 0) return;
+
+  std::vector<unsigned> candidates;
+  for (const Tree &tree : trees_) {
+    const Node &leaf = Descend(tree, query);
+    candidates.insert(candidates.end(), tree.points.begin() + leaf.begin, tree.points.begin() + leaf.end);
+  }
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+  std::vector<Neighbor> ranked;
+  ranked.reserve(candidates.size());
+  for (unsigned id : candidates)
+    ranked.push_back(Neighbor(id, distance_->compare(query, point(id), (unsigned)dimension_), true));
+
+  size_t found = std::min(k, ranked.size());
+  std::partial_sort(ranked.begin(), ranked.begin() + found, ranked.end());
+  for (size_t i = 0; i < found; i++) indices[i] = ranked[i].id;
+
+  // too few leaf points: pad with random ones, drawn from a stream seeded by the candidates
+  // so that concurrent searches share no state
+  std::mt19937 rng(candidates.empty() ? 0 : candidates[0]);
+  for (size_t i = found; i < k && i < nd_; i++) {
+    unsigned id;
+    do {
+      id = rng() % nd_;
+    } while (std::binary_search(candidates.begin(), candidates.end(), id) ||
+             std::find(indices + found, indices + i, id) != indices + i);
+    indices[i] = id;
+  }
+}
+
+}
@@ -0,0 +1,67 @@
+//
+// Random projection forest, used to seed the NNDescent graph with leaf neighbors.
+//
+// This source code is licensed under the MIT license.
+//
+
+#ifndef EFANNA2E_INDEX_RPFOREST_H
+#define EFANNA2E_INDEX_RPFOREST_H
+
+#include <cstddef>
+#include <vector>
+#include <random>
+#include "util.h"
+#include "parameters.h"
+#include "index.h"
+
+
+namespace efanna2e {
+
+class IndexRPForest : public Index {
+ public:
+  explicit IndexRPForest(const size_t dimension, const size_t n, Metric m);
+
+
+  virtual ~IndexRPForest();
+
+  void Save(const char *filename) override {}
+  void Load(const char *filename) override {}
+
+  // parameters: nTrees, leafSize, seed
+  virtual void Build(size_t n, const float *data, const Parameters &parameters) override;
+
+  // the k closest points among the leaves reached by query in every tree (padded with random points)
+  virtual void Search(
+      const float *query,
+      const float *x,
+      size_t k,
+      const Parameters &parameters,
+      unsigned *indices) override;
+
+ private:
+  // inner nodes send a point to the child of the closer pivot (the hyperplane halfway between
+  // the two pivots); leaves own the range [begin, end) of the tree's permutation of the points
+  struct Node {
+    unsigned pivot[2];
+    unsigned child[2];
+    unsigned begin, end;
+    bool leaf;
+  };
+
+  struct Tree {
+    std::vector<Node> nodes;
+    std::vector<unsigned> points;
+  };
+
+  unsigned leaf_size_;
+  std::vector<Tree> trees_;
+
+  inline const float *point(unsigned id) const { return data_ + (size_t)id * dimension_; }
+
+  void BuildTree(Tree &tree, std::mt19937 &rng);
+  const Node &Descend(const Tree &tree, const float *query) const;
+};
+
+}
+
+#endif //EFANNA2E_INDEX_RPFOREST_H
@@ -53,11 +53,12 @@ struct nhood{
     nn_new.reserve(other.nn_new.capacity());
     pool.reserve(other.pool.capacity());
   }
-  void insert (unsigned id, float dist) {
+  // returns whether the pool changed
+  bool insert (unsigned id, float dist) {
     LockGuard guard(lock);
-    if (dist > pool.front().distance) return;
+    if (dist > pool.front().distance) return false;
     for(unsigned i=0; i<pool.size(); i++){
-      if(id == pool[i].id)return;
+      if(id == pool[i].id)return false;
     }
     if(pool.size() < pool.capacity()){
       pool.push_back(Neighbor(id, dist, true));
@@ -67,7 +68,7 @@ struct nhood{
       pool[pool.size()-1] = Neighbor(id, dist, true);
       std::push_heap(pool.begin(), pool.end());
     }
-
+    return true;
   }
 
   template <typename C>
@@ -0,0 +1,81 @@
+//
+// Rows compressed to int8 codes for approximate candidate distances.
+//
+// This source code is licensed under the MIT license.
+//
+
+#include "quantized.h"
+#include <omp.h>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace efanna2e {
+
+QuantizedRows::QuantizedRows(const float *data, size_t n, unsigned dim, Metric metric)
+    : stride_((dim + 31) / 32 * 32), metric_(metric), scale_(0), center_sqnorm_(0),
+      codes_(n * stride_, 0), offsets_(n, 0),
+      l2sqr_(simd_kernels().l2sqr_i8), dot_(simd_kernels().dot_i8), l1_(simd_kernels().l1_i8) {
+  std::vector<float> lower(dim, std::numeric_limits<float>::max());
+  std::vector<float> upper(dim, std::numeric_limits<float>::lowest());
+
+#pragma omp parallel
+  {
+    std::vector<float> local_lower(lower), local_upper(upper);
+#pragma omp for
+    for (long long i = 0; i < (long long)n; i++) {
+      const float *row = data + (size_t)i * dim;
+      for (unsigned d = 0; d < dim; d++) {
+        local_lower[d] = std::min(local_lower[d], row[d]);
+        local_upper[d] = std::max(local_upper[d], row[d]);
+      }
+    }
+#pragma omp critical
+    for (unsigned d = 0; d < dim; d++) {
+      lower[d] = std::min(lower[d], local_lower[d]);
+      upper[d] = std::max(upper[d], local_upper[d]);
+    }
+  }
+
+  // the widest dimension spans the codes -127..127
+  std::vector<float> center(dim, 0);
+  float half_range = 0;
+  for (unsigned d = 0; n > 0 && d < dim; d++) {
+    center[d] = (lower[d] + upper[d]) / 2;
+    half_range = std::max(half_range, (upper[d] - lower[d]) / 2);
+  }
+  for (unsigned d = 0; d < dim; d++) center_sqnorm_ += center[d] * center[d];
+  scale_ = half_range > 0 ? half_range / 127 : 1;
+
+#pragma omp parallel for
+  for (long long i = 0; i < (long long)n; i++) {
+    const float *row = data + (size_t)i * dim;
+    int8_t *codes = codes_.data() + (size_t)i * stride_;
+    float offset = 0;
+    for (unsigned d = 0; d < dim; d++) {
+      float q = std::round((row[d] - center[d]) / scale_);
+      codes[d] = (int8_t)std::max(-127.0f, std::min(127.0f, q));
+      offset += center[d] * codes[d];
+    }
+    offsets_[i] = offset;
+  }
+}
+
+float QuantizedRows::compare(unsigned a, unsigned b) const {
+  switch (metric_) {
+    case INNER_PRODUCT: {
+      // <x, y> = |center|^2 + scale * (offset_x + offset_y) + scale^2 * <code_x, code_y>
+      float dot = center_sqnorm_ + scale_ * (offsets_[a] + offsets_[b]) + scale_ * scale_ * dot_(code(a), code(b), stride_);
+      return 1.0f - dot;
+    }
+    case COSINE:
+      // unit rows: 1 - cos(x, y) = |x - y|^2 / 2, which has no cancellation between the offsets
+      return scale_ * scale_ * l2sqr_(code(a), code(b), stride_) / 2;
+    case L1:
+      return scale_ * l1_(code(a), code(b), stride_);
+    default:
+      return scale_ * std::sqrt(l2sqr_(code(a), code(b), stride_));
+  }
+}
+
+}
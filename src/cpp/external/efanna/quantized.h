@@ -0,0 +1,41 @@
+//
+// Rows compressed to int8 codes for approximate candidate distances.
+//
+// This source code is licensed under the MIT license.
+//
+
+#ifndef EFANNA2E_QUANTIZED_H
+#define EFANNA2E_QUANTIZED_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "distance.h"
+
+namespace efanna2e {
+
+// scalar quantization x[d] ~ center[d] + scale * code[d], with one scale shared by all
+// dimensions so the distances of two rows are integer sums over their codes
+class QuantizedRows : public RowDistance {
+ public:
+  // data is row-major n x dim (rows already normalized for COSINE)
+  QuantizedRows(const float *data, size_t n, unsigned dim, Metric metric);
+
+  // approximate distance between rows a and b, with the meaning of the dense Distance of the metric
+  float compare(unsigned a, unsigned b) const;
+
+ private:
+  inline const int8_t *code(unsigned id) const { return codes_.data() + (size_t)id * stride_; }
+
+  unsigned stride_;              // codes per row, padded with zeros to a multiple of 32
+  Metric metric_;
+  float scale_;
+  float center_sqnorm_;          // sum of center[d]^2
+  std::vector<int8_t> codes_;
+  std::vector<float> offsets_;   // per row, sum of center[d] * code[d] (inner products)
+  Int8Kernel l2sqr_, dot_, l1_;
+};
+
+}
+
+#endif //EFANNA2E_QUANTIZED_H
@@ -0,0 +1,85 @@
+//
+// Rows of a CSR matrix compared without densifying them.
+//
+// This source code is licensed under the MIT license.
+//
+
+#include "sparse.h"
+#include <omp.h>
+#include <cmath>
+#include <algorithm>
+
+namespace efanna2e {
+
+SparseRows::SparseRows(const float *data, const int *indices, const int *indptr, size_t n, Metric metric)
+    : data_(data), indices_(indices), indptr_(indptr), n_(n), metric_(metric), sqnorms_(n, 0.0) {
+#pragma omp parallel for
+  for (long long i = 0; i < (long long)n; i++) {
+    double sum = 0.0;
+    for (int j = indptr_[i]; j < indptr_[i + 1]; j++) sum += (double)data_[j] * data_[j];
+    sqnorms_[i] = sum;
+  }
+}
+
+double SparseRows::dot(unsigned a, unsigned b) const {
+  int ia = indptr_[a], ea = indptr_[a + 1];
+  int ib = indptr_[b], eb = indptr_[b + 1];
+  if (ea - ia > eb - ib) {
+    std::swap(ia, ib);
+    std::swap(ea, eb);
+  }
+
+  double sum = 0.0;
+  // a short row against a much longer one: binary search its columns instead of merging
+  if ((ea - ia) * 8 < eb - ib) {
+    const int *first = indices_ + ib, *last = indices_ + eb;
+    for (int i = ia; i < ea && first != last; i++) {
+      first = std::lower_bound(first, last, indices_[i]);
+      if (first != last && *first == indices_[i]) sum += (double)data_[i] * data_[first - indices_];
+    }
+    return sum;
+  }
+
+  while (ia < ea && ib < eb) {
+    int ca = indices_[ia], cb = indices_[ib];
+    if (ca == cb) sum += (double)data_[ia++] * data_[ib++];
+    else if (ca < cb) ia++;
+    else ib++;
+  }
+  return sum;
+}
+
+double SparseRows::l1(unsigned a, unsigned b) const {
+  int ia = indptr_[a], ea = indptr_[a + 1];
+  int ib = indptr_[b], eb = indptr_[b + 1];
+
+  double sum = 0.0;
+  while (ia < ea && ib < eb) {
+    int ca = indices_[ia], cb = indices_[ib];
+    if (ca == cb) sum += std::fabs((double)data_[ia++] - data_[ib++]);
+    else if (ca < cb) sum += std::fabs((double)data_[ia++]);
+    else sum += std::fabs((double)data_[ib++]);
+  }
+  for (; ia < ea; ia++) sum += std::fabs((double)data_[ia]);
+  for (; ib < eb; ib++) sum += std::fabs((double)data_[ib]);
+  return sum;
+}
+
+float SparseRows::compare(unsigned a, unsigned b) const {
+  switch (metric_) {
+    case INNER_PRODUCT:
+      return (float)(1.0 - dot(a, b));
+    case COSINE: {
+      double norms = sqnorms_[a] * sqnorms_[b];
+      // an empty row is at distance 1 from everything but another empty row
+      if (norms == 0.0) return sqnorms_[a] == sqnorms_[b] ? 0.0f : 1.0f;
+      return (float)std::max(0.0, 1.0 - dot(a, b) / std::sqrt(norms));
+    }
+    case L1:
+      return (float)l1(a, b);
+    default:
+      return (float)std::sqrt(std::max(0.0, sqnorms_[a] + sqnorms_[b] - 2.0 * dot(a, b)));
+  }
+}
+
+}
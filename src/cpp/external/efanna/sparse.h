@@ -0,0 +1,41 @@
+//
+// Rows of a CSR matrix compared without densifying them.
+//
+// This source code is licensed under the MIT license.
+//
+
+#ifndef EFANNA2E_SPARSE_H
+#define EFANNA2E_SPARSE_H
+
+#include <cstddef>
+#include <vector>
+#include "distance.h"
+
+namespace efanna2e {
+
+// distances between rows of a CSR matrix (column indices sorted within each row);
+// euclidean and cosine come from sparse dot products and the norms cached at construction
+class SparseRows : public RowDistance {
+ public:
+  SparseRows(const float *data, const int *indices, const int *indptr, size_t n, Metric metric);
+
+  // distance between rows a and b, with the same meaning as the dense Distance of the metric
+  float compare(unsigned a, unsigned b) const;
+
+  inline size_t size() const { return n_; }
+
+ private:
+  double dot(unsigned a, unsigned b) const;
+  double l1(unsigned a, unsigned b) const;
+
+  const float *data_;
+  const int *indices_;
+  const int *indptr_;
+  size_t n_;
+  Metric metric_;
+  std::vector<double> sqnorms_;
+};
+
+}
+
+#endif //EFANNA2E_SPARSE_H
@@ -84,6 +84,86 @@ vector<vector<double>> humap::convert_to_vector(const py::array_t<double>& v)
 
 
 
+/**
+* Wraps a dense numpy array as a Matrix without copying its values
+*
+* C-contiguous float32 and float64 arrays are read in place. Other arrays are 
+* converted to a C-contiguous float32 array first, which replaces X so the 
+* caller can keep it alive as long as the Matrix is used.
+* 
+* @param X py::array containing the dataset (n_samples x n_features)
+* @return Matrix reading the buffer of X
+*/
+umap::Matrix humap::wrap_array(py::array& X)
+{
+	bool contiguous = (X.flags() & py::array::c_style) != 0;
+
+	if( !contiguous || !(py::isinstance<py::array_t<float>>(X) || py::isinstance<py::array_t<double>>(X)) )
+		X = py::array_t<float, py::array::c_style | py::array::forcecast>::ensure(X);
+
+	if( !X || X.ndim() != 2 )
+		throw runtime_error("X must be a two-dimensional numeric array");
+
+	if( py::isinstance<py::array_t<float>>(X) )
+		return umap::Matrix((const float*) X.data(), (int) X.shape(0), (int) X.shape(1));
+	else
+		return umap::Matrix((const double*) X.data(), (int) X.shape(0), (int) X.shape(1));
+}
+
+/**
+* Wraps the arrays of a CSR matrix as a Matrix without copying their values
+*
+* float32 values and int32 indices are read in place; arrays of other types 
+* are converted and replace the arguments, which the caller keeps alive as 
+* long as the Matrix is used.
+*
+* @param data py::array with the non-zero values
+* @param indices py::array with the column of each value (sorted within each row)
+* @param indptr py::array with the n_samples+1 row offsets
+* @param n_features int representing the dimensionality
+* @return Matrix reading the CSR arrays
+*/
+umap::Matrix humap::wrap_csr(py::array& data, py::array& indices, py::array& indptr, int n_features)
+{
+	data = py::array_t<float, py::array::c_style | py::array::forcecast>::ensure(data);
+	indices = py::array_t<int, py::array::c_style | py::array::forcecast>::ensure(indices);
+	indptr = py::array_t<int, py::array::c_style | py::array::forcecast>::ensure(indptr);
+
+	if( !data || !indices || !indptr || indptr.ndim() != 1 || indptr.size() < 2 || data.size() != indices.size() )
+		throw runtime_error("X must be a CSR matrix with at least one row");
+
+	// the last row must end where the values do, or the rows would be read past the buffers
+	const int* ptr = (const int*) indptr.data();
+	if( ptr[0] != 0 || ptr[indptr.size()-1] != data.size() )
+		throw runtime_error("X must be a CSR matrix whose indptr spans its values");
+
+	return umap::Matrix((const float*) data.data(), (const int*) indices.data(), (const int*) indptr.data(), 
+						(int) indptr.size()-1, n_features);
+}
+
+/**
+* Wraps an embedding as a numpy array without copying its buffer
+*
+* The array takes ownership of the embedding, which is released when Python 
+* no longer references the array.
+*
+* @param embedding Embedding to be handed to Python
+* @return py::array_t with shape (n, dim) viewing the embedding buffer
+*/
+py::array_t<double> humap::to_array(umap::Embedding&& embedding)
+{
+	umap::Embedding* owner = new umap::Embedding(std::move(embedding));
+	py::capsule free_when_done(owner, [](void* ptr) {
+		delete reinterpret_cast<umap::Embedding*>(ptr);
+	});
+
+	return py::array_t<double>(
+		{(ssize_t) owner->size(), (ssize_t) owner->dim()},
+		{(ssize_t) (owner->dim()*sizeof(double)), (ssize_t) sizeof(double)},
+		owner->data(),
+		free_when_done);
+}
+
 /**
 * Performs depth first search on a point neighborhood
 *
@@ -137,13 +217,15 @@ int humap::HierarchicalUMAP::depth_first_search(int n_neighbors, int* neighbors,
 		}
 
 		if( landmark != -1 ) {
-			free(neighbors);
-			neighbors = 0;
+			delete[] visited;
+			delete[] neighbors_search;
 			return landmark;
 		}
 
 	}
 
+	delete[] visited;
+	delete[] neighbors_search;
 	return -1;
 }
 
@@ -270,6 +352,8 @@ void humap::HierarchicalUMAP::associate_to_landmarks(int n, int n_neighbors, int
 		if( !found ) {
 
 			count_search++;
+			for( int j = 0; j < n_neighbors; ++j )
+				neighbors[j] = cols[index*n_neighbors + j];
 			int landmark = this->depth_first_search(n_neighbors, neighbors, cols, strength, owners, is_landmark);
 			if( landmark != -1 ) {
 				strength[index] = 0;//knn_dists[landmark]
@@ -490,13 +574,13 @@ humap::SparseComponents humap::HierarchicalUMAP::sparse_similarity(int level, in
 vector<double> humap::HierarchicalUMAP::update_position(int i, vector<int>& neighbors, umap::Matrix& X)
 {
 
-	vector<double> u = X.dense_matrix[i];
+	vector<double> u = X.get_row(i);
 
 	vector<double> mean_change(X.shape(1), 0);
 	for( int j = 0; j < neighbors.size(); ++j ) {
 		int neighbor = neighbors[j];
 
-		vector<double> v = X.dense_matrix[neighbor];
+		vector<double> v = X.get_row(neighbor);
 
 		vector<double> temp(v.size(), 0.0);
 		for( int k = 0; k < temp.size(); ++k ) {
@@ -526,18 +610,14 @@ vector<double> humap::HierarchicalUMAP::update_position(int i, vector<int>& neig
 * @param vals Container representing the graph strength
 * @param cols Container representing the neighborhood
 * @param walk_length int representing the max hops in the random walk
-* @param unif uniform_real_distribution
-* @param rng default_random_engine
+* @param rng CounterRNG owned by this walk
 * @return int representing the endpoint
 */
-int humap::random_walk(int vertex, int n_neighbors, vector<double>& vals, vector<int>& cols,
-					   int walk_length, std::uniform_real_distribution<double>& unif, 
-					   std::mt19937& rng) 
+int humap::random_walk(int vertex, int n_neighbors, const vector<double>& vals, const vector<int>& cols,
+					   int walk_length, umap::CounterRNG& rng) 
 {
-	//std::srand(0);
-	int begin_vertex = vertex;
 	for( int step = 0; step < walk_length; ++step ) {
-		double c = unif(rng);
+		double c = rng.next_double();
 		
 		int next_vertex = vertex;
 		double incremental_prob = 0.0;
@@ -561,49 +641,94 @@ int humap::random_walk(int vertex, int n_neighbors, vector<double>& vals, vector
 	return vertex;
 }
 
+/**
+* Relabels the neighborhood graph used by the random walks
+*
+* @param order Container with the new vertex order (order[new] = old)
+* @param n_neighbors int representing the number of neighbors
+* @param vals Container representing the graph strength
+* @param cols Container representing the neighborhood
+* @param new_vals Container to store the graph strength in the new order
+* @param new_cols Container to store the neighborhood in the new order (with new labels)
+*/
+static void permute_neighborhood_graph(const vector<int>& order, int n_neighbors, 
+									   const vector<double>& vals, const vector<int>& cols,
+									   vector<double>& new_vals, vector<int>& new_cols)
+{
+	vector<int> rank = utils::inverse_permutation(order);
+
+	new_vals.resize(vals.size());
+	new_cols.resize(cols.size());
+
+	#pragma omp parallel for
+	for( int p = 0; p < order.size(); ++p ) {
+		size_t from = (size_t) order[p]*n_neighbors, to = (size_t) p*n_neighbors;
+		for( int it = 0; it < n_neighbors; ++it ) {
+			int col = cols[from + it];
+			new_vals[to + it] = vals[from + it];
+			new_cols[to + it] = (col >= 0 && col < rank.size()) ? rank[col] : col;
+		}
+	}
+}
+
 /**
 * Performs a markov chain in the neighborhood graph for sampling selection
 *
+* Each walk draws from its own counter-based stream (seed, vertex, walk), so 
+* the endpoints do not depend on the number of threads. When an order is 
+* given, walks run on a relabelled copy of the graph for memory locality and 
+* the result is the same as without it.
+*
 * @param knn_indices Container representing the neighborhood graph
 * @param vals Container representing the graph strength
 * @param cols Container representing the neighborhood
 * @param num_walks int representing the number of random walks
 * @param walk_length int representing the walk length
+* @param seed uint64_t representing the random state of the chain
+* @param order Container with a locality-friendly vertex order (order[new] = old), or empty
 * @return Container representing how many times each landmark was the endpoint
 */
 vector<int> humap::markov_chain(vector<vector<int>>& knn_indices, 
 								vector<double>& vals, vector<int>& cols, 
-							 	int num_walks, int walk_length, bool reproducible) 
+							 	int num_walks, int walk_length, uint64_t seed,
+							 	const vector<int>& order) 
 {	
-	vector<int> endpoint(knn_indices.size(), 0);
-
-
-	std::mt19937& rng = RandomGenerator::Instance().get();
-	std::uniform_real_distribution<double> unif(0.0, 1.0);
-
-	if( reproducible ) {
-		// #pragma omp parallel for// default(shared) 
-		for( int i = 0; i < knn_indices.size(); ++i ) {
-			// perform num_walks random walks for this vertex
-			for( int walk = 0; walk < num_walks; ++walk ) {
-				int vertex = humap::random_walk(i, knn_indices[0].size(), vals, cols, walk_length, unif, rng);
-				if( vertex != -1 )
-					endpoint[vertex]++;
-			}
-		}
-	} else {
-		#pragma omp parallel for// default(shared) 
-		for( int i = 0; i < knn_indices.size(); ++i ) {
-			// perform num_walks random walks for this vertex
-			for( int walk = 0; walk < num_walks; ++walk ) {
-				int vertex = humap::random_walk(i, knn_indices[0].size(), vals, cols, walk_length, unif, rng);
-				if( vertex != -1 )
-					endpoint[vertex]++;
+	int n_vertices = knn_indices.size();
+	int n_neighbors = knn_indices[0].size();
+
+	vector<double> local_vals;
+	vector<int> local_cols;
+	if( !order.empty() )
+		permute_neighborhood_graph(order, n_neighbors, vals, cols, local_vals, local_cols);
+
+	const vector<double>& walk_vals = order.empty() ? vals : local_vals;
+	const vector<int>& walk_cols = order.empty() ? cols : local_cols;
+
+	vector<int> endpoint(n_vertices, 0);
+
+	#pragma omp parallel for
+	for( int p = 0; p < n_vertices; ++p ) {
+		int i = order.empty() ? p : order[p];
+
+		// perform num_walks random walks for this vertex
+		for( int walk = 0; walk < num_walks; ++walk ) {
+			umap::CounterRNG rng(seed, i, walk);
+			int vertex = humap::random_walk(p, n_neighbors, walk_vals, walk_cols, walk_length, rng);
+			if( vertex != -1 ) {
+				#pragma omp atomic
+				endpoint[vertex]++;
 			}
 		}
 	}
 
-	return endpoint;
+	if( order.empty() )
+		return endpoint;
+
+	vector<int> result(n_vertices);
+	for( int p = 0; p < n_vertices; ++p )
+		result[order[p]] = endpoint[p];
+
+	return result;
 }
 
 /**
@@ -614,18 +739,15 @@ vector<int> humap::markov_chain(vector<vector<int>>& knn_indices,
 * @param vals Container representing the graph strength
 * @param cols Container representing the neighborhood
 * @param walk_length int representing the max hops in the random walk
-* @param unif uniform_real_distribution
-* @param rng default_random_engine
+* @param rng CounterRNG owned by this walk
 * @param is_landmark Container storing landmarks information
 * @return int representing the endpoint
 */
-int humap::random_walk(int vertex, int n_neighbors, vector<double>& vals, vector<int>& cols, 				
-	   				   int walk_length, uniform_real_distribution<double>& unif, 
-					   mt19937& rng, vector<int>& is_landmark)
+int humap::random_walk(int vertex, int n_neighbors, const vector<double>& vals, const vector<int>& cols, 				
+	   				   int walk_length, umap::CounterRNG& rng, const vector<int>& is_landmark)
 {
-	// std::srand(0);
 	for( int step = 0;  step < walk_length; ++step ) {
-		double c = unif(rng);
+		double c = rng.next_double();
 		int next_vertex = vertex;
 		double incremental_prob = 0.0;
 
@@ -653,6 +775,12 @@ int humap::random_walk(int vertex, int n_neighbors, vector<double>& vals, vector
 /**
 * Performs a markov chain in the neighborhood graph for constructing representation neighborhood
 *
+* Walks run in parallel over blocks of vertices and their endpoints are merged 
+* in vertex order, so the neighborhoods are the same for any number of threads.
+* When an order is given, vertices are visited (and merged) in that order on a 
+* relabelled copy of the graph for memory locality, so the counts are the same 
+* but the neighborhoods are listed in that order.
+*
 * @param knn_indices Container representing the neighborhood graph
 * @param vals Container representing the graph strength
 * @param cols Container representing the neighborhood
@@ -662,6 +790,8 @@ int humap::random_walk(int vertex, int n_neighbors, vector<double>& vals, vector
 * @param influence_neighborhood int representing how many local neighbors to add in the representation neighborhood
 * @param neighborhood Container to store the representation neighborhood
 * @param association Container to store the force of association (how many times a landmark was the endpoint of a random walks)
+* @param seed uint64_t representing the random state of the chain
+* @param order Container with a locality-friendly vertex order (order[new] = old), or empty
 * @return int with the maximum representation neighborhood
 */
 int humap::markov_chain(vector<vector<int>>& knn_indices, 
@@ -670,14 +800,8 @@ int humap::markov_chain(vector<vector<int>>& knn_indices,
 						vector<int>& landmarks, int influence_neighborhood, 
 						vector<vector<int>>& neighborhood, 
 						vector<vector<int>>& association,
-						bool reproducible)
+						uint64_t seed, const vector<int>& order)
 {	
-
-	using clock = chrono::system_clock;
-	using sec = chrono::duration<double>;
-	// std::srand(0);
-	auto begin_influence = clock::now();
-	
 	vector<int> is_landmark(knn_indices.size(), -1);
 	for( int i = 0; i < landmarks.size(); ++i ) {
 		is_landmark[landmarks[i]] = i;
@@ -686,46 +810,74 @@ int humap::markov_chain(vector<vector<int>>& knn_indices,
 	neighborhood = vector<vector<int>>(landmarks.size(), vector<int>());
 	association = vector<vector<int>>(landmarks.size(), vector<int>(knn_indices.size(), 0));
 	
-
-	std::mt19937& rng = RandomGenerator::Instance().get();
-	std::uniform_real_distribution<double> unif(0.0, 1.0);
 	int max_neighborhood = -1;
 
 	if( influence_neighborhood > 1 ) {
-		#pragma omp parallel for
 		for( int i = 0; i < knn_indices.size(); ++i ) {
 			if( is_landmark[i] != -1 )
 				continue;
 
 			for(int j = 1; j < influence_neighborhood; ++j ) {
-				#pragma omp critical
-				{
-					if( is_landmark[knn_indices[i][j]] != -1 ) {
-
-						int index = is_landmark[knn_indices[i][j]];
+				if( is_landmark[knn_indices[i][j]] != -1 ) {
 
-						neighborhood[index].push_back(i);
-						max_neighborhood = max(max_neighborhood, (int) neighborhood[index].size());
+					int index = is_landmark[knn_indices[i][j]];
 
-						association[index][i] = 1;
+					neighborhood[index].push_back(i);
+					max_neighborhood = max(max_neighborhood, (int) neighborhood[index].size());
 
-					}
+					association[index][i] = 1;
 				}
-				
 			}
 		}
 	}
 
-	if( reproducible ) {
+	int n_vertices = (int) is_landmark.size();
+	int n_neighbors = knn_indices[0].size();
+
+	vector<double> local_vals;
+	vector<int> local_cols;
+	vector<int> local_landmark;
+	if( !order.empty() ) {
+		permute_neighborhood_graph(order, n_neighbors, vals, cols, local_vals, local_cols);
+		local_landmark.resize(n_vertices);
+		for( int p = 0; p < n_vertices; ++p )
+			local_landmark[p] = is_landmark[order[p]];
+	}
 
-		for( int i = 0; i < is_landmark.size(); ++i ) {	
+	const vector<double>& walk_vals = order.empty() ? vals : local_vals;
+	const vector<int>& walk_cols = order.empty() ? cols : local_cols;
+	const vector<int>& walk_landmark = order.empty() ? is_landmark : local_landmark;
 
-			if( is_landmark[i] != -1 ) 
+	const int block_size = 4096;
+	vector<int> endpoints((size_t) min(block_size, n_vertices)*num_walks);
+
+	for( int block = 0; block < n_vertices; block += block_size ) {
+		int block_end = min(block + block_size, n_vertices);
+
+		#pragma omp parallel for 
+		for( int p = block; p < block_end; ++p ) {	
+			int i = order.empty() ? p : order[p];
+			int* out = endpoints.data() + (size_t) (p-block)*num_walks;
+
+			if( is_landmark[i] != -1 ) {
+				std::fill(out, out + num_walks, -1);
 				continue;
+			}
+
+			for( int walk = 0; walk < num_walks; ++walk ) {
+				umap::CounterRNG rng(seed, i, walk);
+				int vertex = humap::random_walk(p, n_neighbors, walk_vals, walk_cols, walk_length, rng, walk_landmark);
+				out[walk] = (vertex == -1 || order.empty()) ? vertex : order[vertex];
+			}
+		}
+
+		for( int p = block; p < block_end; ++p ) {
+			int i = order.empty() ? p : order[p];
+			const int* out = endpoints.data() + (size_t) (p-block)*num_walks;
 
 			for( int walk = 0; walk < num_walks; ++walk ) {
-				int vertex = humap::random_walk(i, knn_indices[0].size(), vals, cols, walk_length, unif, rng, is_landmark);
-				if(  vertex != -1 ) {				
+				int vertex = out[walk];
+				if( vertex != -1 ) {				
 					int index = is_landmark[vertex];
 					if( !association[index][i] ) {
 						neighborhood[index].push_back(i);
@@ -735,34 +887,8 @@ int humap::markov_chain(vector<vector<int>>& knn_indices,
 				} 
 			}
 		}
-
-	} else {
-
-		#pragma omp parallel for 
-		for( int i = 0; i < is_landmark.size(); ++i ) {	
-
-			if( is_landmark[i] != -1 ) 
-				continue;
-
-			for( int walk = 0; walk < num_walks; ++walk ) {
-				int vertex = humap::random_walk(i, knn_indices[0].size(), vals, cols, walk_length, unif, rng, is_landmark);
-				#pragma omp critical(update_information)
-				{
-					if(  vertex != -1 ) {				
-						int index = is_landmark[vertex];
-						if( !association[index][i] ) {
-							neighborhood[index].push_back(i);
-							max_neighborhood = max(max_neighborhood, (int) neighborhood[index].size());
-						} 
-						association[index][i]++;
-					} 	
-				}
-			}
-		}
 	}
 
-	
-
 	return max_neighborhood;
 }
 
@@ -773,7 +899,43 @@ int humap::markov_chain(vector<vector<int>>& knn_indices,
 * @param X py::array_t with the dataset
 * @param y py::array_t with the labels
 */
-void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
+void humap::HierarchicalUMAP::fit(py::array X, py::array_t<int> y)
+{
+	umap::Matrix first_level = humap::wrap_array(X);
+	this->input_data = X;
+
+	this->fit_levels(first_level, y);
+}
+
+/**
+* Fits the hierarchy on a sparse dataset in CSR form
+*
+* The first level keeps X sparse: its kNN graph comes from NNDescent over 
+* sparse dot products, so memory and time grow with the non-zero values.
+*
+* @param data py::array with the non-zero values
+* @param indices py::array with the column of each value (sorted within each row)
+* @param indptr py::array with the n_samples+1 row offsets
+* @param n_features int representing the dimensionality
+* @param y py::array_t with the labels
+*/
+void humap::HierarchicalUMAP::fit_csr(py::array data, py::array indices, py::array indptr, int n_features, py::array_t<int> y)
+{
+	umap::Matrix first_level = humap::wrap_csr(data, indices, indptr, n_features);
+	this->input_data = data;
+	this->input_indices = indices;
+	this->input_indptr = indptr;
+
+	this->fit_levels(first_level, y);
+}
+
+/**
+* Builds the hierarchy levels
+*
+* @param first_level Matrix with the whole dataset
+* @param y py::array_t with the labels
+*/
+void humap::HierarchicalUMAP::fit_levels(umap::Matrix first_level, py::array_t<int> y)
 {
 	std::srand(this->random_state);
 
@@ -783,11 +945,6 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
 
 	auto hierarchy_before = clock::now();
 
-
-	auto before = clock::now();
-	umap::Matrix first_level(humap::convert_to_vector(X));
-	sec duration = clock::now() - before;
-
 	this->hierarchy_X.push_back(first_level);
 	this->dense_backup.push_back(first_level);
 	this->hierarchy_y.push_back(vector<int>((int*)y.request().ptr, (int*)y.request().ptr + y.request().shape[0]));
@@ -798,17 +955,27 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
 								"Level 0 with "  + std::to_string(first_level.size()) + " data samples.\n"+
 								"Fitting the first hierarchy level... ");
 	
-	umap::UMAP reducer = umap::UMAP("euclidean", this->n_neighbors, this->min_dist, this->knn_algorithm, this->init, this->reproducible);
+	// older wrappers passed 'precomputed' here, which always meant euclidean
+	string metric = this->similarity_method == "precomputed" ? "euclidean" : this->similarity_method;
+	if( !umap::is_supported_metric(metric) )
+		throw runtime_error("Unknown metric " + metric + " (use euclidean, cosine, inner_product or manhattan)");
+
+	umap::UMAP reducer = umap::UMAP(metric, this->n_neighbors, this->min_dist, this->knn_algorithm, this->init, this->reproducible);
 	reducer.set_ab_parameters(this->a, this->b);
+	reducer.set_random_state(this->random_state);
+	reducer.set_fast_gradient(this->fast_gradient);
+	reducer.set_knn_cache(this->knn_cache);
+	reducer.set_knn_quantization(this->knn_quantization);
+	reducer.set_knn_target_recall(this->knn_target_recall);
 	
 	dump_info("Step,Level,Points,Runtime\n");
 
-	before = clock::now();
+	auto before = clock::now();
 	/**
 		Basically, computes the knn and indices the graph of strengths
 	*/
 	reducer.fit(this->hierarchy_X[0]);
-	duration = clock::now() - before;
+	sec duration = clock::now() - before;
 	utils::log(this->verbose, "\ndone in " + std::to_string(duration.count()) + " seconds.\n");
 	this->reducers.push_back(reducer);
 	
@@ -826,6 +993,37 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
 	Eigen::SparseMatrix<double, Eigen::RowMajor> graph = this->reducers[0].get_graph();
 	vector<vector<double>> knn_dists = this->reducers[0].knn_dists();
 
+	this->build_levels();
+
+	sec hierarchy_duration = clock::now() - hierarchy_before;
+	utils::log(this->verbose, "\nHierarchy construction in " + std::to_string(hierarchy_duration.count()) + " seconds.\n\n");
+
+	if( this->output_filename != "" ) {
+		this->output_file.close();
+	}
+}
+
+/**
+* Builds the hierarchy levels above the first one
+*
+* The landmarks of a level are the most visited endpoints of random walks on the 
+* level below it. The drift measured by insert starts from this selection.
+*/
+void humap::HierarchicalUMAP::build_levels()
+{
+	using clock = chrono::system_clock;
+	using sec = chrono::duration<double>;
+
+	// an inserted row drifts when its closest row of this selection is farther than 90% of the rows are from theirs
+	vector<double> rhos = this->reducers[0].rhos();
+	if( !rhos.empty() ) {
+		int quantile = (int) (0.9*(rhos.size()-1));
+		std::nth_element(rhos.begin(), rhos.begin() + quantile, rhos.end());
+		this->drift_radius = rhos[quantile];
+	}
+	this->drift_base = this->hierarchy_X[0].size();
+	this->drifted = 0;
+
 	for( int level = 0; level < this->percents.size(); ++level ) {
 
 		auto level_before = clock::now();
@@ -837,6 +1035,16 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
 										"Level " + std::to_string(level+1) + ": " + std::to_string(n_elements) + " data samples.");
 
 
+		// locality-friendly order of the neighborhood graph for the random walks
+		vector<int> walk_order;
+		if( this->reorder ) {
+			int k = this->reducers[level].knn_indices()[0].size();
+			vector<int> ptr(this->reducers[level].knn_indices().size() + 1);
+			for( int i = 0; i < ptr.size(); ++i )
+				ptr[i] = i*k;
+			walk_order = utils::reverse_cuthill_mckee(ptr.size()-1, ptr.data(), this->reducers[level].cols.data());
+		}
+
 		/*
 			COMPUTING RANDOM WALK FOR SAMPLING SELETION
  		*/
@@ -848,7 +1056,8 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
  										this->reducers[level].vals_transition, 
  										this->reducers[level].cols,
 										this->landmarks_nwalks, 
-										this->landmarks_wl, this->reproducible); 
+										this->landmarks_wl, umap::CounterRNG(this->random_state, level, 0).next(),
+										walk_order); 
 
  		sec end_random_walk = clock::now() - begin_random_walk;
 		utils::log(this->verbose, "done in " + std::to_string(end_random_walk.count()) + " seconds.\n");
@@ -883,7 +1092,8 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
 										    this->reducers[level].cols,
 										    this->influence_nwalks, this->influence_wl,  
 										    inds_lands, this->influence_neighborhood,
-										    neighborhood, association, this->reproducible);
+										    neighborhood, association, umap::CounterRNG(this->random_state, level, 1).next(),
+										    walk_order);
 
  		sec influence_time = clock::now() - influence_begin;
 		utils::log(this->verbose, "done in " + std::to_string(influence_time.count()) + " seconds.\n");
@@ -925,8 +1135,10 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
 															greatest, neighborhood, max_incidence, association); 	
 		vector<utils::SparseData> sparse = humap::create_sparse(n_elements, triplets.rows, triplets.cols, triplets.vals);
 		data = umap::Matrix(sparse, greatest.size());
-		reducer = umap::UMAP("precomputed", this->n_neighbors, this->min_dist, this->knn_algorithm, this->init, this->reproducible);
+		umap::UMAP reducer = umap::UMAP("precomputed", this->n_neighbors, this->min_dist, this->knn_algorithm, this->init, this->reproducible);
 		reducer.set_ab_parameters(this->a, this->b);
+		reducer.set_random_state(this->random_state);
+		reducer.set_fast_gradient(this->fast_gradient);
 
 		sec similarity_after = clock::now() - similarity_before;
 		utils::log(this->verbose, "done in "  + std::to_string(similarity_after.count()) + " seconds.\n");
@@ -1018,15 +1230,9 @@ void humap::HierarchicalUMAP::fit(py::array_t<double> X, py::array_t<int> y)
 
 	}
 
-	sec hierarchy_duration = clock::now() - hierarchy_before;
-	utils::log(this->verbose, "\nHierarchy construction in " + std::to_string(hierarchy_duration.count()) + " seconds.\n\n");
-
-	for( int i = 0; i < this->hierarchy_X.size(); ++i ) {
-		this->embeddings.push_back(vector<vector<double>>());
-	}
-
-	if( this->output_filename != "" ) {
-		this->output_file.close();
+	for( int i = this->embeddings.size(); i < this->hierarchy_X.size(); ++i ) {
+		this->embeddings.push_back(umap::Embedding());
+		this->embedded_indices.push_back(vector<int>());
 	}
 }
 
@@ -1051,9 +1257,259 @@ py::array_t<double> humap::HierarchicalUMAP::transform(int level)
 		}
 	}
 
-	vector<vector<double>> result = this->embed_data(level, this->reducers[level].get_graph(), this->hierarchy_X[level]);
+	vector<int> indices(this->metadata[level].size);
+	for( int i = 0; i < indices.size(); ++i )
+		indices[i] = i;
+
+	// owner of every point in the level above
+	vector<int> coarse;
+	if( level+1 < this->hierarchy_X.size() )
+		coarse = this->metadata[level].indices;
+
+	umap::Embedding embedding = this->embed_data(level, this->reducers[level].get_graph(), this->hierarchy_X[level], coarse);
+	this->remember_embedding(level, embedding, indices);
+
+	return humap::to_array(std::move(embedding));
+}
+
+/**
+* Places new rows into the last embedding of a hierarchy level
+*
+* The new rows are searched on the level-0 knn graph. Their memberships use
+* the sigma and rho of each fitted neighbor, exp(-(d - rho_j)/sigma_j), and a
+* neighbor below the level counts for the landmark that owns it in the level.
+* Every new row starts at the weighted mean of its neighbors and moves during
+* n_epochs/3 epochs of SGD, while the points of the level stay fixed. The
+* fitted hierarchy and its embeddings are left untouched.
+*
+* @param X py::array with the new rows (dense, with the features of the fitted data)
+* @param level int representing the hierarchy level, embedded by transform beforehand
+* @return py::array_t with the positions of the new rows
+*/
+py::array_t<double> humap::HierarchicalUMAP::transform_new(py::array X, int level)
+{
+	if( this->hierarchy_X.empty() )
+		throw runtime_error("The hierarchy must be fitted before transform_new.");
+	if( level >= this->hierarchy_X.size() || level < 0 )
+		throw runtime_error("Level out of bounds.");
+	if( this->embeddings[level].size() == 0 )
+		throw runtime_error("Level " + std::to_string(level) + " has no embedding yet, call transform first.");
+
+	umap::Matrix Q = humap::wrap_array(X);
+	string metric = this->similarity_method == "precomputed" ? "euclidean" : this->similarity_method;
+
+	vector<vector<int>> knn_indices;
+	vector<vector<double>> knn_dists;
+	tie(knn_indices, knn_dists) = umap::query_nearest_neighbors(this->hierarchy_X[0], this->reducers[0].knn_indices(), 
+																Q, this->n_neighbors, metric);
+
+	const umap::Embedding& fitted = this->embeddings[level];
+	int dim = fitted.dim();
+	int n = Q.shape(0);
+
+	vector<int> row_of(this->metadata[level].size, -1);
+	for( int r = 0; r < this->embedded_indices[level].size(); ++r )
+		row_of[this->embedded_indices[level][r]] = r;
+
+	vector<double> sigmas = this->reducers[0].sigmas();
+	vector<double> rhos = this->reducers[0].rhos();
+
+	vector<double> center(dim, 0.0);
+	for( int r = 0; r < fitted.size(); ++r )
+		for( int d = 0; d < dim; ++d )
+			center[d] += fitted.row(r)[d]/fitted.size();
+
+	// edges from the new rows (head) to the rows of the fitted embedding (tail)
+	vector<vector<pair<int, double>>> edges(n);
+	umap::Embedding embedding(n, dim);
+
+	#pragma omp parallel for
+	for( int i = 0; i < n; ++i ) {
+		map<int, double> strength;
+		for( int j = 0; j < knn_indices[i].size(); ++j ) {
+			int p = knn_indices[i][j];
+			double sigma = max(sigmas[p], 1e-12);
+			double weight = exp(-max(0.0, knn_dists[i][j] - rhos[p])/sigma);
+
+			for( int l = 0; l < level && p != -1; ++l )
+				p = this->metadata[l].owners[p] == -1 ? -1 : this->metadata[l].indices[p];
+			if( p != -1 && row_of[p] != -1 && weight > 0.0 )
+				strength[row_of[p]] += weight;
+		}
+
+		double* point = embedding.row(i);
+		double total = 0.0;
+		std::fill(point, point + dim, 0.0);
+		for( auto& edge : strength ) {
+			edges[i].push_back(edge);
+			total += edge.second;
+			for( int d = 0; d < dim; ++d )
+				point[d] += edge.second*fitted.row(edge.first)[d];
+		}
+
+		for( int d = 0; d < dim; ++d )
+			point[d] = total > 0.0 ? point[d]/total : center[d];
+	}
+
+	int epochs = this->n_epochs > 0 ? max(1, this->n_epochs/3) : (n <= 10000 ? 100 : 30);
+
+	double max_weight = 0.0;
+	for( int i = 0; i < n; ++i )
+		for( auto& edge : edges[i] )
+			max_weight = max(max_weight, edge.second);
+
+	// as in embed_data, edges too weak to be sampled in the epochs are dropped
+	vector<int> head, tail;
+	vector<double> weights;
+	for( int i = 0; i < n; ++i ) {
+		for( auto& edge : edges[i] ) {
+			if( edge.second < max_weight/epochs )
+				continue;
+			head.push_back(i);
+			tail.push_back(edge.first);
+			weights.push_back(edge.second);
+		}
+	}
+
+	if( weights.empty() )
+		return humap::to_array(std::move(embedding));
+
+	umap::UMAP& reducer = this->reducers[level];
+	vector<double> epochs_per_sample = reducer.make_epochs_per_sample(weights, epochs);
+
+	umap::Embedding tail_embedding = fitted;
+	reducer.verbose = this->verbose;
+	reducer.set_free_datapoints(vector<bool>(n, true));
+	reducer.set_convergence_tolerance(this->convergence_tol, this->convergence_patience);
+	reducer.set_repulsion(this->repulsion, this->theta);
+	// the fitted points stay where they are, even when the batch is as large as the level
+	reducer.optimize_layout_euclidean(embedding, tail_embedding, head, tail, epochs, tail_embedding.size(), epochs_per_sample, false);
+	reducer.set_free_datapoints(vector<bool>());
+
+	this->stopping_epoch = reducer.stopping_epoch();
+	this->convergence_curve = reducer.convergence_curve();
+
+	return humap::to_array(std::move(embedding));
+}
+
+/**
+* Appends new rows to the first level of the fitted hierarchy
+*
+* The knn graph of the first level is extended to the new rows (UMAP::insert), 
+* which also updates sigma and rho of the rows whose neighbors changed. Each new 
+* row is associated to the landmark of one of its neighbors, updating the 
+* influence of the landmarks. A new row drifts when its closest row of the last 
+* landmark selection is farther than 90% of those rows are from their closest 
+* neighbors (or is not among its neighbors at all). Once the drifted rows exceed 
+* drift_threshold of the first level at the selection, the levels above the first 
+* one are built again from the updated knn graph. The embedding of the first level
+* is kept, without the new rows; the others must be computed again by transform.
+*
+* @param X py::array with the new rows (dense, with the features of the fitted data)
+* @param y py::array_t with the labels of the new rows
+* @return bool indicating whether the landmarks were selected again
+*/
+bool humap::HierarchicalUMAP::insert(py::array X, py::array_t<int> y)
+{
+	if( this->hierarchy_X.empty() )
+		throw runtime_error("HierarchicalUMAP is not fitted");
+	if( this->hierarchy_X[0].is_sparse() || this->hierarchy_X[0].is_csr() )
+		throw runtime_error("Inserting rows requires a dense fit");
+
+	umap::Matrix Q = humap::wrap_array(X);
+	if( Q.shape(1) != this->hierarchy_X[0].shape(1) )
+		throw runtime_error("New rows have " + to_string(Q.shape(1)) + " features, the fitted data has " + 
+							to_string(this->hierarchy_X[0].shape(1)));
+	if( y.request().shape[0] != Q.shape(0) )
+		throw runtime_error("The labels do not match the new rows");
+
+	int n_old = this->hierarchy_X[0].size();
+	int n = n_old + Q.shape(0);
+	if( n == n_old )
+		return false;
+
+	// the first level reads a single buffer, so the new rows are appended to a buffer that doubles 
+	// its capacity when full: a stream of batches copies each row a constant number of times on average
+	py::module np = py::module::import("numpy");
+	py::array rows = np.attr("ascontiguousarray")(X, this->input_data.dtype()).cast<py::array>();
+	size_t row_bytes = (size_t) Q.shape(1) * this->input_data.itemsize();
+
+	bool reusable = this->input_buffer.ndim() == 2 && this->input_buffer.shape(0) >= n && 
+					this->input_buffer.data() == this->input_data.data() && this->input_buffer.dtype().is(this->input_data.dtype());
+	if( !reusable ) {
+		py::array grown(this->input_data.dtype(), {(ssize_t) max(n, 2*n_old), (ssize_t) Q.shape(1)});
+		memcpy(grown.mutable_data(), this->input_data.data(), (size_t) n_old * row_bytes);
+		this->input_buffer = grown;
+	}
+	memcpy((char*) this->input_buffer.mutable_data() + (size_t) n_old * row_bytes, rows.data(), (size_t) (n - n_old) * row_bytes);
+
+	this->input_data = this->input_buffer[py::slice(0, n, 1)].cast<py::array>();
+	this->hierarchy_X[0] = humap::wrap_array(this->input_data);
+	this->dense_backup[0] = this->hierarchy_X[0];
+
+	this->reducers[0].insert(this->hierarchy_X[0]);
+	if( !this->_sigmas.empty() )
+		this->_sigmas[0] = this->reducers[0].sigmas();
+
+	const int* labels = (const int*) y.request().ptr;
+	this->hierarchy_y[0].insert(this->hierarchy_y[0].end(), labels, labels + (n - n_old));
+
+	Metadata& first = this->metadata[0];
+	for( int i = n_old; i < n; ++i ) {
+		first.indices.push_back(i);
+		first.owners.push_back(-1);
+		first.strength.push_back(-1.0);
+		first.association.push_back(vector<int>());
+		this->original_indices[0].push_back(i);
+	}
+	first.size = n;
+
+	vector<vector<int>>& knn_indices = this->reducers[0].knn_indices();
+	vector<vector<double>>& knn_dists = this->reducers[0].knn_dists();
+	for( int i = n_old; i < n; ++i ) {
+		int j = 1;
+		while( j < knn_indices[i].size() && knn_indices[i][j] >= this->drift_base )
+			++j;
+		if( j == knn_indices[i].size() || knn_dists[i][j] > this->drift_radius )
+			this->drifted++;
+	}
+
+	if( this->hierarchy_X.size() == 1 )
+		return false;
+
+	if( this->get_drift() > this->drift_threshold ) {
+		utils::log(this->verbose, "Drift of " + std::to_string(this->get_drift()) + ", selecting the landmarks again...\n");
+
+		vector<int> indices(n, 0);
+		iota(indices.begin(), indices.end(), 0);
+		this->metadata.clear();
+		this->metadata.push_back(humap::Metadata(indices, vector<int>(n, -1), vector<double>(n, -1.0), vector<vector<int>>(n), n));
+
+		this->reducers.erase(this->reducers.begin() + 1, this->reducers.end());
+		this->hierarchy_X.erase(this->hierarchy_X.begin() + 1, this->hierarchy_X.end());
+		this->hierarchy_y.erase(this->hierarchy_y.begin() + 1, this->hierarchy_y.end());
+		this->original_indices.erase(this->original_indices.begin() + 1, this->original_indices.end());
+		this->embeddings.erase(this->embeddings.begin() + 1, this->embeddings.end());
+		this->embedded_indices.erase(this->embedded_indices.begin() + 1, this->embedded_indices.end());
+		this->level_landmarks.clear();
+		this->_sigmas.clear();
+		this->_indices.clear();
+
+		this->build_levels();
+		return true;
+	}
+
+	vector<int> is_landmark(n, -1);
+	for( int i = 0; i < this->_indices[0].size(); ++i )
+		is_landmark[this->_indices[0][i]] = i;
+
+	vector<int> new_rows(n - n_old);
+	iota(new_rows.begin(), new_rows.end(), n_old);
+	this->associate_to_landmarks(new_rows.size(), this->n_neighbors, new_rows.data(), this->reducers[0].cols,
+								 first.strength, first.owners, first.indices, first.association, first.count_influence, 
+								 is_landmark, knn_dists);
 
-	return py::cast(result);
+	return false;
 }
 
 /**
@@ -1167,7 +1623,7 @@ py::array_t<int> humap::HierarchicalUMAP::get_labels(int level)
 }
 
 /**
-* Gets the embedding of a hierarchy level
+* Gets the last embedding computed for a hierarchy level (by transform or by a projection)
 *
 * @param level int representing the hierarchy level
 * @return py::array_t with the embedding
@@ -1177,7 +1633,7 @@ py::array_t<double> humap::HierarchicalUMAP::get_embedding(int level)
 	if( level >= this->hierarchy_X.size() || level < 0 )
 		throw new runtime_error("Level out of bounds.");
 
-	return py::cast(this->embeddings[level]);
+	return humap::to_array(umap::Embedding(this->embeddings[level]));
 }	
 
 /**
@@ -1203,9 +1659,11 @@ Eigen::SparseMatrix<double, Eigen::RowMajor> humap::HierarchicalUMAP::get_data(i
 * @param level int representing the hierarchy level
 * @param graph Eigen::SparseMatrix representing the graph forces
 * @param X Matrix representing the subset of data
-* @return Container with embed data
+* @param coarse Container with the index of the owner of each row in level+1 (empty for no warm start)
+* @return Embedding with embed data
 */
-vector<vector<double>> humap::HierarchicalUMAP::embed_data(int level, Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, umap::Matrix& X)
+umap::Embedding humap::HierarchicalUMAP::embed_data(int level, Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, umap::Matrix& X, 
+													const vector<int>& coarse)
 {
 	using clock = chrono::system_clock;
 	using sec = chrono::duration<double>;
@@ -1237,15 +1695,21 @@ vector<vector<double>> humap::HierarchicalUMAP::embed_data(int level, Eigen::Spa
 	}
 	
 	auto tic = clock::now();
-	vector<vector<double>> embedding = this->reducers[level].spectral_layout(X, graph, this->n_components);
+	umap::Embedding embedding = this->reducers[level].spectral_layout(X, graph, this->n_components);
+
+	// coarse-to-fine initialization, which only needs a fraction of the epochs
+	bool warm = this->warm_start && this->prolongate(level, coarse, embedding);
+	int layout_epochs = warm ? max(1, (int) (this->n_epochs*this->warm_start_epochs)) : this->n_epochs;
 	sec toc = clock::now() - tic; 
     
 	this->reducers[level].set_free_datapoints(this->free_datapoints);
 	this->reducers[level].set_fixing_term(this->_fixing_term);
+	this->reducers[level].set_convergence_tolerance(this->convergence_tol, this->convergence_patience);
+	this->reducers[level].set_repulsion(this->repulsion, this->theta);
 
 	if( this->free_datapoints.size() != 0 ) {
 		for( int i = 0; i < this->indices_fixed.size(); ++i ) {
-			embedding[this->indices_fixed[i]] = this->fixed_datapoints[i];
+			std::copy(this->fixed_datapoints[i].begin(), this->fixed_datapoints[i].end(), embedding.row(this->indices_fixed[i]));
 		}
 	}
 
@@ -1256,40 +1720,59 @@ vector<vector<double>> humap::HierarchicalUMAP::embed_data(int level, Eigen::Spa
 
 
 	
+	// locality-friendly vertex order (Reverse Cuthill-McKee) for the layout optimization
+	vector<int> order;
+	Eigen::SparseMatrix<double, Eigen::RowMajor> reordered_graph;
+	if( this->reorder ) {
+		order = utils::reverse_cuthill_mckee(graph.rows(), graph.outerIndexPtr(), graph.innerIndexPtr());
+		vector<int> rank = utils::inverse_permutation(order);
+
+		vector<Eigen::Triplet<double>> triplets;
+		triplets.reserve(graph.nonZeros());
+		for( int i = 0; i < graph.outerSize(); ++i )
+			for( Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(graph, i); it; ++it )
+				triplets.push_back(Eigen::Triplet<double>(rank[it.row()], rank[it.col()], it.value()));
+
+		reordered_graph.resize(graph.rows(), graph.cols());
+		reordered_graph.setFromTriplets(triplets.begin(), triplets.end());
+
+		umap::Embedding reordered(embedding.size(), embedding.dim());
+		for( int p = 0; p < order.size(); ++p )
+			std::copy(embedding.row(order[p]), embedding.row(order[p]) + embedding.dim(), reordered.row(p));
+		embedding = std::move(reordered);
+
+		if( this->free_datapoints.size() != 0 ) {
+			vector<bool> free_datapoints(order.size());
+			for( int p = 0; p < order.size(); ++p )
+				free_datapoints[p] = this->free_datapoints[order[p]];
+			this->reducers[level].set_free_datapoints(free_datapoints);
+		}
+	}
+
 	vector<int> rows, cols;
 	vector<double> data;	
-	tie(rows, cols, data) = utils::to_row_format(graph);
+	tie(rows, cols, data) = utils::to_row_format(this->reorder ? reordered_graph : graph);
 	
-	vector<double> epochs_per_sample = this->reducers[level].make_epochs_per_sample(data, this->n_epochs);
+	vector<double> epochs_per_sample = this->reducers[level].make_epochs_per_sample(data, layout_epochs);
 	
-	vector<double> min_vec, max_vec;
-	for( int j = 0; j < this->n_components; ++j ) {
-
-		min_vec.push_back((*min_element(embedding.begin(), embedding.end(), 
-			[j](vector<double> a, vector<double> b) {							
-				return a[j] < b[j];
-			}))[j]);
-		max_vec.push_back((*max_element(embedding.begin(), embedding.end(), 
-			[j](vector<double> a, vector<double> b) {
-				return a[j] < b[j];
-			}))[j]);
+	vector<double> min_vec(this->n_components, numeric_limits<double>::max());
+	vector<double> max_vec(this->n_components, numeric_limits<double>::lowest());
+	for( int i = 0; i < embedding.size(); ++i ) {
+		const double* point = embedding.row(i);
+		for( int j = 0; j < this->n_components; ++j ) {
+			min_vec[j] = min(min_vec[j], point[j]);
+			max_vec[j] = max(max_vec[j], point[j]);
+		}
 	}
 	
 	vector<double> max_minus_min(this->n_components, 0.0);
 	std::transform(max_vec.begin(), max_vec.end(), min_vec.begin(), max_minus_min.begin(), [](double a, double b){ return a-b; });
 	
 
-	for( int j = 0; j < embedding.size(); ++j ) {
-
-		std::transform(embedding[j].begin(), embedding[j].end(), min_vec.begin(), embedding[j].begin(), 
-			[](double a, double b) {
-				return 10*(a-b);
-			});
-
-		std::transform(embedding[j].begin(), embedding[j].end(), max_minus_min.begin(), embedding[j].begin(),
-			[](double a, double b) {
-				return a/b;
-			});
+	for( int i = 0; i < embedding.size(); ++i ) {
+		double* point = embedding.row(i);
+		for( int j = 0; j < this->n_components; ++j )
+			point[j] = 10*(point[j]-min_vec[j])/max_minus_min[j];
 	}
 
 	if( this->verbose ) {
@@ -1297,18 +1780,26 @@ vector<vector<double>> humap::HierarchicalUMAP::embed_data(int level, Eigen::Spa
 	}
 
 	this->reducers[level].verbose = this->verbose;
-	
-
-	vector<vector<double>> result = this->reducers[level].optimize_layout_euclidean(
+	this->reducers[level].optimize_layout_euclidean(
 		embedding,
 		embedding,
 		rows,
 		cols,
-		this->n_epochs,
+		layout_epochs,
 		n_vertices,
 		epochs_per_sample);
 
-	// vector<vector<double>> result = embedding;
+	this->stopping_epoch = this->reducers[level].stopping_epoch();
+	this->convergence_curve = this->reducers[level].convergence_curve();
+
+	// back to user order
+	if( this->reorder ) {
+		umap::Embedding result(embedding.size(), embedding.dim());
+		for( int p = 0; p < order.size(); ++p )
+			std::copy(embedding.row(p), embedding.row(p) + embedding.dim(), result.row(order[p]));
+		embedding = std::move(result);
+	}
+
 	sec duration = clock::now() - before;
 	if( this->verbose ) {
 		cout << endl << "It took " << duration.count() << " to embed." << endl;
@@ -1319,10 +1810,85 @@ vector<vector<double>> humap::HierarchicalUMAP::embed_data(int level, Eigen::Spa
 	this->fixed_datapoints = vector<vector<double>>();
 
 
-	return result;
+	return embedding;
 }	
 
 
+/**
+* Initializes a level from the last embedding of the level above (prolongation)
+*
+* Every row is placed at the position of its owner plus a jitter of 1% of 
+* the extent of the coarse layout, so the points of a landmark do not start 
+* at the same position. Rows whose owner was not embedded get a random 
+* position inside the coarse layout.
+*
+* @param level int representing the hierarchy level being embedded
+* @param coarse Container with the index of the owner of each row in level+1
+* @param embedding Embedding with the random initialization (updated in place)
+* @return bool representing if the embedding was initialized from the level above
+*/
+bool humap::HierarchicalUMAP::prolongate(int level, const vector<int>& coarse, umap::Embedding& embedding)
+{
+	if( coarse.size() != embedding.size() || level+1 >= this->embeddings.size() )
+		return false;
+
+	const umap::Embedding& above = this->embeddings[level+1];
+	if( above.size() == 0 || above.dim() != embedding.dim() )
+		return false;
+
+	int dim = embedding.dim();
+	vector<int> row_of(this->metadata[level+1].size, -1);
+	for( int r = 0; r < this->embedded_indices[level+1].size(); ++r )
+		row_of[this->embedded_indices[level+1][r]] = r;
+
+	vector<double> lower(above.row(0), above.row(0) + dim), upper(lower);
+	for( int r = 0; r < above.size(); ++r ) {
+		for( int d = 0; d < dim; ++d ) {
+			lower[d] = min(lower[d], above.row(r)[d]);
+			upper[d] = max(upper[d], above.row(r)[d]);
+		}
+	}
+
+	int placed = 0;
+	for( int p = 0; p < embedding.size(); ++p ) {
+		double* point = embedding.row(p);
+		int r = coarse[p] >= 0 && coarse[p] < row_of.size() ? row_of[coarse[p]] : -1;
+
+		umap::CounterRNG rng(this->random_state, level, p);
+		for( int d = 0; d < dim; ++d ) {
+			double extent = max(upper[d] - lower[d], 1e-8);
+			if( r != -1 )
+				point[d] = above.row(r)[d] + 0.01*extent*(2.0*rng.next_double() - 1.0);
+			else
+				point[d] = lower[d] + extent*(point[d] + 10.0)/20.0;
+		}
+		placed += r != -1;
+	}
+
+	utils::log(this->verbose, "Warm start: " + std::to_string(placed) + "/" + std::to_string(embedding.size()) + 
+							  " points placed from level " + std::to_string(level+1) + ".\n");
+
+	return placed > 0;
+}
+
+/**
+* Keeps the last embedding of a level so the level below can start from it
+*
+* @param level int representing the hierarchy level
+* @param embedding Embedding whose first indices.size() rows are points of the level
+* @param indices Container with the index in the level of each row
+*/
+void humap::HierarchicalUMAP::remember_embedding(int level, const umap::Embedding& embedding, const vector<int>& indices)
+{
+	umap::Embedding kept(indices.size(), embedding.dim());
+	for( int r = 0; r < indices.size(); ++r )
+		std::copy(embedding.row(r), embedding.row(r) + embedding.dim(), kept.row(r));
+
+	this->embeddings[level] = std::move(kept);
+	this->embedded_indices[level] = indices;
+}
+
+
 /**
 * Embed a subset of data based on indices
 *
@@ -1437,6 +2003,11 @@ py::array_t<double> humap::HierarchicalUMAP::project_data(int level, vector<int>
 	this->influence_selected = this->get_influence_by_indices(level-1, indices_next_level);
 	this->indices_selected = indices_next_level;
 
+	// owner of every projected point in this level
+	vector<int> coarse(indices_next_level.size());
+	for( int i = 0; i < indices_next_level.size(); ++i )
+		coarse[i] = this->metadata[level-1].indices[indices_next_level[i]];
+
 	if( this->hierarchy_X[level-1].is_sparse() && !this->focus_context  ) {
 
 		umap::Matrix X = this->hierarchy_X[level-1];
@@ -1518,7 +2089,10 @@ py::array_t<double> humap::HierarchicalUMAP::project_data(int level, vector<int>
 
 		umap::Matrix nX = umap::Matrix(new_X, indices_next_level.size());
 
-		return py::cast(this->embed_data(level-1, new_graph, nX));
+		umap::Embedding embedding = this->embed_data(level-1, new_graph, nX, coarse);
+		this->remember_embedding(level-1, embedding, indices_next_level);
+
+		return humap::to_array(std::move(embedding));
 		
 	} if( this->hierarchy_X[level-1].is_sparse() && this->focus_context ) {
 
@@ -1581,6 +2155,9 @@ py::array_t<double> humap::HierarchicalUMAP::project_data(int level, vector<int>
 
 		this->labels_selected.insert(this->labels_selected.end(), additional_y.begin(), additional_y.end());
 
+		// the context points are points of this level themselves
+		coarse.insert(coarse.end(), indices_to_iterate.begin(), indices_to_iterate.end());
+
 		for( int i = 0; i < indices_to_iterate.size(); ++i ) {
 
 			int index = indices_to_iterate[i];
@@ -1667,16 +2244,28 @@ py::array_t<double> humap::HierarchicalUMAP::project_data(int level, vector<int>
 
 		umap::Matrix nX = umap::Matrix(new_X, new_X.size());
 
-		return py::cast(this->embed_data(level-1, new_graph, nX));
+		umap::Embedding embedding = this->embed_data(level-1, new_graph, nX, coarse);
+		this->remember_embedding(level-1, embedding, indices_next_level);
+
+		return humap::to_array(std::move(embedding));
 	} else {
 
 
-		umap::Matrix X = this->hierarchy_X[level-1];
+		umap::Matrix& X = this->hierarchy_X[level-1];
 		vector<vector<double>> new_X;
+		vector<utils::SparseData> new_rows;
 
+		// rows of a CSR dataset are kept sparse instead of being densified
 		for( int i = 0; i < indices_next_level.size(); ++i ) {
-			vector<double> dd = X.dense_matrix[indices_next_level[i]];
-			new_X.push_back(dd);
+			int index = indices_next_level[i];
+			if( X.is_csr() ) {
+				utils::SparseData sd;
+				for( int j = X.csr_indptr[index]; j < X.csr_indptr[index+1]; ++j )
+					sd.push(X.csr_indices[j], X.csr_data[j]);
+				new_rows.push_back(sd);
+			} else {
+				new_X.push_back(X.get_row(index));
+			}
 		}
 	
 		pair<int,int> max_neighbor = *std::max_element(mapper.begin(), mapper.end(), [](const pair<int,int>& a, const pair<int, int>& b) {
@@ -1705,9 +2294,12 @@ py::array_t<double> humap::HierarchicalUMAP::project_data(int level, vector<int>
 
 		new_graph.makeCompressed();
 		
-		umap::Matrix nX = umap::Matrix(new_X);
+		umap::Matrix nX = X.is_csr() ? umap::Matrix(new_rows, X.shape(1)) : umap::Matrix(new_X);
+
+		umap::Embedding embedding = this->embed_data(level-1, new_graph, nX, coarse);
+		this->remember_embedding(level-1, embedding, indices_next_level);
 
-		return py::cast(this->embed_data(level-1, new_graph, nX));
+		return humap::to_array(std::move(embedding));
 	}
 
 	return py::cast(vector<vector<double>>());
@@ -66,25 +66,36 @@ namespace humap {
 // converts py array to dense representation
 vector<vector<double>> convert_to_vector(const py::array_t<double>& v);
 
+// wraps a float32/float64 numpy array as a Matrix without copying
+umap::Matrix wrap_array(py::array& X);
+
+// wraps the arrays of a scipy CSR matrix as a Matrix without copying
+umap::Matrix wrap_csr(py::array& data, py::array& indices, py::array& indptr, int n_features);
+
+// hands an embedding to Python as a numpy array without copying
+py::array_t<double> to_array(umap::Embedding&& embedding);
+
 // creates a sparse object from rows, columns, and values
 vector<utils::SparseData> create_sparse(int n, const vector<int>& rows, const vector<int>& cols, const vector<double>& vals);
 
 // returns how many times each data point was an endpoint after a markov chain
-vector<int>  markov_chain(vector<vector<int>>& knn_indices, vector<double>& vals, vector<int>& cols, int num_walks, int walk_length, bool reproducible); 
+vector<int>  markov_chain(vector<vector<int>>& knn_indices, vector<double>& vals, vector<int>& cols, int num_walks, int walk_length, uint64_t seed,
+						  const vector<int>& order=vector<int>()); 
 
 // returns the endpoint after a random walk
-int random_walk(int vertex, int n_neighbors, vector<double>& vals, vector<int>& cols, int walk_length, 
-	            uniform_real_distribution<double>& unif, std::mt19937& rng);
+int random_walk(int vertex, int n_neighbors, const vector<double>& vals, const vector<int>& cols, int walk_length, 
+	            umap::CounterRNG& rng);
 
 
 // returns the max neighborhood after markov chain
 int markov_chain(vector<vector<int>>& knn_indices, vector<double>& vals, vector<int>& cols, 
 	             int num_walks, int walk_length, vector<int>& landmarks, int influence_neighborhood, 
-				 vector<vector<int>>& neighborhood, vector<vector<int>>& association, bool reproducible);
+				 vector<vector<int>>& neighborhood, vector<vector<int>>& association, uint64_t seed,
+				 const vector<int>& order=vector<int>());
 
 // returns the endpoint after a random walk
-int random_walk(int vertex, int n_neighbors, vector<double>& vals, vector<int>& cols, 
-				int walk_length, uniform_real_distribution<double>& unif, mt19937& rng, vector<int>& is_landmark);	
+int random_walk(int vertex, int n_neighbors, const vector<double>& vals, const vector<int>& cols, 
+				int walk_length, umap::CounterRNG& rng, const vector<int>& is_landmark);	
 
 
 /**
@@ -145,7 +156,7 @@ public:
 	/**
 	* Constructs HierarchicalUMAP
 	*
-	* @param similarity_method_ string representing the similarity method (we only support 'euclidean' right now)
+	* @param similarity_method_ string representing the kNN metric ('euclidean', 'cosine', 'inner_product' or 'manhattan')
 	* @param percents_ py::array_t<double> representing the percentage of points in each hierarchy level after the first level (whole dataset)
 	* @param n_neighbors_ int representing the number of neighbors for knn computation
 	* @param min_dist_ double representing the minimum distance between manifold structures
@@ -165,7 +176,10 @@ public:
 
 
 	// fits the hierarchy on X
-	void fit(py::array_t<double> X, py::array_t<int> y);
+	void fit(py::array X, py::array_t<int> y);
+
+	// fits the hierarchy on a CSR matrix given by its data, indices, and indptr arrays
+	void fit_csr(py::array data, py::array indices, py::array indptr, int n_features, py::array_t<int> y);
 
 	// returns the hierarchy level labels 
 	py::array_t<int> get_labels(int level);
@@ -173,11 +187,16 @@ public:
 	// returns the subset X associated to the hierarchy level
 	Eigen::SparseMatrix<double, Eigen::RowMajor> get_data(int level);
 
-	// returns the embedding of the hierarchy level
+	// returns the last embedding computed for the hierarchy level
 	py::array_t<double> get_embedding(int level);
 
 	// generates and returns the embedding of the hierarchy level
 	py::array_t<double> transform(int level);
+	// places new rows into the last embedding of the hierarchy level, with the fitted points fixed
+	py::array_t<double> transform_new(py::array X, int level);
+
+	// appends new rows to the first level, selecting the landmarks again once they drift (returns whether they did)
+	bool insert(py::array X, py::array_t<int> y);
 
 	// returns the indices of the embedding corresponding to the hierarchy level below
 	py::array_t<int> get_indices(int level);
@@ -240,8 +259,63 @@ public:
 	}
 
 	void set_random_state(int random_state) { this->random_state = random_state; }
+
+	// approximate x^b in the SGD gradients (relative error below 1e-7)
+	void set_fast_gradient(bool fast_gradient) { this->fast_gradient = fast_gradient; }
+
+	// stop the layout optimization once it stops moving (tolerance 0 disables it)
+	void set_convergence_tolerance(double tolerance, int patience) { 
+		this->convergence_tol = tolerance; 
+		this->convergence_patience = patience;
+	}
+
+	// number of epochs run by the last embedding
+	int get_stopping_epoch() { return this->stopping_epoch; }
+
+	// relative displacement per epoch of the last embedding
+	py::array_t<double> get_convergence_curve() { return py::cast(this->convergence_curve); }
+
+	// neighbor updates of each NNDescent round on the first level (empty if another algorithm or the knn cache gave the graph)
+	py::array_t<long> get_knn_updates() { return py::cast(this->first_reducer().descent_report().updates); }
+
+	// recall of the first-level knn graph after each NNDescent round, estimated on sampled points
+	py::array_t<double> get_knn_recall() { return py::cast(this->first_reducer().descent_report().recall); }
+
+	// knn graph of the first level (each row lists the point itself first)
+	py::array_t<int> get_knn_indices() { return py::cast(this->first_reducer().knn_indices()); }
+	py::array_t<double> get_knn_dists() { return py::cast(this->first_reducer().knn_dists()); }
+
+	// repulsion engine of the layout optimization: "NegativeSampling" or "BarnesHut" (theta is the opening angle)
+	void set_repulsion(string method, double theta) {
+		this->repulsion = method;
+		this->theta = theta;
+	}
+
+	// reorder vertices (Reverse Cuthill-McKee) for memory locality in the random walks and the layout optimization
+	void set_reorder(bool reorder) { this->reorder = reorder; }
+
+	// initialize a level from the last embedding of the level above and run a fraction of the epochs
+	void set_warm_start(bool warm_start, double epochs_fraction) {
+		this->warm_start = warm_start;
+		this->warm_start_epochs = epochs_fraction;
+	}
 	void set_n_epochs(int n_epochs) { this->n_epochs = n_epochs; }
 
+	// directory where the level-0 knn graph is cached by dataset fingerprint (empty disables the cache)
+	void set_knn_cache(string directory) { this->knn_cache = directory; }
+
+	// compression of the rows NNDescent compares on the first level: "none" or "int8" (re-ranked exactly)
+	void set_knn_quantization(string mode) { this->knn_quantization = mode; }
+
+	// recall the first level knn graph should reach with the cheapest tuned NNDescent parameters (0 keeps the defaults)
+	void set_knn_target_recall(double target) { this->knn_target_recall = target; }
+
+	// share of drifted rows over the first level size that makes insert select the landmarks again
+	void set_drift_threshold(double threshold) { this->drift_threshold = threshold; }
+
+	// drift of the inserted rows since the landmarks were selected
+	double get_drift() { return this->drift_base > 0 ? (double) this->drifted/this->drift_base : 0.0; }
+
 	// set statistics
 	void dump_info(string info);
 		
@@ -251,6 +325,8 @@ private:
 	int n_epochs = 500;
 	int n_components = 2;
 	int random_state = 0;
+	int convergence_patience = 10;
+	int stopping_epoch = 0;
 
 	int landmarks_nwalks = 10;
 	int landmarks_wl = 10;
@@ -259,21 +335,38 @@ private:
 	int influence_wl = 30;
 	int influence_neighborhood = 0;
 
+	int drift_base = 0;
+	int drifted = 0;
+
 	bool verbose;
 	bool focus_context = false;
 	bool distance_similarity = false;
 	bool reproducible;
+	bool fast_gradient = false;
+	bool reorder = false;
+	bool warm_start = false;
 	
 	double min_dist = 0.15;
 	double a = -1.0, b = -1.0;
 	double percent_glue = 0.0;
 	double _fixing_term = 0.01;
+	double convergence_tol = 0.0;
+	double theta = 0.5;
+	double warm_start_epochs = 0.3;
+	double drift_threshold = 0.1;
+	double drift_radius = 0.0;
+
+	vector<double> convergence_curve;
 
 	string output_filename = "";
 	ofstream output_file;
 	string init = "Spectral";
+	string repulsion = "NegativeSampling";
 	string similarity_method;
 	string knn_algorithm;
+	string knn_cache = "";
+	string knn_quantization = "none";
+	double knn_target_recall = 0.0;
 
 	vector<int>                    labels_selected;
 	vector<int>                    influence_selected;
@@ -287,7 +380,8 @@ private:
 	vector<vector<double>> 		   _sigmas;
 	vector<vector<double>> 		   fixed_datapoints;
 	vector<vector<int>>            level_landmarks;
-	vector<vector<vector<double>>> embeddings;
+	vector<vector<int>>            embedded_indices;
+	vector<umap::Embedding>        embeddings;
 
 	vector<Metadata> metadata;
 
@@ -295,6 +389,22 @@ private:
 	
 	vector<umap::Matrix> hierarchy_X;
 	vector<umap::Matrix> dense_backup;
+	py::array input_data; // keeps the buffer read by the first level alive
+	py::array input_buffer; // rows of the first level after insert, with room for more (input_data views its first rows)
+	py::array input_indices, input_indptr; // and the other CSR arrays for sparse input
+
+	// returns the reducer of the first level
+	umap::UMAP& first_reducer() {
+		if( this->reducers.empty() )
+			throw runtime_error("HierarchicalUMAP is not fitted");
+		return this->reducers[0];
+	}
+
+	// builds the hierarchy on top of the first level
+	void fit_levels(umap::Matrix first_level, py::array_t<int> y);
+
+	// selects the landmarks of every level above the fitted first level
+	void build_levels();
 
 	// finds which data point influence the one passed as parameter
 	int influenced_by(int level, int index);
@@ -313,8 +423,15 @@ private:
 	// update the position of a landmark based on its surroundings	
 	vector<double> update_position(int i, vector<int>& neighbors, umap::Matrix& X);
 
-	// performs the embedding on the dataset X using the graph force 
-	vector<vector<double>> embed_data(int level, Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, umap::Matrix& X);
+	// performs the embedding on the dataset X using the graph force (coarse: owner of each row in the level above, for warm start)
+	umap::Embedding embed_data(int level, Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, umap::Matrix& X, 
+							   const vector<int>& coarse=vector<int>());
+
+	// places every row at the position of its owner in the last embedding of the level above (plus jitter)
+	bool prolongate(int level, const vector<int>& coarse, umap::Embedding& embedding);
+
+	// keeps the last embedding of a level, whose rows are the level points in indices
+	void remember_embedding(int level, const umap::Embedding& embedding, const vector<int>& indices);
 
 	// associates points to landmarks
 	void associate_to_landmarks(int n, int n_neighbors, int* indices, vector<int>& cols, 
@@ -44,7 +44,10 @@ PYBIND11_MODULE(_hierarchical_umap, m) {
 		.def(py::init<string, py::array_t<double>, int, double, string, string, bool, bool>())
 		.def(py::init<>())
 		.def("fit", &humap::HierarchicalUMAP::fit)
+		.def("fit_csr", &humap::HierarchicalUMAP::fit_csr)
 		.def("transform", &humap::HierarchicalUMAP::transform)
+		.def("transform_new", &humap::HierarchicalUMAP::transform_new)
+		.def("insert", &humap::HierarchicalUMAP::insert)
 		.def("get_influence", &humap::HierarchicalUMAP::get_influence)
 		.def("get_labels", &humap::HierarchicalUMAP::get_labels)
 		.def("get_indices", &humap::HierarchicalUMAP::get_indices)
@@ -68,6 +71,22 @@ PYBIND11_MODULE(_hierarchical_umap, m) {
 		.def("set_fixing_term", &humap::HierarchicalUMAP::set_fixing_term)
 		.def("set_info_file", &humap::HierarchicalUMAP::set_info_file)
 		.def("set_n_epochs", &humap::HierarchicalUMAP::set_n_epochs)
+		.def("set_fast_gradient", &humap::HierarchicalUMAP::set_fast_gradient)
+		.def("set_reorder", &humap::HierarchicalUMAP::set_reorder)
+		.def("set_convergence_tolerance", &humap::HierarchicalUMAP::set_convergence_tolerance)
+		.def("set_repulsion", &humap::HierarchicalUMAP::set_repulsion)
+		.def("set_warm_start", &humap::HierarchicalUMAP::set_warm_start)
+		.def("set_knn_cache", &humap::HierarchicalUMAP::set_knn_cache)
+		.def("set_knn_quantization", &humap::HierarchicalUMAP::set_knn_quantization)
+		.def("set_knn_target_recall", &humap::HierarchicalUMAP::set_knn_target_recall)
+		.def("set_drift_threshold", &humap::HierarchicalUMAP::set_drift_threshold)
+		.def("get_drift", &humap::HierarchicalUMAP::get_drift)
+		.def("get_stopping_epoch", &humap::HierarchicalUMAP::get_stopping_epoch)
+		.def("get_convergence_curve", &humap::HierarchicalUMAP::get_convergence_curve)
+		.def("get_knn_updates", &humap::HierarchicalUMAP::get_knn_updates)
+		.def("get_knn_recall", &humap::HierarchicalUMAP::get_knn_recall)
+		.def("get_knn_indices", &humap::HierarchicalUMAP::get_knn_indices)
+		.def("get_knn_dists", &humap::HierarchicalUMAP::get_knn_dists)
 
 		.def("__repr__",
 			[](humap::HierarchicalUMAP& a) {
@@ -36,23 +36,104 @@
 #include "umap.h"
 #include "utils.h"
 
+#include <fstream>
+#include <mutex>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace py = pybind11;
 using namespace std;
 
+/**
+* Computes x^b for the gradients, exactly or with utils::fast_pow
+*
+* @param x double representing a positive squared distance
+* @param b double representing the b parameter of the curve
+* @return x^b
+*/
+template<bool FAST>
+static inline double gradient_pow(double x, double b)
+{
+	return FAST ? utils::fast_pow(x, b) : pow(x, b);
+}
+
+// number of negative samples whose repulsion is computed from the same position
+static const int NEGATIVE_BATCH = 8;
+
+/**
+* Applies the repulsion of a batch of negative samples as one combined update
+*
+* All coefficients are computed from the same position of the current point, 
+* so the distances, powers and clipped gradients of the batch are independent 
+* and the loops over the batch can be vectorised.
+*
+* @param current pointer to the point being optimized
+* @param tail_embedding Embedding where the negative samples are read from
+* @param samples pointer to the indices of the negative samples
+* @param count int representing the number of samples (at most NEGATIVE_BATCH)
+* @param self int representing the index of the current point (skipped if drawn)
+* @param a double
+* @param b double
+* @param gamma double
+* @param dim int representing the output dimension (only read when DIM = 0)
+* @param step double representing the learning rate of the current point
+*/
+template<int DIM, bool FAST_POW>
+static inline void negative_update(double* current, const umap::Embedding& tail_embedding, const int* samples, int count, 
+								   int self, double a, double b, double gamma, int dim, double step)
+{
+	const int D = DIM > 0 ? DIM : dim;
+
+	const double* others[NEGATIVE_BATCH];
+	double dist_squared[NEGATIVE_BATCH];
+	double grad_coeff[NEGATIVE_BATCH];
+	double weight[NEGATIVE_BATCH];
+
+	for( int p = 0; p < count; ++p ) {
+		others[p] = tail_embedding.row(samples[p]);
+		weight[p] = samples[p] != self ? 1.0 : 0.0;
+		dist_squared[p] = utils::rdist(current, others[p], D);
+	}
+
+	for( int p = 0; p < count; ++p ) {
+		grad_coeff[p] = 0.0;
+		if( dist_squared[p] > 0.0 )
+			grad_coeff[p] = 2.0 * gamma * b / ((0.001 + dist_squared[p]) * (a * gradient_pow<FAST_POW>(dist_squared[p], b) + 1.0));
+	}
+
+	for( int d = 0; d < D; ++d ) {
+		double grad_d = 0.0;
+		for( int p = 0; p < count; ++p )
+			grad_d += weight[p] * (grad_coeff[p] > 0.0 ? utils::clip(grad_coeff[p] * (current[d] - others[p][d])) : 4.0);
+
+		current[d] += grad_d * step;
+	}
+}
+
 /**
 * Optimize the layout for one epoch
 *
+* The kernel is specialised on the output dimension (DIM = 0 means any 
+* dimension), on whether there are fixed datapoints, on move_other, and on 
+* the fast gradient mode, so the inner loops have no per-coordinate branches.
+*
 * @param head_embedding Container
 * @param tail_embedding Container
 * @param head Container 
 * @param tail Container
+* @param active Container with the edges that fire in this epoch
 * @param n_vertices int
 * @param epochs_per_sample Container
 * @param a double
 * @param b double
 * @param gamma double
-* @param dim int
-* @param move_other bool
+* @param dim int (only read when DIM = 0)
+* @param move_other bool (ignored, MOVE_OTHER is used instead)
 * @param alpha double
 * @param epochs_per_negative_sample Container
 * @param epochs_of_next_negative_sample Container
@@ -60,97 +141,62 @@ using namespace std;
 * @param n int
 * @return 
 */
-void umap::UMAP::optimize_euclidean_epoch(vector<vector<double>>& head_embedding, vector<vector<double>>& tail_embedding,
-										   const vector<int>& head, const vector<int>& tail, int n_vertices, 
+template<int DIM, bool HAS_FIXED, bool MOVE_OTHER, bool FAST_POW>
+void umap::UMAP::optimize_euclidean_epoch(umap::Embedding& head_embedding, umap::Embedding& tail_embedding,
+										   const vector<int>& head, const vector<int>& tail, const vector<int>& active, int n_vertices, 
 										   const vector<double>& epochs_per_sample, double a, double b, 
 										   double gamma, int dim, bool move_other, double alpha, vector<double>& epochs_per_negative_sample,
 										   vector<double>& epoch_of_next_negative_sample, 
 										   vector<double>& epoch_of_next_sample, 
 										   int n)
 {
-	
-	const int seed = 0;
-	std::mt19937& engine = RandomGenerator::Instance().get();
-	std::uniform_int_distribution<int> dist(0, head_embedding.size());
+	const int D = DIM > 0 ? DIM : dim;
+	const double* scale = this->_datapoint_scale.data();
 
 	#pragma omp parallel for		
-	for( int i = 0; i < epochs_per_sample.size(); ++i ) {
-		if( epoch_of_next_sample[i] <= n ) {
+	for( int e = 0; e < active.size(); ++e ) {
+		{
+			int i = active[e];
 			int j = head[i];
 			int k = tail[i];
 
-			vector<double>* current = &head_embedding[j];			
-			vector<double>* other = &tail_embedding[k];
-			
+			double* current = head_embedding.row(j);
+			double* other = tail_embedding.row(k);
+
+			double step_current = HAS_FIXED ? alpha*scale[j] : alpha;
+			double step_other = (HAS_FIXED && MOVE_OTHER) ? alpha*scale[k] : alpha;
 
-			double dist_squared = utils::rdist((*current), (*other));
+			double dist_squared = utils::rdist(current, other, D);
 
 			double grad_coeff = 0.0;
 
 			if( dist_squared > 0.0 ) {
-				grad_coeff = -2.0 * a * b * pow(dist_squared, b-1.0);
-				grad_coeff /= a * pow(dist_squared, b) + 1.0;
+				// d^(b-1) = d^b / d, one pow per edge
+				double dist_pow = gradient_pow<FAST_POW>(dist_squared, b);
+				grad_coeff = -2.0 * a * b * (dist_pow / dist_squared);
+				grad_coeff /= a * dist_pow + 1.0;
 			}
 
-			for( int d = 0; d < dim; ++d ) {
-				double grad_d = utils::clip(grad_coeff * ((*current)[d] - (*other)[d]));
-
-				if( this->_free_datapoints[j] ) {
-					(*current)[d] += (grad_d * alpha);
-				} else {
-					(*current)[d] += (grad_d * alpha)*this->_fixing_term;
-				}
-			
-				if( move_other ) {
-
-					if( this->_free_datapoints[k] ) {
-						(*other)[d] += (-grad_d * alpha);
-					} else {
-						(*other)[d] += (-grad_d * alpha)*this->_fixing_term;
-					}
+			for( int d = 0; d < D; ++d ) {
+				double grad_d = utils::clip(grad_coeff * (current[d] - other[d]));
 
-				}
+				current[d] += grad_d * step_current;
+				if( MOVE_OTHER )
+					other[d] -= grad_d * step_other;
 			}
 
 			epoch_of_next_sample[i] += epochs_per_sample[i];
 			int n_neg_samples = (int) ((n-epoch_of_next_negative_sample[i])/epochs_per_negative_sample[i]);
-			// #pragma omp critical
-			// {
-			for( int p = 0; p < n_neg_samples; ++p ) {
-				
-					int k = dist(engine);
-					k = k % n_vertices;
-				
-					other = &tail_embedding[k];
-					dist_squared = utils::rdist(*current, *other);
-				
-					if( dist_squared > 0.0 ) {
-						grad_coeff = 2.0 * gamma * b;
-						grad_coeff /= (0.001 + dist_squared) * (a * pow(dist_squared, b) + 1.0);
-					} else if( j == k ) {
-						;
-					} else {
-						grad_coeff = 0.0;
-					}
-				
-
-
-				for( int d = 0; j != k && d < dim; ++d ) {
-					double grad_d = 0.0;
-					if( grad_coeff > 0.0 ) {
-						grad_d = utils::clip(grad_coeff * ((*current)[d] - (*other)[d]));
-					}
-					else {
-						grad_d = 4.0;
-					}
 
-					if( this->_free_datapoints[j] ) {
-						(*current)[d] += (grad_d * alpha);
-					} else {
-						(*current)[d] += (grad_d * alpha)*this->_fixing_term;
-					}
-				}
+			// negative samples are a pure function of (seed, epoch, edge, sample)
+			umap::CounterRNG rng(this->random_state, n, i);
+			int samples[NEGATIVE_BATCH];
+			for( int p = 0; p < n_neg_samples; p += NEGATIVE_BATCH ) {
+				int count = min(NEGATIVE_BATCH, n_neg_samples - p);
+				for( int q = 0; q < count; ++q )
+					samples[q] = rng.next_int(n_vertices);
 
+				negative_update<DIM, FAST_POW>(current, tail_embedding, samples, count, j, a, b, gamma, D, step_current);
 			}
 			
 			epoch_of_next_negative_sample[i] += (n_neg_samples * epochs_per_negative_sample[i]);
@@ -160,12 +206,76 @@ void umap::UMAP::optimize_euclidean_epoch(vector<vector<double>>& head_embedding
 }
 
 /**
-* Optimize the layout for one epoch (reproducible method)
+* Selects the epoch kernel for fixed datapoints and move_other
+*
+* @param has_fixed bool representing if any datapoint is not free
+* @param move_other bool
+* @return pointer to the specialised kernel
+*/
+template<int DIM, bool FAST_POW>
+umap::UMAP::EpochKernel umap::UMAP::epoch_kernel(bool has_fixed, bool move_other)
+{
+	if( has_fixed ) 
+		return move_other ? &UMAP::optimize_euclidean_epoch<DIM, true, true, FAST_POW> : &UMAP::optimize_euclidean_epoch<DIM, true, false, FAST_POW>;
+	else
+		return move_other ? &UMAP::optimize_euclidean_epoch<DIM, false, true, FAST_POW> : &UMAP::optimize_euclidean_epoch<DIM, false, false, FAST_POW>;
+}
+
+/**
+* Selects the epoch kernel for the output dimension, fixed datapoints, move_other and gradient mode
+*
+* @param dim int representing the output dimension
+* @param has_fixed bool representing if any datapoint is not free
+* @param move_other bool
+* @param fast bool representing if x^b is approximated with utils::fast_pow
+* @return pointer to the specialised kernel
+*/
+umap::UMAP::EpochKernel umap::UMAP::epoch_kernel(int dim, bool has_fixed, bool move_other, bool fast)
+{
+	switch( dim ) {
+		case 2: return fast ? this->epoch_kernel<2, true>(has_fixed, move_other) : this->epoch_kernel<2, false>(has_fixed, move_other);
+		case 3: return fast ? this->epoch_kernel<3, true>(has_fixed, move_other) : this->epoch_kernel<3, false>(has_fixed, move_other);
+		default: return fast ? this->epoch_kernel<0, true>(has_fixed, move_other) : this->epoch_kernel<0, false>(has_fixed, move_other);
+	}
+}
+
+/**
+* Groups a list of edges by one of their endpoints (stable counting sort)
+*
+* @param edges Container with the edge indices to group
+* @param endpoints Container with the endpoint of every edge
+* @param n int representing the number of vertices
+* @param ptr Container to store where the edges of each vertex begin
+* @param grouped Container to store the edges, in their original order for each vertex
+*/
+static void group_edges(const vector<int>& edges, const vector<int>& endpoints, int n, vector<int>& ptr, vector<int>& grouped)
+{
+	ptr.assign(n+1, 0);
+	for( int e = 0; e < edges.size(); ++e )
+		ptr[endpoints[edges[e]]+1]++;
+
+	for( int v = 0; v < n; ++v )
+		ptr[v+1] += ptr[v];
+
+	vector<int> next(ptr.begin(), ptr.end()-1);
+	grouped.resize(edges.size());
+	for( int e = 0; e < edges.size(); ++e )
+		grouped[next[endpoints[edges[e]]]++] = edges[e];
+}
+
+/**
+* Optimize the layout for one epoch (deterministic parallel method)
+*
+* Every vertex is owned by one thread, which gathers the updates of its 
+* active edges in schedule order. Positions of other vertices are read from a 
+* snapshot taken at the beginning of the epoch, so the layout is bitwise 
+* identical for any number of threads.
 *
 * @param head_embedding Container
 * @param tail_embedding Container
 * @param head Container 
 * @param tail Container
+* @param active Container with the edges that fire in this epoch
 * @param n_vertices int
 * @param epochs_per_sample Container
 * @param a double
@@ -178,120 +288,440 @@ void umap::UMAP::optimize_euclidean_epoch(vector<vector<double>>& head_embedding
 * @param epochs_of_next_negative_sample Container
 * @param epochs_of_next_sample Container
 * @param n int
+* @param barnes_hut bool representing if the repulsion is read from a SpaceTree (2-D and 3-D only)
 * @return 
 */
-void umap::UMAP::optimize_euclidean_epoch_reproducible(vector<vector<double>>& head_embedding, vector<vector<double>>& tail_embedding,
-										   const vector<int>& head, const vector<int>& tail, int n_vertices, 
+void umap::UMAP::optimize_euclidean_epoch_deterministic(umap::Embedding& head_embedding, umap::Embedding& tail_embedding,
+										   const vector<int>& head, const vector<int>& tail, const vector<int>& active, int n_vertices, 
 										   const vector<double>& epochs_per_sample, double a, double b, 
 										   double gamma, int dim, bool move_other, double alpha, vector<double>& epochs_per_negative_sample,
 										   vector<double>& epoch_of_next_negative_sample, 
 										   vector<double>& epoch_of_next_sample, 
-										   int n)
+										   int n, bool barnes_hut)
 {
-	const int seed = 0;
-	std::mt19937& engine = RandomGenerator::Instance().get();
-	std::uniform_int_distribution<int> dist(0, head_embedding.size());
+	const bool shared = &head_embedding == &tail_embedding;
+	const umap::Embedding tail_snapshot = tail_embedding;
+	const umap::Embedding head_snapshot = (move_other && !shared) ? head_embedding : umap::Embedding();
+	const umap::Embedding& head_source = shared ? tail_snapshot : head_snapshot;
 
-	for( int i = 0; i < epochs_per_sample.size(); ++i ) {
-		if( epoch_of_next_sample[i] <= n ) {
-			int j = head[i];
-			int k = tail[i];
+	// negative samples are replaced by the repulsion of the whole snapshot
+	const umap::Embedding no_points;
+	const umap::SpaceTree tree(barnes_hut ? tail_snapshot : no_points, this->theta);
 
-			vector<double>* current = &head_embedding[j];			
-			vector<double>* other = &tail_embedding[k];
-			
+	vector<int> out_ptr, out_edges, in_ptr, in_edges;
+	group_edges(active, head, head_embedding.size(), out_ptr, out_edges);
+	if( move_other )
+		group_edges(active, tail, tail_embedding.size(), in_ptr, in_edges);
 
-			double dist_squared = utils::rdist((*current), (*other));
+	#pragma omp parallel for schedule(dynamic, 256)
+	for( int v = 0; v < head_embedding.size(); ++v ) {
 
+		double* current = head_embedding.row(v);
+		double scale = alpha*this->_datapoint_scale[v];
+		int n_repulsions = 0;
+
+		for( int e = out_ptr[v]; e < out_ptr[v+1]; ++e ) {
+			int i = out_edges[e];
+			int k = tail[i];
+			const double* other = tail_snapshot.row(k);
+
+			double dist_squared = utils::rdist(current, other, dim);
 			double grad_coeff = 0.0;
 
 			if( dist_squared > 0.0 ) {
-				grad_coeff = -2.0 * a * b * pow(dist_squared, b-1.0);
-				grad_coeff /= a * pow(dist_squared, b) + 1.0;
+				double dist_pow = this->fast_gradient ? utils::fast_pow(dist_squared, b) : pow(dist_squared, b);
+				grad_coeff = -2.0 * a * b * (dist_pow / dist_squared);
+				grad_coeff /= a * dist_pow + 1.0;
 			}
 
-			for( int d = 0; d < dim; ++d ) {
-				double grad_d = utils::clip(grad_coeff * ((*current)[d] - (*other)[d]));
+			for( int d = 0; d < dim; ++d ) 
+				current[d] += utils::clip(grad_coeff * (current[d] - other[d])) * scale;
 
-				if( this->_free_datapoints[j] ) {
-					(*current)[d] += (grad_d * alpha);
-				} else {
-					(*current)[d] += (grad_d * alpha)*this->_fixing_term;
-				}
-			
-				if( move_other ) {
+			int n_neg_samples = (int) ((n-epoch_of_next_negative_sample[i])/epochs_per_negative_sample[i]);
 
-					if( this->_free_datapoints[k] ) {
-						(*other)[d] += (-grad_d * alpha);
-					} else {
-						(*other)[d] += (-grad_d * alpha)*this->_fixing_term;
-					}
+			if( barnes_hut ) {
+				n_repulsions += n_neg_samples;
+				continue;
+			}
 
-				}
+			// negative samples are a pure function of (seed, epoch, edge, sample)
+			umap::CounterRNG rng(this->random_state, n, i);
+			int samples[NEGATIVE_BATCH];
+			for( int p = 0; p < n_neg_samples; p += NEGATIVE_BATCH ) {
+				int count = min(NEGATIVE_BATCH, n_neg_samples - p);
+				for( int q = 0; q < count; ++q )
+					samples[q] = rng.next_int(n_vertices);
+
+				if( this->fast_gradient )
+					negative_update<0, true>(current, tail_snapshot, samples, count, v, a, b, gamma, dim, scale);
+				else
+					negative_update<0, false>(current, tail_snapshot, samples, count, v, a, b, gamma, dim, scale);
+			}
+		}
+
+		// n_repulsions samples of the mean repulsion (sampling v itself adds nothing, as above)
+		if( n_repulsions > 0 ) {
+			double force[3] = {0.0, 0.0, 0.0};
+
+			if( dim == 2 )
+				this->fast_gradient ? tree.repulsion<2, true>(current, a, b, gamma, force) : tree.repulsion<2, false>(current, a, b, gamma, force);
+			else
+				this->fast_gradient ? tree.repulsion<3, true>(current, a, b, gamma, force) : tree.repulsion<3, false>(current, a, b, gamma, force);
+
+			double weight = (double) n_repulsions/tree.size();
+			for( int d = 0; d < dim; ++d )
+				current[d] += force[d] * weight * scale;
+		}
+
+		// the tail side of the attractive moves (move_other)
+		if( !move_other || v >= tail_embedding.size() )
+			continue;
+
+		current = tail_embedding.row(v);
+		scale = alpha*this->_datapoint_scale[v];
+
+		for( int e = in_ptr[v]; e < in_ptr[v+1]; ++e ) {
+			int i = in_edges[e];
+
+			const double* other = head_source.row(head[i]);
+
+			double dist_squared = utils::rdist(current, other, dim);
+			double grad_coeff = 0.0;
+
+			if( dist_squared > 0.0 ) {
+				double dist_pow = this->fast_gradient ? utils::fast_pow(dist_squared, b) : pow(dist_squared, b);
+				grad_coeff = -2.0 * a * b * (dist_pow / dist_squared);
+				grad_coeff /= a * dist_pow + 1.0;
 			}
 
+			for( int d = 0; d < dim; ++d ) 
+				current[d] += utils::clip(grad_coeff * (current[d] - other[d])) * scale;
+		}
+	}
+
+	// advances the existing epochs_per_sample schedule
+	#pragma omp parallel for
+	for( int e = 0; e < active.size(); ++e ) {
+		{
+			int i = active[e];
 			epoch_of_next_sample[i] += epochs_per_sample[i];
 			int n_neg_samples = (int) ((n-epoch_of_next_negative_sample[i])/epochs_per_negative_sample[i]);
-			// #pragma omp critical
-			// {
-			for( int p = 0; p < n_neg_samples; ++p ) {
-				
-					int k = dist(engine);
-					k = k % n_vertices;
-				
-					other = &tail_embedding[k];
-					dist_squared = utils::rdist(*current, *other);
-				
-					if( dist_squared > 0.0 ) {
-						grad_coeff = 2.0 * gamma * b;
-						grad_coeff /= (0.001 + dist_squared) * (a * pow(dist_squared, b) + 1.0);
-					} else if( j == k ) {
-						;
-					} else {
-						grad_coeff = 0.0;
-					}
-				
+			epoch_of_next_negative_sample[i] += (n_neg_samples * epochs_per_negative_sample[i]);
+		}
+	}
+}
 
+/**
+* Builds the calendar of the first epoch in which every edge fires
+*
+* @param epochs_per_sample Container representing the number of epochs per sample
+* @param n_epochs int representing the number of training epochs
+*/
+umap::EpochSchedule::EpochSchedule(const vector<double>& epochs_per_sample, int n_epochs)
+: n_epochs(n_epochs), buckets(n_epochs), mask((epochs_per_sample.size() + 63)/64, 0)
+{
+	for( int i = 0; i < epochs_per_sample.size(); ++i )
+		this->push(i, 0, epochs_per_sample[i]);
+}
 
-				for( int d = 0; j != k && d < dim; ++d ) {
-					double grad_d = 0.0;
-					if( grad_coeff > 0.0 ) {
-						grad_d = utils::clip(grad_coeff * ((*current)[d] - (*other)[d]));
-					}
-					else {
-						grad_d = 4.0;
-					}
+/**
+* Moves the edges that fired in an epoch to the epoch of their next sample
+*
+* The next bucket is kept in increasing edge order, the order of a full 
+* scan, since the layout quality depends on the order of the updates.
+*
+* @param n int representing the epoch that was just optimized
+* @param epoch_of_next_sample Container with the (already advanced) next sample of each edge
+*/
+void umap::EpochSchedule::advance(int n, const vector<double>& epoch_of_next_sample)
+{
+	for( int i : this->buckets[n] )
+		this->push(i, n+1, epoch_of_next_sample[i]);
 
-					if( this->_free_datapoints[j] ) {
-						(*current)[d] += (grad_d * alpha);
-					} else {
-						(*current)[d] += (grad_d * alpha)*this->_fixing_term;
-					}
-				}
+	vector<int>().swap(this->buckets[n]);
+
+	if( n+1 < this->n_epochs )
+		this->sort_bucket(n+1);
+}
+
+/**
+* Sorts a bucket by edge index with a bitmap over the edges
+*
+* @param n int representing the epoch of the bucket
+*/
+void umap::EpochSchedule::sort_bucket(int n)
+{
+	vector<int>& bucket = this->buckets[n];
+	if( bucket.size() < 2 )
+		return;
+
+	int first = bucket[0], last = bucket[0];
+	for( int i : bucket ) {
+		this->mask[i >> 6] |= 1ULL << (i & 63);
+		first = min(first, i);
+		last = max(last, i);
+	}
+
+	int count = 0;
+	for( int w = first >> 6; w <= (last >> 6); ++w ) {
+		uint64_t bits = this->mask[w];
+		this->mask[w] = 0;
+		while( bits ) {
+			bucket[count++] = (w << 6) + utils::count_trailing_zeros(bits);
+			bits &= bits - 1;
+		}
+	}
+}
+
+/**
+* Schedules an edge in the first epoch >= earliest in which epoch >= next_sample
+*
+* @param edge int representing the edge index
+* @param earliest int representing the first epoch allowed
+* @param next_sample double representing the epoch of the next sample
+*/
+void umap::EpochSchedule::push(int edge, int earliest, double next_sample)
+{
+	double epoch = max((double) earliest, ceil(next_sample));
+	if( epoch < this->n_epochs )
+		this->buckets[(int) epoch].push_back(edge);
+}
+
+// maximum number of points in a leaf of a SpaceTree
+static const int SPACE_TREE_LEAF = 8;
+
+/**
+* Builds the Barnes-Hut tree over the points of an embedding (2-D or 3-D)
+*
+* @param embedding Embedding with the points
+* @param theta double representing the opening angle (0 computes the exact repulsion)
+*/
+umap::SpaceTree::SpaceTree(const umap::Embedding& embedding, double theta)
+: dim(embedding.dim()), n_points(embedding.size()), theta(theta)
+{
+	if( this->n_points == 0 )
+		return;
 
+	if( this->dim < 2 || this->dim > 3 )
+		throw runtime_error("SpaceTree only supports 2-D and 3-D embeddings");
+
+	Cell root;
+	double lower[3], upper[3];
+	for( int d = 0; d < this->dim; ++d ) {
+		lower[d] = upper[d] = embedding.row(0)[d];
+		root.center[d] = root.mass_center[d] = 0.0;
+	}
+
+	for( int i = 0; i < this->n_points; ++i ) {
+		const double* point = embedding.row(i);
+		for( int d = 0; d < this->dim; ++d ) {
+			lower[d] = min(lower[d], point[d]);
+			upper[d] = max(upper[d], point[d]);
+		}
+	}
+
+	root.half_width = 0.0;
+	for( int d = 0; d < this->dim; ++d ) {
+		root.center[d] = 0.5*(lower[d] + upper[d]);
+		root.half_width = max(root.half_width, 0.5*(upper[d] - lower[d]));
+	}
+	root.begin = 0;
+	root.count = this->n_points;
+	root.child = -1;
+	root.n_children = 0;
+
+	vector<int> order(this->n_points), scratch(this->n_points);
+	for( int i = 0; i < this->n_points; ++i )
+		order[i] = i;
+
+	this->cells.reserve(2*(this->n_points/SPACE_TREE_LEAF + 1));
+	this->cells.push_back(root);
+	this->split(0, order, scratch, embedding, 0);
+
+	// points are stored in tree order so every cell reads a contiguous block
+	this->points.resize((size_t) this->n_points*this->dim);
+	for( int p = 0; p < this->n_points; ++p )
+		std::copy(embedding.row(order[p]), embedding.row(order[p]) + this->dim, this->points.data() + (size_t) p*this->dim);
+}
+
+/**
+* Computes the center of mass of a cell and splits it into its non-empty quadrants/octants
+*
+* @param cell int representing the index of the cell
+* @param order Container with the points in tree order (reordered in place)
+* @param scratch Container used by the counting sort
+* @param embedding Embedding with the points
+* @param depth int representing the depth of the cell
+*/
+void umap::SpaceTree::split(int cell, vector<int>& order, vector<int>& scratch, const umap::Embedding& embedding, int depth)
+{
+	const int begin = this->cells[cell].begin;
+	const int count = this->cells[cell].count;
+	const int n_octants = 1 << this->dim;
+
+	for( int p = begin; p < begin+count; ++p ) {
+		const double* point = embedding.row(order[p]);
+		for( int d = 0; d < this->dim; ++d )
+			this->cells[cell].mass_center[d] += point[d]/count;
+	}
+
+	// coincident points cannot be separated, so the depth is bounded
+	if( count <= SPACE_TREE_LEAF || depth >= 32 )
+		return;
+
+	int octant_count[8] = {0};
+	for( int p = begin; p < begin+count; ++p ) {
+		const double* point = embedding.row(order[p]);
+		int octant = 0;
+		for( int d = 0; d < this->dim; ++d )
+			octant |= (point[d] >= this->cells[cell].center[d]) << d;
+		scratch[p] = octant;
+		octant_count[octant]++;
+	}
+
+	int octant_begin[8];
+	for( int o = 0, offset = begin; o < n_octants; ++o ) {
+		octant_begin[o] = offset;
+		offset += octant_count[o];
+	}
+
+	vector<int> sorted(count);
+	int next[8];
+	std::copy(octant_begin, octant_begin + n_octants, next);
+	for( int p = begin; p < begin+count; ++p )
+		sorted[next[scratch[p]]++ - begin] = order[p];
+	std::copy(sorted.begin(), sorted.end(), order.begin() + begin);
+
+	this->cells[cell].child = this->cells.size();
+	double half_width = 0.5*this->cells[cell].half_width;
+	for( int o = 0; o < n_octants; ++o ) {
+		if( octant_count[o] == 0 )
+			continue;
+
+		Cell child;
+		for( int d = 0; d < this->dim; ++d ) {
+			child.center[d] = this->cells[cell].center[d] + ((o >> d) & 1 ? half_width : -half_width);
+			child.mass_center[d] = 0.0;
+		}
+		child.half_width = half_width;
+		child.begin = octant_begin[o];
+		child.count = octant_count[o];
+		child.child = -1;
+		child.n_children = 0;
+
+		this->cells.push_back(child);
+		this->cells[cell].n_children++;
+	}
+
+	int first = this->cells[cell].child, last = first + this->cells[cell].n_children;
+	for( int c = first; c < last; ++c )
+		this->split(c, order, scratch, embedding, depth+1);
+}
+
+/**
+* Sums the repulsive gradients of all points of the tree on a point
+*
+* The gradient of every pair is the one of a negative sample; cells that 
+* satisfy the opening criterion contribute count times the gradient of their 
+* center of mass. Points at the same position (such as point itself) are skipped.
+*
+* @param point pointer to the point being optimized
+* @param a double
+* @param b double
+* @param gamma double
+* @param force pointer to DIM doubles where the gradients are accumulated
+*/
+template<int DIM, bool FAST_POW>
+void umap::SpaceTree::repulsion(const double* point, double a, double b, double gamma, double* force) const
+{
+	if( this->cells.empty() )
+		return;
+
+	const double theta_squared = this->theta*this->theta;
+
+	// each level pushes at most 8 cells and the depth is bounded by 32
+	int stack[8*33 + 1];
+	int top = 0;
+	stack[top++] = 0;
+
+	while( top > 0 ) {
+		const Cell& cell = this->cells[stack[--top]];
+
+		double dist_squared = utils::rdist(point, cell.mass_center, DIM);
+		double width = 2.0*cell.half_width;
+
+		if( width*width < theta_squared*dist_squared ) {
+			double grad_coeff = 2.0 * gamma * b / ((0.001 + dist_squared) * (a * gradient_pow<FAST_POW>(dist_squared, b) + 1.0));
+			for( int d = 0; d < DIM; ++d )
+				force[d] += cell.count * utils::clip(grad_coeff * (point[d] - cell.mass_center[d]));
+
+		} else if( cell.n_children == 0 ) {
+			// leaves are small, so their gradients are computed pair by pair
+			const double* other = this->points.data() + (size_t) cell.begin*DIM;
+			for( int p = 0; p < cell.count; ++p, other += DIM ) {
+				double pair_squared = utils::rdist(point, other, DIM);
+				if( pair_squared <= 0.0 )
+					continue;
+
+				double grad_coeff = 2.0 * gamma * b / ((0.001 + pair_squared) * (a * gradient_pow<FAST_POW>(pair_squared, b) + 1.0));
+				for( int d = 0; d < DIM; ++d )
+					force[d] += utils::clip(grad_coeff * (point[d] - other[d]));
 			}
-			
-			epoch_of_next_negative_sample[i] += (n_neg_samples * epochs_per_negative_sample[i]);
+
+		} else {
+			for( int c = cell.child; c < cell.child + cell.n_children; ++c )
+				stack[top++] = c;
 		}
 	}
-	
 }
 
 /**
-* Compute the embedding
+* Measures how much a sample of points moved since the last call
 *
-* @param head_embedding Container
-* @param tail_embedding Container
+* @param embedding Embedding being optimized
+* @param sample Container with the indices of the monitored points
+* @param previous Container with the previous positions of the sample (updated in place)
+* @return double with the mean displacement divided by the RMS distance of the sample to its centroid
+*/
+static double relative_displacement(const umap::Embedding& embedding, const vector<int>& sample, vector<double>& previous)
+{
+	int dim = embedding.dim();
+	vector<double> centroid(dim, 0.0);
+	double displacement = 0.0;
+
+	for( int s = 0; s < sample.size(); ++s ) {
+		const double* point = embedding.row(sample[s]);
+		double* before = previous.data() + (size_t) s*dim;
+
+		displacement += sqrt(utils::rdist(point, before, dim));
+		for( int d = 0; d < dim; ++d ) {
+			centroid[d] += point[d]/sample.size();
+			before[d] = point[d];
+		}
+	}
+
+	double spread = 0.0;
+	for( int s = 0; s < sample.size(); ++s )
+		spread += utils::rdist(embedding.row(sample[s]), centroid.data(), dim)/sample.size();
+
+	return spread > 0.0 ? (displacement/sample.size())/sqrt(spread) : 0.0;
+}
+
+/**
+* Compute the embedding (head_embedding is optimized in place)
+*
+* @param head_embedding Embedding
+* @param tail_embedding Embedding
 * @param head Container
 * @param tail Container
 * @param n_epochs int
 * @param n_vertices int
 * @param epochs_per_sample Container
-* @return Container representing the low-dimensional presentation
+* @param move_other bool moving the tail of the attractive moves (false keeps the tail embedding frozen)
 */
-vector<vector<double>> umap::UMAP::optimize_layout_euclidean(vector<vector<double>>& head_embedding, vector<vector<double>>& tail_embedding,
+void umap::UMAP::optimize_layout_euclidean(umap::Embedding& head_embedding, umap::Embedding& tail_embedding,
 										                     const vector<int>& head, const vector<int>& tail, int n_epochs, int n_vertices, 
-										                     const vector<double>& epochs_per_sample)
+										                     const vector<double>& epochs_per_sample, bool move_other)
 {
 	double a = this->_a;
 	double b = this->_b;
@@ -300,8 +730,7 @@ vector<vector<double>> umap::UMAP::optimize_layout_euclidean(vector<vector<doubl
 	double negative_sample_rate = this->negative_sample_rate;
 
 
-	int dim = head_embedding[0].size();
-	bool move_other = head_embedding.size() == tail_embedding.size();
+	int dim = head_embedding.dim();
 	double alpha = initial_alpha;
 
 	vector<double> epochs_per_negative_sample(epochs_per_sample.size(), 0.0);
@@ -316,16 +745,51 @@ vector<vector<double>> umap::UMAP::optimize_layout_euclidean(vector<vector<doubl
 	if( this->_free_datapoints.size() == 0 ) {
 		this->_free_datapoints = vector<bool>(head_embedding.size(), true);
 	}
+
+	// step multiplier of each datapoint (fixed datapoints move by _fixing_term)
+	bool has_fixed = false;
+	this->_datapoint_scale.assign(this->_free_datapoints.size(), 1.0);
+	for( int i = 0; i < this->_free_datapoints.size(); ++i ) {
+		if( !this->_free_datapoints[i] ) {
+			this->_datapoint_scale[i] = this->_fixing_term;
+			has_fixed = true;
+		}
+	}
+
+	EpochKernel kernel = this->epoch_kernel(dim, has_fixed, move_other, this->fast_gradient);
+
+	// the tree-based repulsion runs on the vertex-owned kernel
+	bool barnes_hut = this->repulsion == "BarnesHut" && (dim == 2 || dim == 3);
+	if( this->repulsion == "BarnesHut" && !barnes_hut && this->verbose )
+		printf("\tBarnesHut repulsion needs 2 or 3 components, using NegativeSampling\n");
+
+	// only the edges that fire in an epoch are visited
+	umap::EpochSchedule schedule(epochs_per_sample, n_epochs);
+
+	// convergence monitor on (up to ~1024) evenly spaced points, disabled when the tolerance is 0
+	vector<int> monitored;
+	vector<double> previous;
+	int calm_epochs = 0;
+	this->_stopping_epoch = n_epochs;
+	this->_convergence_curve.clear();
+	if( this->convergence_tol > 0.0 ) {
+		int stride = max(1, head_embedding.size()/1024);
+		for( int i = 0; i < head_embedding.size(); i += stride ) {
+			monitored.push_back(i);
+			previous.insert(previous.end(), head_embedding.row(i), head_embedding.row(i) + dim);
+		}
+	}
 	
 	for( int epoch = 0; epoch < n_epochs; ++epoch ) {
 		
-		if( this->try_reproducible ) {
+		if( this->try_reproducible || barnes_hut ) {
 
-			this->optimize_euclidean_epoch_reproducible(
+			this->optimize_euclidean_epoch_deterministic(
 				head_embedding,
 				tail_embedding,
 				head,
 				tail,
+				schedule.active(epoch),
 				n_vertices,
 				epochs_per_sample,
 				a, 
@@ -337,15 +801,17 @@ vector<vector<double>> umap::UMAP::optimize_layout_euclidean(vector<vector<doubl
 				epochs_per_negative_sample,
 				epoch_of_next_negative_sample,
 				epoch_of_next_sample,
-				epoch);
+				epoch,
+				barnes_hut);
 
 		} else {
 
-			this->optimize_euclidean_epoch(
+			(this->*kernel)(
 				head_embedding,
 				tail_embedding,
 				head,
 				tail,
+				schedule.active(epoch),
 				n_vertices,
 				epochs_per_sample,
 				a, 
@@ -360,18 +826,26 @@ vector<vector<double>> umap::UMAP::optimize_layout_euclidean(vector<vector<doubl
 				epoch);
 		}
 
+		schedule.advance(epoch, epoch_of_next_sample);
+
 		alpha = initial_alpha * (1.0 - ((double)epoch/(double)n_epochs));
 
 		if( this->verbose && epoch % (int)(n_epochs/10) == 0)
 			printf("\tcompleted %d / %d epochs\n", epoch, n_epochs);
 
+		if( !monitored.empty() ) {
+			double change = relative_displacement(head_embedding, monitored, previous);
+			this->_convergence_curve.push_back(change);
+
+			calm_epochs = change < this->convergence_tol ? calm_epochs + 1 : 0;
+			if( calm_epochs >= this->convergence_patience ) {
+				this->_stopping_epoch = epoch + 1;
+				break;
+			}
+		}
 	}
 	if( this->verbose )
-		printf("\tcompleted %d epochs\n", n_epochs);
-
-
-	return head_embedding;
-
+		printf("\tcompleted %d epochs\n", this->_stopping_epoch);
 }
 
 /**
@@ -696,7 +1170,24 @@ vector<vector<double>> umap::UMAP::multi_component_layout(umap::Matrix& data,
 	return result;
 }
 
-vector<vector<double>> umap::UMAP::spectral_layout(umap::Matrix& data, 
+/**
+* Copies a numpy array of shape (n, dim) into a contiguous embedding
+*
+* @param array py::object holding the numpy array
+* @param n int representing the number of points
+* @param dim int representing the number of dimensions
+* @return Embedding with the values of the array
+*/
+static umap::Embedding to_embedding(const py::object& array, int n, int dim)
+{
+	py::array_t<double, py::array::c_style | py::array::forcecast> values(array);
+	umap::Embedding embedding(n, dim);
+	std::copy(values.data(), values.data() + (size_t)n*dim, embedding.data());
+
+	return embedding;
+}
+
+umap::Embedding umap::UMAP::spectral_layout(umap::Matrix& data, 
 	const Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, int dim)
 {
 	using clock = chrono::system_clock;
@@ -712,7 +1203,7 @@ vector<vector<double>> umap::UMAP::spectral_layout(umap::Matrix& data,
 		py::object noiseObj = randomState.attr("uniform")(py::arg("low")=-10, py::arg("high")=10, py::arg("size")=size);
 
 
-		return noiseObj.cast<vector<vector<double>>>();
+		return to_embedding(noiseObj, graph.rows(), dim);
 	} 
 
 	int n_samples = graph.rows();
@@ -749,7 +1240,7 @@ vector<vector<double>> umap::UMAP::spectral_layout(umap::Matrix& data,
 				noise[i].begin(), spectral_embedding[i].begin(), plus<double>());
 		}
 
-		return spectral_embedding;
+		return umap::Embedding(spectral_embedding);
 	}
 	Eigen::VectorXd result = graph * Eigen::VectorXd::Ones(graph.cols());
 	vector<double> diag_data(&result[0], result.data() + result.size());
@@ -825,7 +1316,7 @@ vector<vector<double>> umap::UMAP::spectral_layout(umap::Matrix& data,
 		}
 
 
-		return spectral_embedding;
+		return umap::Embedding(spectral_embedding);
 
 	} catch(...) {
 		wcout << "WARNING (Spectral Layout): spectral initialisation failed! The eigenvector solver\n" <<
@@ -837,8 +1328,53 @@ vector<vector<double>> umap::UMAP::spectral_layout(umap::Matrix& data,
 		py::object randomState = scipy_random.attr("RandomState")(this->random_state);
 		vector<int> size = {(int)graph.rows(), dim};
 		py::object noiseObj = randomState.attr("uniform")(py::arg("low")=-10, py::arg("high")=10, py::arg("size")=size);
-		return noiseObj.cast<vector<vector<double>>>();
+		return to_embedding(noiseObj, graph.rows(), dim);
+	}
+}
+
+// checks if a metric is computed natively
+bool umap::is_supported_metric(const string& metric)
+{
+	return metric == "euclidean" || metric == "cosine" || metric == "inner_product" || metric == "manhattan";
+}
+
+/**
+* Computes the distance between two dense rows
+*
+* Cosine is 1 - cos(u, v) (1 for zero rows), inner product is 1 - <u, v> 
+* clamped at zero, and manhattan is the L1 distance.
+*
+* @param u const double* representing the first row
+* @param v const double* representing the second row
+* @param d int representing the dimensionality
+* @param metric string representing the metric
+* @return double representing the distance
+*/
+double umap::metric_distance(const double* u, const double* v, int d, const string& metric)
+{
+	double result = 0.0;
+
+	if( metric == "cosine" || metric == "inner_product" ) {
+		double dot = 0.0, norm_u = 0.0, norm_v = 0.0;
+		for( int k = 0; k < d; ++k ) {
+			dot += u[k]*v[k];
+			norm_u += u[k]*u[k];
+			norm_v += v[k]*v[k];
+		}
+		if( metric == "inner_product" )
+			return max(0.0, 1.0 - dot);
+		if( norm_u == 0.0 || norm_v == 0.0 )
+			return 1.0;
+		return max(0.0, 1.0 - dot/sqrt(norm_u*norm_v));
+	} else if( metric == "manhattan" ) {
+		for( int k = 0; k < d; ++k )
+			result += fabs(u[k]-v[k]);
+		return result;
 	}
+
+	for( int k = 0; k < d; ++k )
+		result += (u[k]-v[k])*(u[k]-v[k]);
+	return sqrt(result);
 }
 
 /**
@@ -855,18 +1391,16 @@ vector<vector<double>> umap::pairwise_distances(umap::Matrix& X, std::string met
 
 
   vector<vector<double>> pd(n, vector<double>(n, 0.0));
+  vector<double> u(d), v(d);
 
 
   for( int i = 0; i < n; ++i ) {
+    X.copy_row(i, u.data());
     for( int j = i+1; j < n; ++j ) {
 
-      double distance = 0;
+      X.copy_row(j, v.data());
 
-      for( int k = 0; k < d; ++k ) {
-      	distance += (X.dense_matrix[i][k]-X.dense_matrix[j][k])*(X.dense_matrix[i][k]-X.dense_matrix[j][k]);
-      }
-
-      pd[i][j] = sqrt(distance);
+      pd[i][j] = umap::metric_distance(u.data(), v.data(), d, metric);
       pd[j][i] = pd[i][j];
     }
   }
@@ -1038,31 +1572,722 @@ tuple<vector<double>, vector<double>> umap::smooth_knn_dist(vector<vector<double
 	return make_tuple(result, rho);
 }
 
+// rows of the query and reference tiles of the exact kNN
+static const int KNN_QUERY_TILE = 128;
+static const int KNN_REFERENCE_TILE = 512;
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMajorTile;
+
 /**
-* Compute the nearest neighbors for each data point
-* 
-* @param X Matrix represeting the dataset
-* @param n_neighbors int representing the number of neighbors
-* @param metric string representing the metric used for computing distances
-* @param knn_args map<string, string> with arguments for different k nearest neighbors methods
-* @param verbose bool controls the verbosity of the method
+* Copies consecutive rows of a dense Matrix to a contiguous tile
+*
+* @param X Matrix representing the dataset (dense)
+* @param begin int representing the first row
+* @param end int representing the end of the rows (exclusive)
+* @param tile RowMajorTile to store the rows
+*/
+static void copy_tile(umap::Matrix& X, int begin, int end, RowMajorTile& tile)
+{
+	tile.resize(end - begin, X.shape(1));
+	for( int i = begin; i < end; ++i )
+		X.copy_row(i, tile.row(i-begin).data());
+}
+
+// scales the rows of a tile to unit length (norms holds the squared norms of the dataset rows)
+static void normalize_tile(RowMajorTile& tile, const vector<double>& norms, int begin)
+{
+	for( int i = 0; i < tile.rows(); ++i )
+		if( norms[begin+i] > 0.0 )
+			tile.row(i) /= sqrt(norms[begin+i]);
+}
+
+/**
+* Computes the exact k nearest neighbors of a dense dataset
+*
+* The data is processed in tiles of KNN_QUERY_TILE x KNN_REFERENCE_TILE 
+* rows. Squared distances come from ||x||^2 + ||y||^2 - 2 x.y, where the dot 
+* products of a tile are one matrix product (Eigen's blocked GEMM kernels), 
+* and every query keeps a bounded max-heap with its n_neighbors-1 best 
+* candidates. Cosine and inner product rank by -x.y (cosine on rows scaled 
+* to unit length); manhattan sums |x-y| over the same tiles. As in the other 
+* algorithms, each point is its own first neighbor.
+*
+* @param X Matrix representing the dataset (dense)
+* @param n_neighbors int representing the number of neighbors (including the point itself)
+* @param metric string representing the metric (see metric_distance)
+* @return tuple with two Containers containing the knn indices and knn distances
+*/
+tuple<vector<vector<int>>, vector<vector<double>>> umap::exact_nearest_neighbors(umap::Matrix& X, int n_neighbors, string metric)
+{
+	if( X.is_sparse() || X.is_csr() )
+		throw runtime_error("Exact kNN requires a dense dataset");
+
+	int n = X.shape(0);
+	int k = max(0, min(n_neighbors-1, n-1));
+
+	bool euclidean = metric == "euclidean";
+	bool cosine = metric == "cosine";
+	bool manhattan = metric == "manhattan";
+
+	vector<double> norms(n, 0.0);
+	#pragma omp parallel
+	{
+		vector<double> row(X.shape(1));
+
+		#pragma omp for
+		for( int i = 0; i < n; ++i ) {
+			X.copy_row(i, row.data());
+			for( double value : row )
+				norms[i] += value*value;
+		}
+	}
+
+	vector<vector<int>> knn_indices(n, vector<int>(n_neighbors, 0));
+	vector<vector<double>> knn_dists(n, vector<double>(n_neighbors, 0.0));
+
+	int n_tiles = (n + KNN_QUERY_TILE - 1)/KNN_QUERY_TILE;
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for( int t = 0; t < n_tiles; ++t ) {
+
+		int q_begin = t*KNN_QUERY_TILE;
+		int q_end = min(n, q_begin + KNN_QUERY_TILE);
+
+		vector<vector<pair<double, int>>> heaps(q_end - q_begin);
+		for( auto& heap : heaps )
+			heap.reserve(k);
+
+		RowMajorTile queries, references, dots;
+		copy_tile(X, q_begin, q_end, queries);
+		if( cosine )
+			normalize_tile(queries, norms, q_begin);
+
+		for( int r_begin = 0; r_begin < n && k > 0; r_begin += KNN_REFERENCE_TILE ) {
+			int r_end = min(n, r_begin + KNN_REFERENCE_TILE);
+
+			copy_tile(X, r_begin, r_end, references);
+			if( cosine )
+				normalize_tile(references, norms, r_begin);
+
+			if( manhattan ) {
+				dots.resize(q_end-q_begin, r_end-r_begin);
+				for( int i = 0; i < q_end-q_begin; ++i )
+					for( int j = 0; j < r_end-r_begin; ++j )
+						dots(i, j) = (queries.row(i) - references.row(j)).cwiseAbs().sum();
+			} else {
+				dots.noalias() = queries * references.transpose();
+			}
+
+			// ||x||^2 is the same for the whole row, so euclidean candidates are ranked by ||y||^2 - 2 x.y
+			for( int i = q_begin; i < q_end; ++i ) {
+				vector<pair<double, int>>& heap = heaps[i-q_begin];
+				double* row_dots = dots.row(i-q_begin).data();
+
+				if( euclidean ) {
+					for( int j = 0; j < r_end-r_begin; ++j )
+						row_dots[j] = norms[r_begin+j] - 2.0*row_dots[j];
+				} else if( !manhattan ) {
+					for( int j = 0; j < r_end-r_begin; ++j )
+						row_dots[j] = -row_dots[j];
+				}
+
+				double worst = heap.size() < k ? numeric_limits<double>::max() : heap.front().first;
+				for( int j = 0; j < r_end-r_begin; ++j ) {
+					if( row_dots[j] >= worst || r_begin+j == i )
+						continue;
+
+					if( heap.size() == k ) {
+						pop_heap(heap.begin(), heap.end());
+						heap.pop_back();
+					}
+					heap.push_back(make_pair(row_dots[j], r_begin+j));
+					push_heap(heap.begin(), heap.end());
+
+					if( heap.size() == k )
+						worst = heap.front().first;
+				}
+			}
+		}
+
+		for( int i = q_begin; i < q_end; ++i ) {
+			vector<pair<double, int>>& heap = heaps[i-q_begin];
+			sort_heap(heap.begin(), heap.end());
+
+			knn_indices[i][0] = i;
+			knn_dists[i][0] = 0.0;
+			for( int j = 0; j < heap.size(); ++j ) {
+				knn_indices[i][j+1] = heap[j].second;
+				if( euclidean )
+					knn_dists[i][j+1] = sqrt(max(0.0, norms[i] + heap[j].first));
+				else if( manhattan )
+					knn_dists[i][j+1] = heap[j].first;
+				else
+					knn_dists[i][j+1] = max(0.0, 1.0 + heap[j].first);
+			}
+		}
+	}
+
+	return make_tuple(knn_indices, knn_dists);
+}
+
+/**
+* Compute the nearest neighbors for each data point
+* 
+* @param X Matrix represeting the dataset
+* @param n_neighbors int representing the number of neighbors
+* @param metric string representing the metric used for computing distances
+* @param knn_args map<string, string> with arguments for different k nearest neighbors methods
+* @param verbose bool controls the verbosity of the method
 * @return tuple with two Containers containing the knn indices and knn distances
 */
+const uint64_t KNN_FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t KNN_FNV_PRIME = 0x100000001b3ULL;
+const uint32_t KNN_CACHE_VERSION = 1;
+
+// header of a knn cache file, followed by n*k double distances and n*k int32 indices (row by row)
+struct KnnCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t k;
+	uint64_t n;
+	uint64_t key;
+};
+
+static inline uint64_t fnv1a(uint64_t h, uint64_t word)
+{
+	return (h ^ word) * KNN_FNV_PRIME;
+}
+
+static inline uint64_t double_bits(double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(double));
+	return bits;
+}
+
+/**
+* Computes the key of a knn graph in the cache
+*
+* Rows are hashed in parallel (FNV-1a over 64-bit words) and their hashes are 
+* combined in order, with the shape, the metric, the number of neighbors and 
+* every knn argument but the cache directory.
+*
+* @param X Matrix representing the dataset
+* @param n_neighbors int representing the number of neighbors
+* @param metric string representing the metric used for distance computation
+* @param knn_args Container with the knn algorithm and its parameters
+* @param reproducible bool indicating the reproducible knn path
+* @return uint64_t representing the fingerprint
+*/
+uint64_t umap::knn_fingerprint(umap::Matrix& X, int n_neighbors, string metric, map<string, string> knn_args, bool reproducible)
+{
+	int n = X.shape(0);
+	bool eigen_rows = X.is_sparse() && X.sparse_matrix.size() != n;
+	vector<uint64_t> row_hashes(n, 0);
+	vector<double> row;
+
+	#pragma omp parallel for firstprivate(row)
+	for( int i = 0; i < n; ++i )
+	{
+		uint64_t h = KNN_FNV_OFFSET;
+
+		if( eigen_rows ) {
+			for( Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(X.eigen_sparse, i); it; ++it ) {
+				h = fnv1a(h, (uint64_t) it.col());
+				h = fnv1a(h, double_bits(it.value()));
+			}
+		} else if( X.is_csr() ) {
+			for( int j = X.csr_indptr[i]; j < X.csr_indptr[i+1]; ++j ) {
+				h = fnv1a(h, (uint64_t) X.csr_indices[j]);
+				h = fnv1a(h, double_bits(X.csr_data[j]));
+			}
+		} else if( X.is_sparse() ) {
+			const utils::SparseData& row = X.sparse_matrix[i];
+			for( int j = 0; j < row.indices.size(); ++j ) {
+				h = fnv1a(h, (uint64_t) row.indices[j]);
+				h = fnv1a(h, double_bits(row.data[j]));
+			}
+		} else {
+			// float32 and float64 inputs with the same values share a fingerprint
+			row.resize(X.shape(1));
+			X.copy_row(i, row.data());
+			for( double value: row )
+				h = fnv1a(h, double_bits(value));
+		}
+
+		row_hashes[i] = umap::CounterRNG::mix(h);
+	}
+
+	uint64_t h = fnv1a(fnv1a(KNN_FNV_OFFSET, (uint64_t) n), (uint64_t) X.shape(1));
+	for( uint64_t row_hash: row_hashes )
+		h = fnv1a(h, row_hash);
+
+	string description = metric + ";k=" + std::to_string(n_neighbors) + ";reproducible=" + std::to_string(reproducible);
+	for( auto& arg: knn_args )
+		if( arg.first != "cache_dir" )
+			description += ";" + arg.first + "=" + arg.second;
+
+	for( unsigned char c: description )
+		h = fnv1a(h, (uint64_t) c);
+
+	return umap::CounterRNG::mix(h);
+}
+
+// returns the file of a knn graph in the cache directory
+string umap::knn_cache_filename(string directory, uint64_t key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "knn-%016llx.bin", (unsigned long long) key);
+	return directory + "/" + name;
+}
+
+// copies a knn graph out of the bytes of a cache file, after checking its header
+static bool read_knn_cache(const char* bytes, size_t size, uint64_t key, int n, int k,
+						   vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists)
+{
+	if( size < sizeof(KnnCacheHeader) )
+		return false;
+
+	KnnCacheHeader header;
+	memcpy(&header, bytes, sizeof(KnnCacheHeader));
+
+	size_t entries = (size_t) n * k;
+	if( memcmp(header.magic, "HUMAPKNN", 8) != 0 || header.version != KNN_CACHE_VERSION || header.key != key || 
+		header.n != (uint64_t) n || header.k != (uint32_t) k || 
+		size != sizeof(KnnCacheHeader) + entries * (sizeof(double) + sizeof(int32_t)) )
+		return false;
+
+	const char* dists = bytes + sizeof(KnnCacheHeader);
+	const char* indices = dists + entries * sizeof(double);
+
+	knn_indices = vector<vector<int>>(n, vector<int>(k, 0));
+	knn_dists = vector<vector<double>>(n, vector<double>(k, 0.0));
+
+	#pragma omp parallel for
+	for( int i = 0; i < n; ++i ) {
+		memcpy(knn_dists[i].data(), dists + (size_t) i * k * sizeof(double), k * sizeof(double));
+		memcpy(knn_indices[i].data(), indices + (size_t) i * k * sizeof(int32_t), k * sizeof(int32_t));
+	}
+
+	return true;
+}
+
+/**
+* Loads a knn graph from the cache (memory-mapped where available)
+*
+* @param filename string representing the cache file
+* @param key uint64_t representing the fingerprint the file must carry
+* @param n int representing the number of data points
+* @param k int representing the number of neighbors
+* @param knn_indices Container that receives the indices of k nearest neighbors
+* @param knn_dists Container that receives the distances of k nearest neighbors
+* @return bool indicating whether a valid graph was found
+*/
+bool umap::load_knn_cache(string filename, uint64_t key, int n, int k, 
+						  vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists)
+{
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_RDONLY);
+	if( fd < 0 )
+		return false;
+
+	struct stat st;
+	if( fstat(fd, &st) != 0 || st.st_size == 0 ) {
+		close(fd);
+		return false;
+	}
+
+	size_t size = (size_t) st.st_size;
+	void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( mapped == MAP_FAILED )
+		return false;
+
+	bool found = read_knn_cache((const char*) mapped, size, key, n, k, knn_indices, knn_dists);
+	munmap(mapped, size);
+	return found;
+#else
+	ifstream in(filename, ios::binary | ios::ate);
+	if( !in )
+		return false;
+
+	size_t size = (size_t) in.tellg();
+	vector<char> bytes(size);
+	in.seekg(0);
+	if( !in.read(bytes.data(), size) )
+		return false;
+
+	return read_knn_cache(bytes.data(), size, key, n, k, knn_indices, knn_dists);
+#endif
+}
+
+/**
+* Stores a knn graph in the cache
+*
+* The file is written under a temporary name and renamed, so a concurrent 
+* fit never reads a partial graph.
+*
+* @param filename string representing the cache file
+* @param key uint64_t representing the fingerprint of the graph
+* @param knn_indices Container representing the indices of k nearest neighbors
+* @param knn_dists Container representing the distances of k nearest neighbors
+* @return bool indicating whether the graph was stored
+*/
+bool umap::save_knn_cache(string filename, uint64_t key, vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists)
+{
+	if( knn_indices.size() == 0 )
+		return false;
+
+	KnnCacheHeader header;
+	memcpy(header.magic, "HUMAPKNN", 8);
+	header.version = KNN_CACHE_VERSION;
+	header.k = (uint32_t) knn_indices[0].size();
+	header.n = knn_indices.size();
+	header.key = key;
+
+	string temporary = filename + ".tmp" + std::to_string(chrono::steady_clock::now().time_since_epoch().count());
+	ofstream out(temporary, ios::binary);
+	if( !out )
+		return false;
+
+	out.write((const char*) &header, sizeof(KnnCacheHeader));
+	for( auto& row: knn_dists )
+		out.write((const char*) row.data(), header.k * sizeof(double));
+	for( auto& row: knn_indices ) {
+		vector<int32_t> ids(row.begin(), row.end());
+		out.write((const char*) ids.data(), header.k * sizeof(int32_t));
+	}
+	out.close();
+
+	if( !out || std::rename(temporary.c_str(), filename.c_str()) != 0 ) {
+		std::remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+// efanna distance of a knn metric
+static efanna2e::Metric efanna_metric(const string& metric)
+{
+	if( metric == "cosine" )
+		return efanna2e::COSINE;
+	else if( metric == "inner_product" )
+		return efanna2e::INNER_PRODUCT;
+	else if( metric == "manhattan" )
+		return efanna2e::L1;
+	return efanna2e::L2;
+}
+
+/**
+* Returns the float rows indexed by the efanna algorithms
+*
+* float32 input is read in place. A converted copy is made when the input is 
+* float64, when the metric needs unit-length rows (cosine), or when the rows 
+* must be padded to DATA_ALIGN_FACTOR floats.
+*
+* @param X Matrix representing the dataset (dense)
+* @param metric string representing the metric
+* @param pad bool indicating whether the rows are padded (KDTree_NNDescent)
+* @param dim unsigned receiving the (padded) dimensionality
+* @param owned float* receiving the copy to release with delete[] (nullptr if there is none)
+* @return const float* representing the rows
+*/
+static const float* efanna_rows(umap::Matrix& X, const string& metric, bool pad, unsigned& dim, float*& owned)
+{
+	dim = (unsigned) X.shape(1);
+	owned = nullptr;
+
+	bool normalize = metric == "cosine";
+	bool padded = pad && dim % DATA_ALIGN_FACTOR != 0;
+	if( X.float_buffer() && !normalize && !padded )
+		return X.float_buffer();
+
+	owned = X.data_f();
+	if( normalize )
+		efanna2e::normalize_rows(owned, X.shape(0), dim);
+	if( padded )
+		owned = efanna2e::data_align(owned, X.shape(0), dim);
+	return owned;
+}
+
+/**
+* Copies the progress of the NNDescent rounds of an index into a report
+*
+* @param index IndexGraph after Build or RefineGraph
+* @param report DescentReport receiving the rounds (nullptr: none)
+* @param verbose bool to print the rounds
+*/
+static void describe_descent(const efanna2e::IndexGraph& index, umap::DescentReport* report, bool verbose)
+{
+	const vector<size_t>& updates = index.UpdateCounts();
+	const vector<float>& recall = index.RecallEstimates();
+
+	if( verbose )
+		for( int i = 0; i < updates.size(); ++i )
+			cout << "NNDescent round " << i+1 << ": " << updates[i] << " updates, estimated recall " << recall[i] << endl;
+
+	if( report ) {
+		report->updates.assign(updates.begin(), updates.end());
+		report->recall.assign(recall.begin(), recall.end());
+	}
+}
+
+/**
+* Returns the compressed rows NNDescent compares while it searches candidates
+*
+* With "int8", candidate distances are computed on int8 codes (a quarter of the 
+* memory traffic of float rows) and the final pools are re-ranked with exact 
+* distances. "none" keeps the float rows.
+*
+* @param data const float* representing the rows indexed by efanna
+* @param n int representing the number of rows
+* @param dim unsigned representing the dimensionality of data
+* @param metric string representing the metric
+* @param mode string representing the quantization ("none" or "int8")
+* @return RowDistance to release with delete (nullptr for "none")
+*/
+static efanna2e::RowDistance* quantized_rows(const float* data, int n, unsigned dim, const string& metric, const string& mode)
+{
+	if( mode == "int8" )
+		return new efanna2e::QuantizedRows(data, n, dim, efanna_metric(metric));
+	if( !mode.empty() && mode != "none" )
+		throw runtime_error("Unknown knn quantization " + mode + " (use none or int8)");
+	return nullptr;
+}
+
+// copies a dense Matrix to a numpy array for the Python knn libraries
+static py::array_t<double> to_numpy(umap::Matrix& X)
+{
+	py::array_t<double> data({X.shape(0), X.shape(1)});
+	for( int i = 0; i < X.shape(0); ++i )
+		X.copy_row(i, data.mutable_data(i, 0));
+	return data;
+}
+
+// copies a CSR Matrix to a scipy.sparse.csr_matrix for the Python knn libraries
+static py::object to_scipy_csr(umap::Matrix& X)
+{
+	int n = X.shape(0);
+	int nnz = X.csr_indptr[n];
+
+	py::array_t<float> data(nnz, X.csr_data);
+	py::array_t<int> indices(nnz, X.csr_indices);
+	py::array_t<int> indptr(n+1, X.csr_indptr);
+
+	py::module scipy_sparse = py::module::import("scipy.sparse");
+	return scipy_sparse.attr("csr_matrix")(py::make_tuple(data, indices, indptr), py::arg("shape") = py::make_tuple(n, X.shape(1)));
+}
+
+// rows of the sample the knn parameters are tuned on
+static const int KNN_TUNE_SAMPLE = 10000;
+
+// knn parameters tuned in this process, by data shape
+static map<string, map<string, string>> tuned_knn_args;
+static std::mutex tuned_knn_mutex;
+
+// copies the tuned L, S and R into the knn arguments
+static map<string, string> with_tuned(map<string, string> knn_args, const map<string, string>& tuned)
+{
+	for( auto& arg: tuned )
+		knn_args[arg.first] = arg.second;
+	return knn_args;
+}
+
+/**
+* Tunes the NNDescent parameters for a target recall
+*
+* Every candidate L (a pool of 1, 1.5 or 2 times n_neighbors) and S = R (0.3, 0.6 
+* or 1 times n_neighbors) builds the knn graph of a random sample of at most 
+* KNN_TUNE_SAMPLE rows, whose recall NNDescent estimates on its control points 
+* (IndexGraph::eval_recall). The cheapest candidate reaching the target wins, or 
+* the one with the best recall if none does. The cost is the number of pool 
+* entries changed over all the rounds times L, which unlike the time does not 
+* depend on the load of the machine; the time only breaks ties. The choice is 
+* kept by data shape (metric, power of two of the size, dimension, n_neighbors, algorithm, quantization 
+* and target) for the process, and in the knn cache directory when there is one. 
+* iter is left as the upper bound of the rounds, since the update rate stops them.
+*
+* @param X Matrix representing the dataset (dense)
+* @param n_neighbors int representing the number of neighbors
+* @param metric string representing the metric used for distance computation
+* @param knn_args Container with the knn algorithm, its parameters and target_recall
+* @param verbose bool printing the candidates
+* @return Container with knn_args, where L, S and R are tuned
+*/
+map<string, string> umap::tune_knn_args(umap::Matrix& X, int n_neighbors, string metric, map<string, string> knn_args, bool verbose)
+{
+	using clock = chrono::system_clock;
+	using sec = chrono::duration<double>;
+
+	double target = stod(knn_args["target_recall"]);
+	string algorithm = knn_args["knn_algorithm"];
+	int n = X.shape(0);
+	int d = X.shape(1);
+	int m = min(n, KNN_TUNE_SAMPLE);
+
+	if( target <= 0.0 || X.is_sparse() || X.is_csr() || m <= 4*n_neighbors ||
+		(algorithm != "NNDescent" && algorithm != "KDTree_NNDescent") )
+		return knn_args;
+
+	int size_class = 0;
+	while( (1LL << (size_class+1)) <= n )
+		size_class++;
+
+	string shape = metric + ";n=2^" + to_string(size_class) + ";d=" + to_string(d) + ";k=" + to_string(n_neighbors) + 
+				   ";" + algorithm + ";quantize=" + knn_args["quantize"] + ";target=" + knn_args["target_recall"];
+
+	{
+		lock_guard<std::mutex> lock(tuned_knn_mutex);
+		auto found = tuned_knn_args.find(shape);
+		if( found != tuned_knn_args.end() )
+			return with_tuned(knn_args, found->second);
+	}
+
+	string file;
+	if( !knn_args["cache_dir"].empty() ) {
+		uint64_t h = KNN_FNV_OFFSET;
+		for( unsigned char c: shape )
+			h = fnv1a(h, (uint64_t) c);
+
+		char name[40];
+		snprintf(name, sizeof(name), "knn-params-%016llx.txt", (unsigned long long) umap::CounterRNG::mix(h));
+		file = knn_args["cache_dir"] + "/" + name;
+
+		// a file that does not hold three valid parameters is tuned again
+		ifstream in(file);
+		map<string, string> tuned;
+		int L, S, R;
+		if( in >> L >> S >> R && L >= n_neighbors-1 && S >= 1 && R >= 1 ) {
+			tuned["L"] = to_string(L);
+			tuned["S"] = to_string(S);
+			tuned["R"] = to_string(R);
+			lock_guard<std::mutex> lock(tuned_knn_mutex);
+			tuned_knn_args[shape] = tuned;
+			return with_tuned(knn_args, tuned);
+		}
+	}
+
+	auto begin = clock::now();
+
+	// first m entries of a partial shuffle
+	vector<int> rows(n);
+	for( int i = 0; i < n; ++i )
+		rows[i] = i;
+	for( int i = 0; i < m; ++i )
+		swap(rows[i], rows[i + rand() % (n - i)]);
+
+	vector<float> values((size_t) m * d);
+	vector<double> row(d);
+	for( int i = 0; i < m; ++i ) {
+		X.copy_row(rows[i], row.data());
+		for( int j = 0; j < d; ++j )
+			values[(size_t) i * d + j] = (float) row[j];
+	}
+	umap::Matrix sample(values.data(), m, d);
+
+	map<string, string> trial = knn_args;
+	trial["cache_dir"] = "";
+	trial["target_recall"] = "0";
+
+	map<string, string> best;
+	double best_seconds = 0.0, best_recall = -1.0;
+	long long best_cost = 0;
+	bool reached = false;
+
+	for( double pool: {1.0, 1.5, 2.0} ) {
+		for( double share: {0.3, 0.6, 1.0} ) {
+			int L = (int) (pool * n_neighbors);
+			int S = max(1, (int) (share * n_neighbors));
+			trial["L"] = to_string(L);
+			trial["S"] = to_string(S);
+			trial["R"] = to_string(S);
+
+			umap::DescentReport report;
+			auto trial_begin = clock::now();
+			umap::nearest_neighbors(sample, n_neighbors, metric, trial, false, false, &report);
+			sec seconds = clock::now() - trial_begin;
+			double recall = report.recall.empty() ? 0.0 : report.recall.back();
+			long long cost = 0;
+			for( long updates: report.updates )
+				cost += updates;
+			cost *= L;
+
+			if( verbose )
+				cout << "\tL = " << L << ", S = R = " << S << ": recall " << recall << ", cost " << cost << " in " << seconds.count() << " seconds" << endl;
+
+			bool cheaper = cost < best_cost || (cost == best_cost && seconds.count() < best_seconds);
+			bool better = recall >= target ? (!reached || cheaper) : (!reached && recall > best_recall);
+			if( better ) {
+				best["L"] = trial["L"];
+				best["S"] = trial["S"];
+				best["R"] = trial["R"];
+				best_seconds = seconds.count();
+				best_cost = cost;
+				best_recall = recall;
+				reached = recall >= target;
+			}
+		}
+	}
+
+	sec end = clock::now() - begin;
+	if( verbose )
+		cout << "Tuning knn parameters for recall " << target << ": L = " << best["L"] << ", S = R = " << best["S"] << 
+				(reached ? "" : " (target not reached)") << ", " << end.count() << " seconds." << endl;
+
+	{
+		lock_guard<std::mutex> lock(tuned_knn_mutex);
+		tuned_knn_args[shape] = best;
+	}
+
+	// written aside and renamed, as in save_knn_cache, so concurrent fits never read a partial file
+	if( !file.empty() ) {
+		string temporary = file + ".tmp" + std::to_string(chrono::steady_clock::now().time_since_epoch().count());
+		ofstream out(temporary);
+		out << best["L"] << " " << best["S"] << " " << best["R"] << endl;
+		out.close();
+
+		if( !out || std::rename(temporary.c_str(), file.c_str()) != 0 )
+			std::remove(temporary.c_str());
+	}
+
+	return with_tuned(knn_args, best);
+}
+
 tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap::Matrix& X,
-	int n_neighbors, string metric, map<string, string> knn_args, bool verbose, bool reproducible)
+	int n_neighbors, string metric, map<string, string> knn_args, bool verbose, bool reproducible, 
+	umap::DescentReport* report)
 {
 
 	using clock = chrono::system_clock;
 	using sec = chrono::duration<double>;
 
 	if( verbose )
-		cout << "Finding nearest neighbors" << endl;
+		cout << "Finding nearest neighbors (distance kernels: " << efanna2e::simd_kernels().name << ")" << endl;
 
 	vector<vector<int>> knn_indices;
 	vector<vector<double>> knn_dists;
 
+	if( metric != "precomputed" && !umap::is_supported_metric(metric) )
+		throw runtime_error("Unknown metric " + metric + " (use euclidean, cosine, inner_product or manhattan)");
+
 	auto begin = clock::now();
 
+	// reuse the graph of a previous fit on the same data with the same knn parameters
+	string cache_file;
+	uint64_t cache_key = 0;
+	if( metric != "precomputed" && !knn_args["cache_dir"].empty() ) {
+		cache_key = umap::knn_fingerprint(X, n_neighbors, metric, knn_args, reproducible);
+		cache_file = umap::knn_cache_filename(knn_args["cache_dir"], cache_key);
+
+		if( umap::load_knn_cache(cache_file, cache_key, X.shape(0), n_neighbors, knn_indices, knn_dists) ) {
+			sec end = clock::now() - begin;
+			if( verbose )
+				cout << "Loading k nearest neighbors from " << cache_file << ": " << end.count() << " seconds." << endl;
+			return make_tuple(knn_indices, knn_dists);
+		}
+	}
+
 	if( metric == "precomputed" ) {
 
 		knn_indices = vector<vector<int>>(X.size(), vector<int>(n_neighbors, 0));
@@ -1071,9 +2296,8 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 		#pragma omp parallel for default(shared)		
 		for( int i = 0; i < knn_indices.size(); ++i )
 		{
-			vector<double> row_data = X.dense_matrix[i];
-			vector<int> sorted_indices = utils::argsort(row_data);
-			vector<int> row_nn_data_indices(sorted_indices.begin(), sorted_indices.begin()+n_neighbors);
+			const vector<double>& row_data = X.dense_matrix[i];
+			vector<int> row_nn_data_indices = utils::argsort_k(row_data, n_neighbors);
 
 			knn_indices[i] = row_nn_data_indices;
 			knn_dists[i] = utils::arrange_by_indices<double>(row_data, row_nn_data_indices);
@@ -1083,11 +2307,20 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 	} else {
 		string algorithm = knn_args["knn_algorithm"];
 
+		if( !reproducible && stod(knn_args["target_recall"]) > 0.0 )
+			knn_args = umap::tune_knn_args(X, n_neighbors, metric, knn_args, verbose);
+
+		if( (algorithm == "FLANN" || algorithm == "ANNOY") && metric != "euclidean" )
+			throw runtime_error(algorithm + " supports only the euclidean metric");
+
+		if( X.is_csr() && algorithm != "NNDescent" )
+			throw runtime_error(algorithm + " does not support sparse input (use NNDescent)");
+
 		if( algorithm == "FLANN" ) {
 
 			py::module pyflann = py::module::import("pyflann");
 			py::module flann = pyflann.attr("FLANN")();
-			py::array_t<double> data = py::cast(X.dense_matrix);
+			py::array_t<double> data = to_numpy(X);
 			py::object result = flann.attr("nn")(data, data, n_neighbors, py::arg("checks") = 128, py::arg("trees") = 3, py::arg("iterations") = 15);
 
 			py::object knn_indices_ = result.attr("__getitem__")(0);
@@ -1096,6 +2329,44 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 			knn_dists = knn_dists_.cast<vector<vector<double>>>();
 			knn_indices = knn_indices_.cast<vector<vector<int>>>();
 
+		} else if( algorithm == "Exact" ) {
+
+			tie(knn_indices, knn_dists) = umap::exact_nearest_neighbors(X, n_neighbors, metric);
+
+		} else if( algorithm == "HNSW" ) {
+
+			unsigned M = (unsigned) stoi(knn_args["M"]);
+			unsigned ef_construction = (unsigned) stoi(knn_args["efConstruction"]);
+
+			float* converted;
+			unsigned ndims;
+			const float* data = efanna_rows(X, metric, false, ndims, converted);
+			efanna2e::IndexHNSW index(ndims, X.shape(0), efanna_metric(metric));
+
+			efanna2e::Parameters params;
+			params.Set<unsigned>("M", M); // links per point (2*M on the bottom layer)
+			params.Set<unsigned>("efConstruction", ef_construction); // candidate list size while inserting
+			params.Set<unsigned>("efSearch", max(ef_construction, (unsigned) n_neighbors)); // candidate list size of the self-queries
+
+			index.Build(X.shape(0), data, params);
+
+			vector<vector<efanna2e::Neighbor>> knn;
+			index.SearchKnnGraph(n_neighbors, params, knn);
+
+			delete[] converted;
+
+			knn_indices = vector<vector<int>>(X.size(), vector<int>(n_neighbors, 0));
+			knn_dists = vector<vector<double>>(X.size(), vector<double>(n_neighbors, 0.0));
+
+			#pragma omp parallel for
+			for( int i = 0; i < X.shape(0); ++i ) 
+			{
+				for( int j = 0; j < knn[i].size(); ++j ) {
+					knn_indices[i][j] = knn[i][j].id;
+					knn_dists[i][j] = (double) knn[i][j].distance;
+				}
+			}
+
 		} else if( algorithm == "ANNOY" ) {
 			py::module scipy_random = py::module::import("numpy.random");
 			scipy_random.attr("seed")(0);
@@ -1108,7 +2379,7 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 			t.attr("set_seed")(0);
 
 			for( int i = 0; i < X.shape(0); ++i ) {
-				py::array_t<double> values = py::cast(X.dense_matrix[i]);
+				py::array_t<double> values = py::cast(X.get_row(i));
 				t.attr("add_item")(py::cast(i), values);				
 			}
 			t.attr("set_seed")(0);
@@ -1135,11 +2406,11 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 
 			
 
-			py::array_t<double> data = py::cast(X.dense_matrix);
+			py::object data = X.is_csr() ? to_scipy_csr(X) : py::object(to_numpy(X));
 			py::object nn_descent = pynn.attr("NNDescent")(
 				data, 
 				py::arg("n_neighbors")=n_neighbors,
-				py::arg("metric")="euclidean",
+				py::arg("metric")=(metric == "inner_product" ? "dot" : metric),
 				// py::arg("metric_kwds")=metric_kwds,
 				py::arg("random_state")=0,
 				py::arg("n_trees")=n_trees,
@@ -1168,8 +2439,11 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 			unsigned K = (unsigned) n_neighbors-1;
 
 
-			efanna2e::IndexRandom init_index(X.shape(1), X.shape(0));
-			efanna2e::IndexGraph index(X.shape(1), X.shape(0), efanna2e::L2, (efanna2e::Index*)(&init_index));
+			unsigned rp_trees = (unsigned) stoi(knn_args["rpTrees"]);
+
+			efanna2e::IndexRandom random_index(X.shape(1), X.shape(0));
+			efanna2e::IndexRPForest forest_index(X.shape(1), X.shape(0), efanna_metric(metric));
+			efanna2e::Index* init_index = &random_index;
 
 			efanna2e::Parameters params;
 			params.Set<unsigned>("K", K); // the number of neighbors to construct the neighbor graph
@@ -1177,13 +2451,39 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 			params.Set<unsigned>("iter", iter); // the number of iterations
 			params.Set<unsigned>("S", S); // how many numbers of points in the leaf node; candidate pool size
 			params.Set<unsigned>("R", R); 
+			params.Set<float>("delta", stof(knn_args["delta"])); // stop once a round changes fewer than delta*N*K neighbors
 			
-			float* data = X.data_f();
+			// CSR rows are compared through sparse dot products instead of being densified
+			float* converted = nullptr;
+			const float* data = nullptr;
+			efanna2e::RowDistance* rows = nullptr;
+			if( X.is_csr() ) {
+				rows = new efanna2e::SparseRows(X.csr_data, X.csr_indices, X.csr_indptr, X.shape(0), efanna_metric(metric));
+			} else {
+				unsigned ndims;
+				data = efanna_rows(X, metric, false, ndims, converted);
+				rows = quantized_rows(data, X.shape(0), ndims, metric, knn_args["quantize"]);
+
+				// the first candidates come from the leaves of a random projection forest instead of random points
+				if( rp_trees > 0 ) {
+					efanna2e::Parameters forest_params;
+					forest_params.Set<unsigned>("nTrees", rp_trees);
+					forest_params.Set<unsigned>("leafSize", std::max(L+1, (unsigned) stoi(knn_args["leafSize"])));
+					forest_params.Set<unsigned>("seed", (unsigned) rand());
+					forest_index.Build(X.shape(0), data, forest_params);
+					init_index = &forest_index;
+					params.Set<unsigned>("initPool", L); // leaf neighbors are worth keeping, unlike random points
+				}
+			}
+
+			efanna2e::IndexGraph index(X.shape(1), X.shape(0), efanna_metric(metric), init_index);
+			index.SetRows(rows);
 
 			index.Build(X.shape(0), data, params);
-			
+			describe_descent(index, report, verbose);
 
-			delete data;
+			delete[] converted;
+			delete rows;
 
 			knn_indices = vector<vector<int>>(X.size(), vector<int>(n_neighbors, 0));
 			knn_dists = vector<vector<double>>(X.size(), vector<double>(n_neighbors, 0.0));
@@ -1211,12 +2511,12 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 			unsigned R = (unsigned) stoi(knn_args["R"]);
 			unsigned K = (unsigned) n_neighbors;
 
-			float* data = X.data_f();
-			unsigned ndims = (unsigned) X.shape(1);
+			unsigned ndims;
 			unsigned nsamples = (unsigned) X.shape(0);
 
-			float* data_aligned = efanna2e::data_align(data, nsamples, ndims);
-			efanna2e::IndexKDtree index_kdtree(ndims, nsamples, efanna2e::L2, nullptr);
+			float* converted;
+			const float* data_aligned = efanna_rows(X, metric, true, ndims, converted);
+			efanna2e::IndexKDtree index_kdtree(ndims, nsamples, efanna_metric(metric), nullptr);
 
 			efanna2e::Parameters params_kdtree;
 			params_kdtree.Set<unsigned>("K", K);
@@ -1227,11 +2527,7 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 
 
 			efanna2e::IndexRandom init_index(ndims, nsamples);
-			efanna2e::IndexGraph index_nndescent(ndims, nsamples, efanna2e::L2, (efanna2e::Index*)(&init_index));
-
-			index_nndescent.final_graph_ = index_kdtree.final_graph_;
-			// index_kdtree.Save("mnist.graph");
-			// index_nndescent.Load("mnist.graph");
+			efanna2e::IndexGraph index_nndescent(ndims, nsamples, efanna_metric(metric), (efanna2e::Index*)(&init_index));
 
 			efanna2e::Parameters params_nndescent;
 			params_nndescent.Set<unsigned>("K", K);
@@ -1239,13 +2535,18 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 			params_nndescent.Set<unsigned>("iter", iter);
 			params_nndescent.Set<unsigned>("S", S);
 			params_nndescent.Set<unsigned>("R", R);
+			params_nndescent.Set<float>("delta", stof(knn_args["delta"]));
 
-			index_nndescent.RefineGraph(data_aligned, params_nndescent);
+			efanna2e::RowDistance* rows = quantized_rows(data_aligned, nsamples, ndims, metric, knn_args["quantize"]);
+			index_nndescent.SetRows(rows);
+			index_nndescent.RefineGraph(data_aligned, std::move(index_kdtree.final_graph_), index_kdtree.GraphWidth(), params_nndescent);
+			describe_descent(index_nndescent, report, verbose);
+			delete rows;
 
 			knn_indices = vector<vector<int>>(X.size(), vector<int>(n_neighbors, 0));
 			knn_dists = vector<vector<double>>(X.size(), vector<double>(n_neighbors, 0.0));
 
-			// #pragma omp parallel for
+			#pragma omp parallel for
 			for( int i = 0; i < nsamples; ++i ) 
 			{
 				knn_dists[i][0] = 0.0;
@@ -1256,50 +2557,335 @@ tuple<vector<vector<int>>, vector<vector<double>>> umap::nearest_neighbors(umap:
 
 				}	
 			}
-			free(data_aligned);
+			delete[] converted;
 		}
 
 	}
 
+	// 1 - <x, y> is negative for long vectors, but the fuzzy set expects non-negative distances
+	if( metric == "inner_product" )
+		for( auto& row: knn_dists )
+			for( double& dist: row )
+				dist = max(0.0, dist);
+
 	sec end = clock::now() - begin; 
 
 	if( verbose )
 		cout << "Computing k nearest neighbors: " << end.count() << " seconds." << endl;
 
+	if( !cache_file.empty() && !umap::save_knn_cache(cache_file, cache_key, knn_indices, knn_dists) && verbose )
+		cout << "Could not store k nearest neighbors in " << cache_file << endl;
+
 
 	return make_tuple(knn_indices, knn_dists);
 }
 
+// smallest candidate list kept by a knn graph query, and trees giving its entry points
+static const int KNN_QUERY_BEAM = 64;
+static const unsigned KNN_QUERY_TREES = 4;
+
 /**
-* Computes the graph-forces to use in the optimization
+* Finds the nearest rows of a fitted dataset for new rows
 *
-* @param X Matrix representing the dataset
-* @param n_neighbors int representing the number of neighbors for k nearest neighbors
-* @param random_state double representing a random state
-* @param metric string representing the metric used for distance computation
-* @param knn_indices Container representing the indices of k nearest neighbors
-* @param knn_dists Container representing the distances of k nearest neighbors
-* @param local_connectivity int representing how connected will be the manifolds
-* @param apply_set_operations bool to symmetrize the graph
-* @param verbose 
-* @param obj 
+* Every query walks the knn graph of X from the rows in the leaves it reaches in
+* a small random projection forest, and keeps the max(2*n_neighbors, KNN_QUERY_BEAM)
+* closest rows it meets, so it computes a few hundred distances instead of a pass
+* over X. The candidates are ranked again
+* with metric_distance, which gives the distances the units of the knn graph.
+* Datasets smaller than two beams are scanned exhaustively.
+*
+* @param X Matrix representing the fitted dataset (dense)
+* @param knn_indices Container with the knn graph of X
+* @param Q Matrix representing the new rows (dense, with the columns of X)
+* @param n_neighbors int representing the number of neighbors of each new row
+* @param metric string representing the metric of the knn graph
+* @return tuple with two Containers containing the knn indices and knn distances of the rows of Q
 */
-tuple<Eigen::SparseMatrix<double, Eigen::RowMajor>, vector<double>, vector<double>> umap::fuzzy_simplicial_set(
-	umap::Matrix& X, int n_neighbors, double random_state, string metric, 
-	vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists,
-	double local_connectivity, bool apply_set_operations, bool verbose, umap::UMAP* obj)
+tuple<vector<vector<int>>, vector<vector<double>>> umap::query_nearest_neighbors(umap::Matrix& X, vector<vector<int>>& knn_indices,
+	umap::Matrix& Q, int n_neighbors, string metric)
 {
+	if( X.is_sparse() || X.is_csr() || Q.is_sparse() || Q.is_csr() )
+		throw runtime_error("Querying the knn graph requires dense data");
+	if( Q.shape(1) != X.shape(1) )
+		throw runtime_error("New rows have " + to_string(Q.shape(1)) + " features, the fitted data has " + to_string(X.shape(1)));
+	if( knn_indices.size() != X.shape(0) )
+		throw runtime_error("The knn graph does not match the fitted data");
+
+	int n = X.shape(0), m = Q.shape(0), d = X.shape(1);
+	int k = min(n_neighbors, n);
+	int beam = max(2*k, KNN_QUERY_BEAM);
+
+	// candidates of every query (none: all the rows of X)
+	vector<vector<int>> candidates(m);
+	if( n > 2*beam ) {
+		unsigned dim;
+		float* converted_x;
+		float* converted_q;
+		const float* data = efanna_rows(X, metric, false, dim, converted_x);
+		const float* queries = efanna_rows(Q, metric, false, dim, converted_q);
+
+		efanna2e::IndexGraph::CompactGraph graph(n);
+		for( int i = 0; i < n; ++i )
+			graph[i].assign(knn_indices[i].begin(), knn_indices[i].end());
+
+		efanna2e::Parameters params;
+		params.Set<unsigned>("L_search", (unsigned) beam);
+
+		// the walks start from the leaves a query reaches in a small random projection forest, since 
+		// random entry points often miss its cluster
+		efanna2e::Parameters forest_params;
+		forest_params.Set<unsigned>("nTrees", KNN_QUERY_TREES);
+		forest_params.Set<unsigned>("leafSize", (unsigned) beam);
+		forest_params.Set<unsigned>("seed", (unsigned) rand());
+		efanna2e::IndexRPForest forest(dim, n, efanna_metric(metric));
+		forest.Build(n, data, forest_params);
+
+		efanna2e::IndexGraph index(dim, n, efanna_metric(metric), &forest);
+		index.SetGraph(data, std::move(graph));
+		index.SetSearchEntry(&forest);
+
+		#pragma omp parallel for schedule(dynamic, 64)
+		for( int q = 0; q < m; ++q ) {
+			vector<unsigned> ids(beam);
+			index.Search(queries + (size_t)q*dim, data, beam, params, ids.data());
+
+			// an entry point can be met again through the graph
+			std::sort(ids.begin(), ids.end());
+			ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+			candidates[q].assign(ids.begin(), ids.end());
+		}
 
-	using clock = chrono::system_clock;
-	using sec = chrono::duration<double>;
+		delete[] converted_x;
+		delete[] converted_q;
+	}
 
-	if( knn_indices.size() == 0 || knn_dists.size() == 0 ) {
-		tie(knn_indices, knn_dists) = umap::nearest_neighbors(X, n_neighbors, metric, obj->knn_args, verbose, obj->is_reproducible());
-	} 
+	vector<vector<int>> indices(m, vector<int>(k, 0));
+	vector<vector<double>> dists(m, vector<double>(k, 0.0));
 
-	vector<double> sigmas, rhos;
-	tie(sigmas, rhos) = umap::smooth_knn_dist(knn_dists, (double) n_neighbors, 64, local_connectivity);	
+	#pragma omp parallel
+	{
+		vector<double> u(d), v(d);
+		vector<pair<double, int>> ranked;
+
+		#pragma omp for schedule(dynamic, 64)
+		for( int q = 0; q < m; ++q ) {
+			Q.copy_row(q, u.data());
+
+			bool exhaustive = candidates[q].empty();
+			int count = exhaustive ? n : (int) candidates[q].size();
+			ranked.clear();
+			for( int c = 0; c < count; ++c ) {
+				int j = exhaustive ? c : candidates[q][c];
+				X.copy_row(j, v.data());
+				ranked.push_back(make_pair(umap::metric_distance(u.data(), v.data(), d, metric), j));
+			}
+
+			int found = min(k, (int) ranked.size());
+			partial_sort(ranked.begin(), ranked.begin() + found, ranked.end());
+			for( int j = 0; j < found; ++j ) {
+				indices[q][j] = ranked[j].second;
+				dists[q][j] = ranked[j].first;
+			}
+		}
+	}
+
+	return make_tuple(indices, dists);
+}
+
+// rounds of local join of insert_nearest_neighbors over the rows whose neighbors changed
+static const int INSERT_JOIN_ROUNDS = 1;
+
+/**
+* Extends the knn graph of a dataset to rows appended to it
+*
+* X holds the rows of the knn graph followed by the new ones. The graph gains 
+* the new rows through efanna's GraphAdd: every new row walks the graph from 
+* the leaves it reaches in a small random projection forest (and from other new 
+* rows when the batch is large), keeps the n_neighbors-1 closest rows it meets, 
+* and is offered to their neighbor lists in return. The lists that changed are 
+* ranked again with metric_distance and also check the neighbors of their 
+* neighbors, which reach the new rows a fitted row was not offered. Graphs of up 
+* to two beams are computed again with exact_nearest_neighbors.
+*
+* @param X Matrix representing the rows of the knn graph followed by the new rows (dense)
+* @param knn_indices Container with the knn graph of the first rows, extended in place
+* @param knn_dists Container with the knn distances of the first rows, extended in place
+* @param metric string representing the metric of the knn graph
+* @return Container with the rows whose neighbors changed (including the new rows), in ascending order
+*/
+vector<int> umap::insert_nearest_neighbors(umap::Matrix& X, vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists, 
+	string metric)
+{
+	if( X.is_sparse() || X.is_csr() )
+		throw runtime_error("Inserting into the knn graph requires dense data");
+	if( knn_indices.size() == 0 || knn_indices.size() > X.shape(0) )
+		throw runtime_error("The knn graph does not match the data");
+
+	int n = X.shape(0), n_old = knn_indices.size(), d = X.shape(1);
+	int k = knn_indices[0].size();
+	int beam = max(2*k, KNN_QUERY_BEAM);
+
+	vector<int> updated;
+	if( n == n_old )
+		return updated;
+
+	if( n_old <= 2*beam ) {
+		tie(knn_indices, knn_dists) = umap::exact_nearest_neighbors(X, k, metric);
+		updated.resize(n);
+		iota(updated.begin(), updated.end(), 0);
+		return updated;
+	}
+
+	unsigned dim;
+	float* converted;
+	const float* data = efanna_rows(X, metric, false, dim, converted);
+
+	// each point is its own first neighbor, which efanna leaves out
+	efanna2e::IndexGraph::CompactGraph graph(n_old);
+	for( int i = 0; i < n_old; ++i )
+		graph[i].assign(knn_indices[i].begin() + 1, knn_indices[i].end());
+
+	efanna2e::Parameters forest_params;
+	forest_params.Set<unsigned>("nTrees", KNN_QUERY_TREES);
+	forest_params.Set<unsigned>("leafSize", (unsigned) beam);
+	forest_params.Set<unsigned>("seed", (unsigned) rand());
+	efanna2e::IndexRPForest forest(dim, n_old, efanna_metric(metric));
+	forest.Build(n_old, data, forest_params);
+
+	efanna2e::IndexGraph index(dim, n_old, efanna_metric(metric), &forest);
+	index.SetGraph(data, std::move(graph));
+	index.SetSearchEntry(&forest);
+
+	efanna2e::Parameters params;
+	params.Set<unsigned>("L_ADD", (unsigned) beam);
+	index.GraphAdd(data, n - n_old, dim, params);
+
+	delete[] converted;
+
+	vector<char> changed(n, 0);
+	knn_indices.resize(n, vector<int>(k, 0));
+	knn_dists.resize(n, vector<double>(k, 0.0));
+
+	#pragma omp parallel
+	{
+		vector<double> u(d), v(d);
+		vector<pair<double, int>> ranked;
+
+		#pragma omp for schedule(dynamic, 64)
+		for( int i = 0; i < n; ++i ) {
+			const vector<unsigned>& ids = index.final_graph_[i];
+			if( i < n_old && std::none_of(ids.begin(), ids.end(), [n_old](unsigned id) { return id >= (unsigned) n_old; }) )
+				continue;
 
+			X.copy_row(i, u.data());
+			ranked.clear();
+			for( unsigned id : ids ) {
+				if( (int) id == i )
+					continue;
+				X.copy_row(id, v.data());
+				ranked.push_back(make_pair(umap::metric_distance(u.data(), v.data(), d, metric), (int) id));
+			}
+			std::sort(ranked.begin(), ranked.end());
+			ranked.erase(std::unique(ranked.begin(), ranked.end()), ranked.end());
+
+			// lists are only short when the batch leaves a new row with fewer candidates 
+			// than neighbors, so these rows scan every other row instead
+			if( (int) ranked.size() < k-1 ) {
+				vector<char> seen(n, 0);
+				seen[i] = 1;
+				for( auto& neighbor : ranked )
+					seen[neighbor.second] = 1;
+				for( int c = 0; c < n; ++c ) {
+					if( seen[c] )
+						continue;
+					X.copy_row(c, v.data());
+					ranked.push_back(make_pair(umap::metric_distance(u.data(), v.data(), d, metric), c));
+				}
+				std::partial_sort(ranked.begin(), ranked.begin() + (k-1), ranked.end());
+			}
+
+			knn_indices[i][0] = i;
+			knn_dists[i][0] = 0.0;
+			for( int j = 1; j < k; ++j ) {
+				knn_indices[i][j] = ranked[j-1].second;
+				knn_dists[i][j] = ranked[j-1].first;
+			}
+			changed[i] = 1;
+		}
+	}
+
+	for( int i = 0; i < n; ++i )
+		if( changed[i] )
+			updated.push_back(i);
+
+	// a fitted row only meets the new rows that picked it, so the updated rows also 
+	// rank the neighbors of their neighbors (the local join of NNDescent)
+	for( int round = 0; round < INSERT_JOIN_ROUNDS; ++round ) {
+		vector<vector<pair<double, int>>> joined(updated.size());
+
+		#pragma omp parallel
+		{
+			vector<double> u(d), v(d);
+			vector<int> candidates;
+
+			#pragma omp for schedule(dynamic, 64)
+			for( int r = 0; r < updated.size(); ++r ) {
+				int i = updated[r];
+				candidates.clear();
+				for( int j = 1; j < k; ++j ) {
+					const vector<int>& around = knn_indices[knn_indices[i][j]];
+					candidates.insert(candidates.end(), around.begin() + 1, around.end());
+				}
+				std::sort(candidates.begin(), candidates.end());
+				candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+				vector<pair<double, int>>& ranked = joined[r];
+				for( int j = 1; j < k; ++j )
+					ranked.push_back(make_pair(knn_dists[i][j], knn_indices[i][j]));
+
+				X.copy_row(i, u.data());
+				for( int c : candidates ) {
+					if( c == i || std::find(knn_indices[i].begin() + 1, knn_indices[i].end(), c) != knn_indices[i].end() )
+						continue;
+					X.copy_row(c, v.data());
+					ranked.push_back(make_pair(umap::metric_distance(u.data(), v.data(), d, metric), c));
+				}
+				std::partial_sort(ranked.begin(), ranked.begin() + (k-1), ranked.end());
+				ranked.resize(k-1);
+			}
+		}
+
+		for( int r = 0; r < updated.size(); ++r ) {
+			for( int j = 1; j < k; ++j ) {
+				knn_indices[updated[r]][j] = joined[r][j-1].second;
+				knn_dists[updated[r]][j] = joined[r][j-1].first;
+			}
+		}
+	}
+
+	return updated;
+}
+
+/**
+* Builds the graph of membership strengths from the knn graph and the kernel parameters
+*
+* The strengths, their row sums, and the transition probabilities of the random
+* walks are kept in obj.
+*
+* @param n int representing the number of data points
+* @param n_neighbors int representing the number of neighbors for k nearest neighbors
+* @param knn_indices Container representing the indices of k nearest neighbors
+* @param knn_dists Container representing the distances of k nearest neighbors
+* @param sigmas Container representing the kernel width of each data point
+* @param rhos Container representing the distance of each data point to its closest neighbor
+* @param apply_set_operations bool to symmetrize the graph
+* @param obj UMAP object receiving the strengths
+* @return Eigen::SparseMatrix with the graph
+*/
+static Eigen::SparseMatrix<double, Eigen::RowMajor> membership_graph(int n, int n_neighbors, 
+	vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists, vector<double>& sigmas, vector<double>& rhos, 
+	bool apply_set_operations, umap::UMAP* obj)
+{
 	vector<int> rows, cols;
 	vector<double> vals, sum_vals;
 	tie(rows, cols, vals, sum_vals) = umap::compute_membership_strenghts(knn_indices, knn_dists, sigmas, rhos);
@@ -1313,8 +2899,8 @@ tuple<Eigen::SparseMatrix<double, Eigen::RowMajor>, vector<double>, vector<doubl
 
 	vector<double> vals_transition(vals.begin(), vals.end());
 
-	Eigen::SparseMatrix<double, Eigen::RowMajor> result(X.size(), X.size());
-	result.reserve(Eigen::VectorXi::Constant(X.size(), 2*n_neighbors)); // TODO: verificar se é assim (ou com int)
+	Eigen::SparseMatrix<double, Eigen::RowMajor> result(n, n);
+	result.reserve(Eigen::VectorXi::Constant(n, 2*n_neighbors)); // TODO: verificar se é assim (ou com int)
 	// result.reserve(rows*2*n_neighbors);
 	
 	#pragma omp parallel for
@@ -1333,6 +2919,42 @@ tuple<Eigen::SparseMatrix<double, Eigen::RowMajor>, vector<double>, vector<doubl
 		result = 0.5 * (result + transpose);
 	}
 
+	return result;
+}
+
+/**
+* Computes the graph-forces to use in the optimization
+*
+* @param X Matrix representing the dataset
+* @param n_neighbors int representing the number of neighbors for k nearest neighbors
+* @param random_state double representing a random state
+* @param metric string representing the metric used for distance computation
+* @param knn_indices Container representing the indices of k nearest neighbors
+* @param knn_dists Container representing the distances of k nearest neighbors
+* @param local_connectivity int representing how connected will be the manifolds
+* @param apply_set_operations bool to symmetrize the graph
+* @param verbose 
+* @param obj 
+*/
+tuple<Eigen::SparseMatrix<double, Eigen::RowMajor>, vector<double>, vector<double>> umap::fuzzy_simplicial_set(
+	umap::Matrix& X, int n_neighbors, double random_state, string metric, 
+	vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists,
+	double local_connectivity, bool apply_set_operations, bool verbose, umap::UMAP* obj)
+{
+
+	using clock = chrono::system_clock;
+	using sec = chrono::duration<double>;
+
+	if( knn_indices.size() == 0 || knn_dists.size() == 0 ) {
+		tie(knn_indices, knn_dists) = umap::nearest_neighbors(X, n_neighbors, metric, obj->knn_args, verbose, obj->is_reproducible());
+	} 
+
+	vector<double> sigmas, rhos;
+	tie(sigmas, rhos) = umap::smooth_knn_dist(knn_dists, (double) n_neighbors, 64, local_connectivity);	
+
+	Eigen::SparseMatrix<double, Eigen::RowMajor> result = membership_graph(X.size(), n_neighbors, knn_indices, knn_dists, 
+																		   sigmas, rhos, apply_set_operations, obj);
+
 	return make_tuple(result, sigmas, rhos);
 
 }
@@ -1428,8 +3050,7 @@ void umap::UMAP::prepare_for_fitting(umap::Matrix& X)
 				throw runtime_error("Some rows contain fewer than n_neighbors distances");
 			}
 
-			vector<int> sorted_indices = utils::argsort(row_data);
-			vector<int> row_nn_data_indices(sorted_indices.begin(), sorted_indices.begin() + this->n_neighbors);
+			vector<int> row_nn_data_indices = utils::argsort_k(row_data, this->n_neighbors);
 
 			this->_knn_indices[row_id] = utils::arrange_by_indices<int>(row_indices, row_nn_data_indices);
 			this->_knn_dists[row_id] = utils::arrange_by_indices<double>(row_data, row_nn_data_indices);
@@ -1449,7 +3070,7 @@ void umap::UMAP::prepare_for_fitting(umap::Matrix& X)
 		if( this->verbose )
 			cout << "Small matrix. Computing pairwise distances." << endl;
 
-		vector<vector<double>> dmat = umap::pairwise_distances(X);
+		vector<vector<double>> dmat = umap::pairwise_distances(X, this->metric);
 		this->pairwise_distance = umap::Matrix(dmat);
 
 		tie(this->graph_, this->_sigmas, this->_rhos) = umap::fuzzy_simplicial_set(this->pairwise_distance, this->_n_neighbors, random_state,
@@ -1465,8 +3086,10 @@ void umap::UMAP::prepare_for_fitting(umap::Matrix& X)
 	
 		string nn_metric = this->metric;
 
+		this->_descent_report = umap::DescentReport();
 		tie(this->_knn_indices, this->_knn_dists) = umap::nearest_neighbors(X, this->_n_neighbors, nn_metric, 
-																			this->knn_args, verbose=this->verbose, this->is_reproducible());
+																			this->knn_args, verbose=this->verbose, this->is_reproducible(),
+																			&this->_descent_report);
 
 		tie(this->graph_, this->_sigmas, this->_rhos) = umap::fuzzy_simplicial_set(X, this->n_neighbors, random_state,
 																                   nn_metric, this->_knn_indices, this->_knn_dists,
@@ -1538,10 +3161,54 @@ void umap::UMAP::fit(vector<vector<double>> X)
 */
 void umap::UMAP::fit(const umap::Matrix& X) 
 {
-	if( X.is_sparse() )
+	if( X.is_sparse() ) {
 		this->fit(X.sparse_matrix);
-	else
-		this->fit(X.dense_matrix);
+	} else {
+		// dense data (or a view over an external buffer) is shared as is
+		std::srand(this->random_state);
+		this->dataset = X;
+		this->_sparse_data = false;
+
+		this->prepare_for_fitting(this->dataset);
+	}
+}
+
+/**
+* Extends the fit to rows appended to the fitted dataset
+*
+* The knn graph gains the new rows through insert_nearest_neighbors. Sigma and 
+* rho are computed again only for the rows whose neighbors changed, and the 
+* graph of membership strengths is rebuilt from the updated neighborhoods.
+*
+* @param X Matrix representing the fitted rows followed by the new ones (dense)
+*/
+void umap::UMAP::insert(const umap::Matrix& X)
+{
+	if( this->_knn_indices.size() == 0 )
+		throw runtime_error("UMAP is not fitted");
+
+	this->dataset = X;
+
+	vector<int> updated = umap::insert_nearest_neighbors(this->dataset, this->_knn_indices, this->_knn_dists, this->metric);
+	if( updated.empty() )
+		return;
+
+	vector<vector<double>> updated_dists(updated.size());
+	for( int i = 0; i < updated.size(); ++i )
+		updated_dists[i] = this->_knn_dists[updated[i]];
+
+	vector<double> sigmas, rhos;
+	tie(sigmas, rhos) = umap::smooth_knn_dist(updated_dists, (double) this->n_neighbors, 64, this->local_connectivity);
+
+	this->_sigmas.resize(this->dataset.size(), 0.0);
+	this->_rhos.resize(this->dataset.size(), 0.0);
+	for( int i = 0; i < updated.size(); ++i ) {
+		this->_sigmas[updated[i]] = sigmas[i];
+		this->_rhos[updated[i]] = rhos[i];
+	}
+
+	this->graph_ = membership_graph(this->dataset.size(), this->n_neighbors, this->_knn_indices, this->_knn_dists, 
+									this->_sigmas, this->_rhos, true, this);
 }
 
 /**
@@ -1560,20 +3227,55 @@ vector<double> umap::Matrix::get_row(int i) {
 
 		}
 		return row;
+	} else if( this->is_view() || this->is_csr() ) {
+		vector<double> row(this->shape_[1], 0.0);
+		this->copy_row(i, row.data());
+		return row;
 	} else {
 		return this->dense_matrix[i];
 	}
 }
 
+/**
+* Copies a row of a dense or CSR matrix
+*
+* @param i int representing the row
+* @param out double* receiving shape(1) values
+*/
+void umap::Matrix::copy_row(int i, double* out) const {
+	size_t d = this->shape_[1];
+
+	if( this->csr_indptr ) {
+		std::fill(out, out + d, 0.0);
+		for( int j = this->csr_indptr[i]; j < this->csr_indptr[i+1]; ++j )
+			out[this->csr_indices[j]] = this->csr_data[j];
+	} else if( this->dense_f )
+		std::copy(this->dense_f + i*d, this->dense_f + (i+1)*d, out);
+	else if( this->dense_d )
+		std::copy(this->dense_d + i*d, this->dense_d + (i+1)*d, out);
+	else
+		std::copy(this->dense_matrix[i].begin(), this->dense_matrix[i].end(), out);
+}
+
 /**
 * Get C-like representation of dataset
 *
 * @return float* representing the dataset
 */
 float* umap::Matrix::data_f() {
-	if( sparse )
+	if( sparse || this->is_csr() )
 		return nullptr;
 
+	if( this->is_view() ) {
+		size_t count = (size_t) this->shape_[0] * this->shape_[1];
+		float* d = new float[count];
+		if( this->dense_f )
+			std::copy(this->dense_f, this->dense_f + count, d);
+		else
+			std::transform(this->dense_d, this->dense_d + count, d, [](double v) { return (float) v; });
+		return d;
+	}
+
 	float* d = new float[this->dense_matrix.size() * this->dense_matrix[0].size()];
 
 	for( int i = 0; i < this->dense_matrix.size(); ++i )
@@ -1590,9 +3292,16 @@ float* umap::Matrix::data_f() {
 * @return double* representing the dataset
 */
 double* umap::Matrix::data() {
-	if( sparse )
+	if( sparse || this->is_csr() )
 		return nullptr;
 
+	if( this->is_view() ) {
+		double* d = new double[(size_t) shape_[0]*shape_[1]];
+		for( int i = 0; i < shape_[0]; ++i )
+			this->copy_row(i, d + (size_t) i*shape_[1]);
+		return d;
+	}
+
 	double* d = new double[dense_matrix.size()*dense_matrix[0].size()];
 
 	for( int i = 0; i < dense_matrix.size(); ++i )
@@ -45,6 +45,7 @@
 #include <map>
 #include <tuple>
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <typeinfo>
 #include <omp.h>
@@ -64,7 +65,11 @@
 
 #include "external/efanna/index_graph.h"
 #include "external/efanna/index_random.h"
+#include "external/efanna/index_rpforest.h"
 #include "external/efanna/index_kdtree.h"
+#include "external/efanna/index_hnsw.h"
+#include "external/efanna/sparse.h"
+#include "external/efanna/quantized.h"
 #include "external/efanna/util.h"
 
 namespace py = pybind11;
@@ -80,36 +85,51 @@ static double MIN_K_DIST_SCALE = 1e-3;
 
 
 /**
-*  Class for generating random values during random walks
+* Counter-based random number generator (SplitMix64 mixing)
+*
+* A draw is a pure function of (seed, stream, substream, counter), so every 
+* thread, edge or random walk can own an independent generator without sharing 
+* any state. Results do not depend on scheduling or on the number of threads.
 */
-class RandomGenerator
+class CounterRNG
 {
 public:
-    
-	static RandomGenerator& Instance() {
-        static RandomGenerator s;
-        return s;
-    }
 
-    std::mt19937 & get() {
-		mt.seed(0);
-        return mt;
-    }
+	/**
+	* Constructs a generator for one stream
+	*
+	* @param seed uint64_t representing the random state
+	* @param stream uint64_t identifying the stream (e.g., the epoch or the vertex)
+	* @param substream uint64_t identifying the substream (e.g., the edge or the walk)
+	*/
+	CounterRNG(uint64_t seed, uint64_t stream, uint64_t substream=0)
+	: key(mix(mix(mix(seed + GAMMA) ^ stream) + GAMMA ^ substream)), counter(0)
+	{
+	}
 
-private:
-    RandomGenerator() {
-        std::random_device rd;
+	// returns the next 64 random bits
+	uint64_t next() { return mix(key + (++counter)*GAMMA); }
+
+	// returns an integer uniformly distributed in [0, n)
+	int next_int(int n) { return (int) (((next() >> 32) * (uint64_t) n) >> 32); }
+
+	// returns a double uniformly distributed in [0, 1)
+	double next_double() { return (next() >> 11) * (1.0/9007199254740992.0); }
 
-		// if
-        auto seed = 0;// std::chrono::high_resolution_clock::now().time_since_epoch().count();
-        mt.seed(0);
-    }
-    ~RandomGenerator() {}
+	// SplitMix64 finalizer
+	static uint64_t mix(uint64_t z) 
+	{
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
 
-    RandomGenerator(RandomGenerator const&) = delete;
-    RandomGenerator& operator= (RandomGenerator const&) = delete;
+private:
 
-    std::mt19937 mt;
+	static const uint64_t GAMMA = 0x9e3779b97f4a7c15ULL;
+
+	uint64_t key;
+	uint64_t counter;
 };
 
 /**
@@ -165,9 +185,58 @@ public:
 		shape_.push_back(dim); 
 	}
 
+	/**
+	* Constructs a dense Matrix over an external row-major float32 buffer (no copy)
+	*
+	* The buffer must outlive the Matrix and all of its copies.
+	*
+	* @param data_ const float* pointing to rows x cols values
+	* @param rows int representing the number of data points
+	* @param cols int representing the dimensionality
+	*/
+	Matrix(const float* data_, int rows, int cols): dense_f(data_), sparse(false) {
+		shape_.push_back(rows);
+		shape_.push_back(cols);
+	}
+
+	/**
+	* Constructs a dense Matrix over an external row-major float64 buffer (no copy)
+	*
+	* The buffer must outlive the Matrix and all of its copies.
+	*
+	* @param data_ const double* pointing to rows x cols values
+	* @param rows int representing the number of data points
+	* @param cols int representing the dimensionality
+	*/
+	Matrix(const double* data_, int rows, int cols): dense_d(data_), sparse(false) {
+		shape_.push_back(rows);
+		shape_.push_back(cols);
+	}
+
+	/**
+	* Constructs a Matrix over external CSR arrays (no copy)
+	*
+	* Column indices must be sorted within each row. The arrays must outlive 
+	* the Matrix and all of its copies.
+	*
+	* @param data_ const float* with the nnz non-zero values
+	* @param indices_ const int* with the column of each non-zero value
+	* @param indptr_ const int* with rows+1 offsets of the rows in data_ and indices_
+	* @param rows int representing the number of data points
+	* @param cols int representing the dimensionality
+	*/
+	Matrix(const float* data_, const int* indices_, const int* indptr_, int rows, int cols)
+	: csr_data(data_), csr_indices(indices_), csr_indptr(indptr_), sparse(false) {
+		shape_.push_back(rows);
+		shape_.push_back(cols);
+	}
+
 	// get a matrix row
 	vector<double> get_row(int i);
 
+	// copy a row of a dense or CSR matrix into out (shape(1) values)
+	void copy_row(int i, double* out) const;
+
 	// get the matrix size
 	int size() { return shape_[0]; }
 
@@ -189,6 +258,15 @@ public:
 	// check if the matrix is sparse
 	bool is_sparse() const { return sparse; }
 
+	// check if the matrix holds CSR features (the sparse form is kept for similarities between points)
+	bool is_csr() const { return csr_indptr != nullptr; }
+
+	// check if the matrix reads an external buffer instead of dense_matrix
+	bool is_view() const { return dense_f != nullptr || dense_d != nullptr; }
+
+	// returns the external float32 buffer, or nullptr if the matrix does not wrap one
+	const float* float_buffer() const { return dense_f; }
+
 	vector<int> shape_;
 	
 	vector<utils::SparseData> sparse_matrix;
@@ -197,12 +275,168 @@ public:
 	
 	vector<vector<double>> dense_matrix;
 
+	// external row-major buffers (see the buffer constructors)
+	const float* dense_f = nullptr;
+	const double* dense_d = nullptr;
+
+	// external CSR arrays (see the CSR constructor)
+	const float* csr_data = nullptr;
+	const int* csr_indices = nullptr;
+	const int* csr_indptr = nullptr;
+
 private:
 
 	bool sparse = false;
 };
 
 
+/**
+* Low-dimensional embedding stored as a single contiguous buffer
+*
+* Points are laid out row by row (n x dim), so the coordinates of a point are
+* adjacent in memory and the whole embedding is one aligned allocation.
+*/
+class Embedding
+{
+
+public:
+
+	Embedding(): n_(0), dim_(0) {}
+
+	/**
+	* Constructs an embedding with every coordinate set to a value
+	*
+	* @param n int representing the number of points
+	* @param dim int representing the number of dimensions
+	* @param value double used to fill the buffer
+	*/
+	Embedding(int n, int dim, double value=0.0): n_(n), dim_(dim), buffer((size_t)n*dim, value) {}
+
+	/**
+	* Constructs an embedding by copying a row-based representation
+	*
+	* @param rows Container with shape (n, dim)
+	*/
+	Embedding(const vector<vector<double>>& rows): n_(rows.size()), dim_(rows.size() ? rows[0].size() : 0), buffer((size_t)rows.size()*dim_) 
+	{
+		for( int i = 0; i < n_; ++i )
+			std::copy(rows[i].begin(), rows[i].end(), this->row(i));
+	}
+
+	// returns a pointer to the coordinates of a point
+	double* row(int i) { return buffer.data() + (size_t)i*dim_; }
+	const double* row(int i) const { return buffer.data() + (size_t)i*dim_; }
+
+	// returns a coordinate of a point
+	double& operator()(int i, int d) { return buffer[(size_t)i*dim_ + d]; }
+	double operator()(int i, int d) const { return buffer[(size_t)i*dim_ + d]; }
+
+	// returns the C-like array of the embedding
+	double* data() { return buffer.data(); }
+	const double* data() const { return buffer.data(); }
+
+	// get the number of points
+	int size() const { return n_; }
+
+	// get the number of dimensions
+	int dim() const { return dim_; }
+
+private:
+
+	int n_;
+	int dim_;
+
+	vector<double, utils::AlignedAllocator<double>> buffer;
+};
+
+/**
+* Calendar of the edges that fire in each epoch of the layout optimization
+*
+* Every edge lives in the bucket of the next epoch in which it is sampled, 
+* so an epoch only visits its active edges instead of scanning all of 
+* epochs_per_sample.
+*/
+class EpochSchedule
+{
+
+public:
+
+	EpochSchedule(const vector<double>& epochs_per_sample, int n_epochs);
+
+	// returns the edges that fire in epoch n
+	const vector<int>& active(int n) const { return buckets[n]; }
+
+	// moves the edges of epoch n to the epoch of their next sample
+	void advance(int n, const vector<double>& epoch_of_next_sample);
+
+private:
+
+	int n_epochs;
+
+	vector<vector<int>> buckets;
+	vector<uint64_t>    mask;
+
+	// schedules an edge in the first epoch >= earliest that reaches next_sample
+	void push(int edge, int earliest, double next_sample);
+
+	// sorts the edges of a bucket in increasing order
+	void sort_bucket(int n);
+};
+
+/**
+* Barnes-Hut tree (quadtree in 2-D, octree in 3-D) over the points of an embedding
+*
+* A cell that is small compared to its distance to a point acts as a single 
+* point at its center of mass, so the repulsion of the whole embedding on a 
+* point costs O(log n) instead of O(n).
+*/
+class SpaceTree
+{
+
+public:
+
+	SpaceTree(const Embedding& embedding, double theta);
+
+	// sums the repulsive gradients of all points of the tree on point (force must be zeroed)
+	template<int DIM, bool FAST_POW>
+	void repulsion(const double* point, double a, double b, double gamma, double* force) const;
+
+	int size() const { return n_points; }
+
+private:
+
+	struct Cell
+	{
+		double center[3];
+		double mass_center[3];
+		double half_width;
+		int begin, count;
+		int child, n_children;
+	};
+
+	int dim;
+	int n_points;
+	double theta;
+
+	vector<Cell>   cells;
+	vector<double> points;
+
+	// splits a cell into its non-empty quadrants/octants, recursively
+	void split(int cell, vector<int>& order, vector<int>& scratch, const Embedding& embedding, int depth);
+};
+
+
+/**
+* Progress of the NNDescent rounds of a knn computation
+*
+*/
+struct DescentReport
+{
+	vector<long> updates;  // pool entries changed by each round
+	vector<double> recall; // recall of the pools on sampled points after each round
+};
+
+
 /**
 * UMAP class for embedding high-dimensional data in low-dimensional spaces.
 *
@@ -235,11 +469,19 @@ public:
 		knn_args["nlist"] = "100";
 		knn_args["nTrees"] = "50";
 		knn_args["mLevel"] = "8";
-
-		// hard-coded
-		// TODO: find an intelligent way to define these parameters
+		knn_args["M"] = "16";
+		knn_args["efConstruction"] = "100";
+		knn_args["cache_dir"] = "";
+		knn_args["quantize"] = "none";
+		knn_args["rpTrees"] = "4";
+		knn_args["leafSize"] = "30";
+
+		// defaults for NNDescent, replaced by tune_knn_args when a target recall is set
+		knn_args["target_recall"] = "0";
 		knn_args["L"] = std::to_string(n_neighbors_); //"100";
-		knn_args["iter"] = n_neighbors_ >= 50 ? "3" : "10";
+		// NNDescent runs at most iter rounds, stopping once a round changes fewer than delta*N*K neighbors
+		knn_args["iter"] = "30";
+		knn_args["delta"] = "0.001";
 		knn_args["S"] = std::to_string((int)(n_neighbors_ >= 50 ? 0.3*n_neighbors_ : n_neighbors_)); 
 		knn_args["R"] = std::to_string((int)(n_neighbors_ >= 50 ? 0.3*n_neighbors_ : n_neighbors_)); 
 	}
@@ -278,6 +520,13 @@ public:
 	* @return vector<double> with the distance of each data point to its closest neighbor
 	*/
 	vector<double> rhos() { return this->_rhos; }
+
+	/**
+	* Get the progress of NNDescent while it computed the knn graph
+	*
+	* @return DescentReport, empty if another algorithm (or the knn cache) gave the graph
+	*/
+	DescentReport& descent_report() { return this->_descent_report; }
 	
 	// fit dataset using an array of SparseData
 	void fit(const vector<utils::SparseData>& X);
@@ -291,6 +540,9 @@ public:
 	// receives the fit operation
 	void fit(const Matrix& X);
 
+	// extends the fit to the rows appended to the fitted ones in X
+	void insert(const Matrix& X);
+
 	void set_ab_parameters(double a, double b) {
 		this->a = a;
 		this->b = b;
@@ -306,6 +558,50 @@ public:
 		this->_fixing_term = fixing_term;
 	}
 
+	// approximate x^b in the gradients with utils::fast_pow (relative error below 1e-7)
+	void set_fast_gradient(bool fast_gradient) {
+		this->fast_gradient = fast_gradient;
+	}
+
+	// stop the layout optimization once the relative displacement of a sample of points 
+	// stays below tolerance for patience epochs (0 disables the monitor)
+	void set_convergence_tolerance(double tolerance, int patience=10) {
+		this->convergence_tol = tolerance;
+		this->convergence_patience = patience;
+	}
+
+	// number of epochs run by the last layout optimization
+	int stopping_epoch() { return _stopping_epoch; }
+
+	// relative displacement per epoch of the last layout optimization (empty if not monitored)
+	vector<double>& convergence_curve() { return _convergence_curve; }
+
+	// repulsion engine of the layout optimization: "NegativeSampling" or "BarnesHut" (2-D and 3-D only)
+	void set_repulsion(string method, double theta=0.5) {
+		this->repulsion = method;
+		this->theta = theta;
+	}
+
+	// directory where knn graphs are cached by dataset fingerprint (empty disables the cache)
+	void set_knn_cache(string directory) {
+		this->knn_args["cache_dir"] = directory;
+	}
+
+	// compression of the rows NNDescent compares while searching candidates: "none" or "int8"
+	void set_knn_quantization(string mode) {
+		this->knn_args["quantize"] = mode;
+	}
+
+	// recall the knn graph should reach: NNDescent then uses the cheapest L, S and R measured to reach it (0 keeps the defaults)
+	void set_knn_target_recall(double target) {
+		this->knn_args["target_recall"] = std::to_string(target);
+	}
+
+	// set the seed of the random streams used during optimization
+	void set_random_state(int random_state) {
+		this->random_state = random_state;
+	}
+
 	bool is_reproducible() {
 		return try_reproducible;
 	}
@@ -315,15 +611,15 @@ public:
 
 
 	// produces initial low-dimensional representation using Spectral Embedding
-	vector<vector<double>> spectral_layout(Matrix& data, const Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, int dim);
+	Embedding spectral_layout(Matrix& data, const Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, int dim);
 
 
 	vector<double> make_epochs_per_sample(const vector<double>& weights, int n_epochs);
 
-	// optimize the low-dimensional representation to slowly converge to UMAP projection
-	vector<vector<double>> optimize_layout_euclidean(vector<vector<double>>& head_embedding, vector<vector<double>>& tail_embedding,
+	// optimize the low-dimensional representation (in place) to slowly converge to UMAP projection
+	void optimize_layout_euclidean(Embedding& head_embedding, Embedding& tail_embedding,
 								   const vector<int>& head, const vector<int>& tail, int n_epochs, int n_vertices, 
-								   const vector<double>& epochs_per_sample);
+								   const vector<double>& epochs_per_sample, bool move_other=true);
 
 	bool 										 verbose;
 	string                                       metric;
@@ -342,35 +638,44 @@ private:
 	bool _sparse_data;
 	bool force_approximation_algorithm = false;
 	bool try_reproducible = false;
+	bool fast_gradient = false;
 
 	int n_epochs;
 	int n_components;
 	int random_state = 0;
 	int n_neighbors, _n_neighbors;	
+	int convergence_patience = 10;
+	int _stopping_epoch = 0;
 	
 	double _a, _b;
 	double local_connectivity;
 	double a = -1.0, b = -1.0;
 	double _fixing_term = 0.01;
 	double _initial_alpha = 1.0;
+	double convergence_tol = 0.0;
+	double theta = 0.5;
 	double repulsion_strength = 1.0;
 	double negative_sample_rate = 5.0;	
 	double spread = 1.0, min_dist = 0.001;
 
 	string init = "Spectral";
+	string repulsion = "NegativeSampling";
 
 	Matrix dataset;
 	Matrix pairwise_distance;
 
 	vector<bool>		   _free_datapoints;
+	vector<double>		   _datapoint_scale;
+	vector<double>		   _convergence_curve;
 	vector<double> 		   _sigmas; 
 	vector<double>         _rhos; 
 	vector<vector<int>>    _knn_indices;
 	vector<vector<double>> _knn_dists;
-	vector<vector<double>> embedding_;
 
 	Eigen::SparseMatrix<double, Eigen::RowMajor> graph_; 
 
+	DescentReport _descent_report;
+
 	
 
 	// method for Spectral Embedding
@@ -380,21 +685,34 @@ private:
 	vector<vector<double>> multi_component_layout(umap::Matrix& data,  const Eigen::SparseMatrix<double, Eigen::RowMajor>& graph, int n_components, 
 												  vector<int>& component_labels, int dim);
 
-	// optimize the layout for one epoch
-	void optimize_euclidean_epoch(vector<vector<double>>& head_embedding, vector<vector<double>>& tail_embedding,
-								   const vector<int>& head, const vector<int>& tail, int n_vertices, 
+	// optimize the layout for one epoch (specialised on dimension, fixed datapoints, move_other and gradient mode)
+	template<int DIM, bool HAS_FIXED, bool MOVE_OTHER, bool FAST_POW>
+	void optimize_euclidean_epoch(Embedding& head_embedding, Embedding& tail_embedding,
+								   const vector<int>& head, const vector<int>& tail, const vector<int>& active, int n_vertices, 
 								   const vector<double>& epochs_per_sample, double a, double b, 
 								   double gamma, int dim, bool move_other, double alpha, vector<double>& epochs_per_negative_sample,
 								   vector<double>& epoch_of_next_negative_sample, vector<double>& epoch_of_next_sample, 
 								   int n);
 
-	void optimize_euclidean_epoch_reproducible(vector<vector<double>>& head_embedding, vector<vector<double>>& tail_embedding,
-										   const vector<int>& head, const vector<int>& tail, int n_vertices, 
+	typedef void (UMAP::*EpochKernel)(Embedding&, Embedding&, const vector<int>&, const vector<int>&, const vector<int>&, int, 
+									  const vector<double>&, double, double, double, int, bool, double, 
+									  vector<double>&, vector<double>&, vector<double>&, int);
+
+	// selects the specialised epoch kernel once per optimize_layout_euclidean
+	EpochKernel epoch_kernel(int dim, bool has_fixed, bool move_other, bool fast);
+
+	template<int DIM, bool FAST_POW>
+	EpochKernel epoch_kernel(bool has_fixed, bool move_other);
+
+	// optimize the layout for one epoch with vertex-owned updates (bitwise reproducible), 
+	// with the repulsion of a SpaceTree instead of negative samples if barnes_hut
+	void optimize_euclidean_epoch_deterministic(Embedding& head_embedding, Embedding& tail_embedding,
+										   const vector<int>& head, const vector<int>& tail, const vector<int>& active, int n_vertices, 
 										   const vector<double>& epochs_per_sample, double a, double b, 
 										   double gamma, int dim, bool move_other, double alpha, vector<double>& epochs_per_negative_sample,
 										   vector<double>& epoch_of_next_negative_sample, 
 										   vector<double>& epoch_of_next_sample, 
-										   int n);
+										   int n, bool barnes_hut=false);
 
 };
 
@@ -416,7 +734,32 @@ tuple<vector<double>, vector<double>> smooth_knn_dist(vector<vector<double>>& di
 
 // find the nearest neighbors
 tuple<vector<vector<int>>, vector<vector<double>>> nearest_neighbors(umap::Matrix& X,
-	int n_neighbors, string metric, map<string, string> knn_args, bool verbose=false,bool reproducible=false);
+	int n_neighbors, string metric, map<string, string> knn_args, bool verbose=false,bool reproducible=false, 
+	DescentReport* report=nullptr);
+
+// picks the cheapest NNDescent L, S and R reaching knn_args["target_recall"] on a sample of X (cached by data shape)
+map<string, string> tune_knn_args(umap::Matrix& X, int n_neighbors, string metric, map<string, string> knn_args, bool verbose=false);
+
+// find the exact nearest neighbors with blocked distance computations
+tuple<vector<vector<int>>, vector<vector<double>>> exact_nearest_neighbors(umap::Matrix& X, int n_neighbors, string metric="euclidean");
+
+// find the nearest rows of X for new rows Q by a greedy search on the knn graph of X
+tuple<vector<vector<int>>, vector<vector<double>>> query_nearest_neighbors(umap::Matrix& X, vector<vector<int>>& knn_indices,
+	umap::Matrix& Q, int n_neighbors, string metric="euclidean");
+
+// extends the knn graph of the first rows of X to the rows that follow them, returning the rows whose neighbors changed
+vector<int> insert_nearest_neighbors(umap::Matrix& X, vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists, 
+	string metric="euclidean");
+
+// content hash of the dataset and the knn parameters (key of the knn cache)
+uint64_t knn_fingerprint(umap::Matrix& X, int n_neighbors, string metric, map<string, string> knn_args, bool reproducible=false);
+
+// file of a knn graph in the cache directory
+string knn_cache_filename(string directory, uint64_t key);
+
+// loads (memory-mapped) and stores knn graphs in the cache
+bool load_knn_cache(string filename, uint64_t key, int n, int k, vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists);
+bool save_knn_cache(string filename, uint64_t key, vector<vector<int>>& knn_indices, vector<vector<double>>& knn_dists);
 
 // compute the affinities after find knn, sigma and rho values
 tuple<vector<int>, vector<int>, vector<double>, vector<double>> compute_membership_strenghts(
@@ -426,6 +769,12 @@ tuple<vector<int>, vector<int>, vector<double>, vector<double>> compute_membersh
 // computes the pairwise distance between data points
 std::vector<std::vector<double>> pairwise_distances(Matrix& X, string metric="euclidean");
 
+// metrics computed natively: "euclidean", "cosine", "inner_product" and "manhattan"
+bool is_supported_metric(const string& metric);
+
+// distance between two dense rows for a supported metric
+double metric_distance(const double* u, const double* v, int d, const string& metric);
+
 
 
 
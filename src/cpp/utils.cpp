@@ -128,21 +128,19 @@ double utils::rdist(const vector<double>& x, const vector<double>& y)
     return result;
 }
 
+const utils::Log2Table utils::log2_table;
+
 /**
-* Clips a value between -4 and 4 (used in the embedding minimization)
-*
-* @param value A gradient value
-* @return the clipped value between -4 and 4
-*
+* Builds the table used by utils::fast_log2
 */
-double utils::clip(double value)
+utils::Log2Table::Log2Table()
 {
-    if( value > 4.0 )
-      return 4.0;
-    else if( value < -4.0 )
-      return -4.0;
-    else 
-      return value;
+    const int size = 1 << BITS;
+    for( int i = 0; i < size; ++i ) {
+      double center = 1.0 + (i + 0.5)/size;
+      this->inv[i] = 1.0/center;
+      this->log2[i] = -std::log2(this->inv[i]);
+    }
 }
 
 /**
@@ -192,4 +190,72 @@ void utils::log(bool verbose, const string& message)
 {
   if( verbose )
     cout << message;
+}
+
+/**
+* Computes a Reverse Cuthill-McKee ordering of a graph
+*
+* Vertices are visited in breadth-first order from a minimum-degree vertex 
+* of each component, neighbors in increasing degree, and the visit order is 
+* reversed. Vertices that are close in the graph get close positions, which 
+* improves the locality of graph traversals.
+*
+* @param n int representing the number of vertices
+* @param ptr pointer to the n+1 offsets of the adjacency lists
+* @param indices pointer to the adjacency lists (entries out of [0, n) are ignored)
+* @return Container with the ordering, where order[new] = old
+*/
+vector<int> utils::reverse_cuthill_mckee(int n, const int* ptr, const int* indices)
+{
+  vector<int> degree(n);
+  for( int v = 0; v < n; ++v )
+    degree[v] = ptr[v+1] - ptr[v];
+
+  vector<int> by_degree(n);
+  std::iota(by_degree.begin(), by_degree.end(), 0);
+  std::stable_sort(by_degree.begin(), by_degree.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+
+  vector<int> order;
+  order.reserve(n);
+  vector<char> visited(n, 0);
+
+  for( int start : by_degree ) {
+    if( visited[start] )
+      continue;
+
+    visited[start] = 1;
+    order.push_back(start);
+
+    for( size_t head = order.size()-1; head < order.size(); ++head ) {
+      int v = order[head];
+      size_t first = order.size();
+
+      for( int e = ptr[v]; e < ptr[v+1]; ++e ) {
+        int u = indices[e];
+        if( u >= 0 && u < n && !visited[u] ) {
+          visited[u] = 1;
+          order.push_back(u);
+        }
+      }
+
+      std::stable_sort(order.begin() + first, order.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+    }
+  }
+
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+/**
+* Computes the inverse of a permutation
+*
+* @param order Container with a permutation, where order[new] = old
+* @return Container with rank[old] = new
+*/
+vector<int> utils::inverse_permutation(const vector<int>& order)
+{
+  vector<int> rank(order.size());
+  for( int i = 0; i < order.size(); ++i )
+    rank[order[i]] = i;
+  return rank;
 }
\ No newline at end of file
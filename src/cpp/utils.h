@@ -38,11 +38,19 @@
 
 #include <tuple>
 #include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <numeric>
 #include <iostream>
 #include <algorithm>
+#include <cstdlib>
+#include <new>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include <Eigen/Sparse>
 
@@ -84,6 +92,80 @@ struct SparseData
 };
 
 
+/**
+ * Allocator returning memory aligned to a fixed boundary
+ *
+ * Used for contiguous buffers that are traversed by vectorized loops,
+ * so that rows start on a cache line.
+ *
+ * @tparam T the type of the allocated elements
+ * @tparam Alignment the alignment in bytes (power of two)
+ */
+template<typename T, std::size_t Alignment=64>
+struct AlignedAllocator
+{
+  typedef T value_type;
+
+  template<typename U>
+  struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  AlignedAllocator() {}
+
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(std::size_t n) 
+  {
+    if( n == 0 )
+      return nullptr;
+
+    void* ptr = nullptr;
+#ifdef _WIN32
+    ptr = _aligned_malloc(n*sizeof(T), Alignment);
+#else
+    if( posix_memalign(&ptr, Alignment, n*sizeof(T)) != 0 )
+      ptr = nullptr;
+#endif
+    if( !ptr )
+      throw std::bad_alloc();
+
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, std::size_t) 
+  {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+  }
+};
+
+template<typename T, typename U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return true; }
+
+template<typename T, typename U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return false; }
+
+
+/**
+ * Returns the index of the lowest set bit of a non-zero word
+ *
+ * @param word non-zero 64-bit word
+ * @return int with the number of trailing zero bits
+ */
+inline int count_trailing_zeros(uint64_t word)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, word);
+  return (int) index;
+#else
+  return __builtin_ctzll(word);
+#endif
+}
+
 /**
  * Computes a array of linearly spaced numbers
  *
@@ -148,6 +230,27 @@ std::vector<int> argsort(const std::vector<T>& data, bool reverse=false) {
 }
 
 
+/**
+ * Sorts the indices of the k smallest elements of an array
+ *
+ * @param data Container with the values
+ * @param k int representing the number of indices to return
+ * @return Container with the indices of the k smallest values, in increasing order
+ */
+template <typename T>
+std::vector<int> argsort_k(const std::vector<T>& data, int k) {
+
+  std::vector<int> v(data.size());
+  k = std::min(k, (int) data.size());
+
+  std::iota(v.begin(), v.end(), 0);
+  std::partial_sort(v.begin(), v.begin()+k, v.end(), [&](int i, int j){ return data[i] < data[j]; });
+  v.resize(k);
+
+  return v;
+}
+
+
 /**
  * Rearrages an array based on indices
  *
@@ -182,8 +285,119 @@ Eigen::SparseMatrix<double, Eigen::RowMajor> create_sparse(const vector<SparseDa
 // Computes the squared distance of two points
 double rdist(const vector<double>& x, const vector<double>& y);
 
-// Clip a gradient value
-double clip(double value);
+/**
+ * Computes the squared distance of two points stored in contiguous memory
+ *
+ * @param x pointer to the first point
+ * @param y pointer to the second point
+ * @param dim int representing the number of coordinates
+ * @return the squared distance between two points
+ */
+inline double rdist(const double* x, const double* y, int dim)
+{
+  double result = 0.0;
+  for( int i = 0; i < dim; ++i ) {
+    double diff = x[i]-y[i];
+    result += diff*diff;
+  }
+  return result;
+}
+
+/**
+ * Table for utils::fast_log2, indexed by the 8 leading bits of the mantissa
+ *
+ * inv[i] approximates 1/c_i for the center c_i of the i-th mantissa interval 
+ * and log2[i] = -log2(inv[i]) is exact for the stored (rounded) inv[i].
+ */
+struct Log2Table 
+{
+  static const int BITS = 8;
+
+  Log2Table();
+
+  double inv[1 << BITS];
+  double log2[1 << BITS];
+};
+
+extern const Log2Table log2_table;
+
+/**
+ * Computes a fast approximation of log2(x) for positive normal doubles
+ *
+ * log2(x) = e + log2(c) + log2(1 + r), where c is looked up from the leading 
+ * mantissa bits and |r| <= 2^-9, so a cubic in r gives an absolute error 
+ * below 1e-11.
+ *
+ * @param x positive normal double
+ * @return approximation of log2(x)
+ */
+inline double fast_log2(double x)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &x, sizeof(double));
+  int exponent = (int) ((bits >> 52) & 0x7ff) - 1023;
+  int index = (int) ((bits >> (52 - Log2Table::BITS)) & ((1 << Log2Table::BITS) - 1));
+  bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+
+  double m;
+  std::memcpy(&m, &bits, sizeof(double));
+  double r = m*log2_table.inv[index] - 1.0;
+  double series = r*(1.0 + r*(-0.5 + r*(1.0/3.0)));
+  return exponent + log2_table.log2[index] + 1.4426950408889634*series; // 1/ln(2)
+}
+
+/**
+ * Computes a fast approximation of 2^y
+ *
+ * 2^y = 2^i * 2^f with |f| <= 0.5, and 2^f is evaluated with a degree-7 Taylor 
+ * polynomial, so the relative error is below 1e-8. Results are clamped to the 
+ * normal double range.
+ *
+ * @param y exponent
+ * @return approximation of 2^y
+ */
+inline double fast_exp2(double y)
+{
+  y = std::min(std::max(y, -1022.0), 1023.0);
+  double i = std::floor(y + 0.5);
+  double z = (y - i)*0.6931471805599453; // ln(2)
+
+  double p = 1.0 + z*(1.0 + z*(1.0/2.0 + z*(1.0/6.0 + z*(1.0/24.0 + z*(1.0/120.0 + z*(1.0/720.0 + z*(1.0/5040.0)))))));
+
+  uint64_t bits = (uint64_t) ((int64_t) i + 1023) << 52;
+  double scale;
+  std::memcpy(&scale, &bits, sizeof(double));
+  return p*scale;
+}
+
+/**
+ * Computes a fast approximation of x^b for x > 0
+ *
+ * The relative error is below 1e-8 + 1e-11*|b|, i.e., under 1e-7 for the 
+ * distances and b values of UMAP gradients. Subnormal inputs fall back to 
+ * std::pow.
+ *
+ * @param x positive base
+ * @param b exponent
+ * @return approximation of x^b
+ */
+inline double fast_pow(double x, double b)
+{
+  if( x < DBL_MIN )
+    return std::pow(x, b);
+  return fast_exp2(b*fast_log2(x));
+}
+
+/**
+ * Clips a gradient value (inlined, it runs on every coordinate update)
+ *
+ * @param value A gradient value
+ * @return the clipped value between -4 and 4
+ */
+inline double clip(double value)
+{
+  return value > 4.0 ? 4.0 : (value < -4.0 ? -4.0 : value);
+}
 
 // Computes the pairwise distance for a matrix of points
 vector<vector<double>> pairwise_distances(vector<vector<double>>& X);
@@ -191,6 +405,12 @@ vector<vector<double>> pairwise_distances(vector<vector<double>>& X);
 // output verbosity
 void log(bool verbose, const string& message);
 
+// computes a Reverse Cuthill-McKee ordering (order[new] = old) of a graph in CSR format
+vector<int> reverse_cuthill_mckee(int n, const int* ptr, const int* indices);
+
+// computes the inverse of a permutation (rank[old] = new)
+vector<int> inverse_permutation(const vector<int>& order);
+
 
 }
 
@@ -1,12 +1,40 @@
 import humap
 
+import os
+import subprocess
+import sys
+import tempfile
 import unittest
 
 import numpy as np
+import scipy.sparse
 
 from sklearn.datasets import fetch_openml 
 from sklearn.preprocessing import normalize
 from sklearn.model_selection import train_test_split
+from sklearn.manifold import trustworthiness
+from sklearn.metrics import pairwise_distances
+
+def run_script(script, arguments, **environment):
+    # runs a script in a fresh interpreter, so that variables read when the libraries load apply, and returns its output
+    return subprocess.run([sys.executable, "-c", script] + list(arguments), check=True, env=dict(os.environ, **environment),
+                          stdout=subprocess.PIPE, universal_newlines=True).stdout
+
+def brute_force_distances(X, metric='euclidean'):
+    # distances between all rows as the kNN graph defines them, without the row itself
+    if metric == 'inner_product':
+        distances = np.maximum(0.0, 1.0 - X @ X.T)
+    else:
+        distances = pairwise_distances(X, metric=metric)
+    np.fill_diagonal(distances, np.inf)
+    return distances
+
+def knn_recall(indices, distances):
+    # share of the neighbors found (after the point itself) within the exact k-th neighbor distance, so ties count as found
+    k = indices.shape[1] - 1
+    kth = np.partition(distances, k-1, axis=1)[:, k-1]
+    found = np.take_along_axis(distances, indices[:, 1:], axis=1)
+    return np.mean(found <= kth[:, None] + 1e-9)
 
 class TestHumap(unittest.TestCase):
 
@@ -50,6 +78,301 @@ class TestHumap(unittest.TestCase):
         self.assertLess(level2.shape[0], level1.shape[0])
         self.assertLess(level1.shape[0], level0.shape[0])
 
+    def test_reproducibleAcrossThreads(self):
+        # exact kNN and random initialization keep third-party solvers out of the comparison
+        script = ("import sys, numpy as np, humap\n"
+                  "reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='Exact', init='random', verbose=False, reproducible=True)\n"
+                  "reducer.fit(np.load(sys.argv[1]))\n"
+                  "np.save(sys.argv[2], reducer.transform(0))\n")
+
+        with tempfile.TemporaryDirectory() as directory:
+            data = os.path.join(directory, "X.npy")
+            np.save(data, self.X[:2000])
+
+            embeddings = []
+            for threads in ("1", "4"):
+                output = os.path.join(directory, "embedding{}.npy".format(threads))
+                run_script(script, [data, output], OMP_NUM_THREADS=threads)
+                embeddings.append(np.load(output))
+
+        self.assertTrue(np.array_equal(embeddings[0], embeddings[1]), "reproducible embedding depends on the number of threads")
+
+    def test_fastGradient(self):
+        X = self.X[:2000]
+        scores = []
+        for fast_gradient in (False, True):
+            reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='Exact', reproducible=True)
+            reducer.set_fast_gradient(fast_gradient)
+            reducer.fit(X)
+            scores.append(trustworthiness(X, reducer.transform(0), n_neighbors=15))
+
+        self.assertLess(abs(scores[1] - scores[0]), 0.01, "fast x^b changes the quality of the layout")
+
+    def test_reorder(self):
+        X = self.X[:2000]
+        y = np.asarray(self.y[:2000]).astype(int)
+
+        embeddings = []
+        for reorder in (False, True):
+            reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='Exact', reproducible=True)
+            reducer.set_reorder(reorder)
+            reducer.fit(X, y)
+            embeddings.append(reducer.transform(0))
+
+            # the landmarks report their rows in the user's order
+            np.testing.assert_array_equal(reducer.labels(1), y[reducer.original_indices(1)], "landmark labels are not aligned with their rows")
+
+        # rows out of the user's order would make the layout untrustworthy
+        scores = [trustworthiness(X, embedding, n_neighbors=15) for embedding in embeddings]
+
+        self.assertEqual(embeddings[0].shape, embeddings[1].shape)
+        self.assertLess(abs(scores[1] - scores[0]), 0.01, "reordered layout is not mapped back to the user's order")
+
+    def test_convergenceStopsEarly(self):
+        reducer = humap.HUMAP(n_neighbors=15)
+        reducer.set_convergence_tolerance(1.0, patience=5)
+        reducer.fit(self.X)
+        reducer.transform(2)
+
+        epochs, curve = reducer.convergence()
+
+        self.assertEqual(epochs, 5, "layout optimization did not stop after patience epochs")
+        self.assertEqual(len(curve), epochs)
+
+    def test_negativeConvergenceTolerance(self):
+        reducer = humap.HUMAP(n_neighbors=15)
+
+        self.assertRaises(ValueError, reducer.set_convergence_tolerance, -1.0)
+
+    def test_barnesHutRepulsion(self):
+        X = self.X[:2000]
+        reducer = humap.HUMAP(n_neighbors=15)
+        reducer.fit(X)
+
+        # theta = 0 opens every cell, so the repulsion of all points is exact
+        reducer.set_repulsion("BarnesHut", theta=0.0)
+        exact = reducer.transform(0)
+        reducer.set_repulsion("BarnesHut", theta=0.8)
+        approximate = reducer.transform(0)
+
+        self.assertTrue(np.all(np.isfinite(approximate)), "Barnes-Hut layout is not finite")
+        self.assertGreater(trustworthiness(X, approximate, n_neighbors=15), trustworthiness(X, exact, n_neighbors=15) - 0.02,
+                           "Barnes-Hut layout preserves fewer neighbors than the exact repulsion")
+
+    def test_unknownRepulsion(self):
+        reducer = humap.HUMAP(n_neighbors=15)
+
+        self.assertRaises(ValueError, reducer.set_repulsion, "FFT")
+
+    def test_warmStart(self):
+        reducer = humap.HUMAP(n_neighbors=15)
+        reducer.set_n_epochs(100)
+        reducer.set_warm_start(True, epochs_fraction=0.2)
+        reducer.fit(self.X)
+
+        reducer.transform(1)
+        embedding = reducer.transform(0)
+        epochs, _ = reducer.convergence()
+
+        self.assertEqual(epochs, 20, "warm start did not shorten the epoch schedule")
+        self.assertEqual(embedding.shape[0], self.X.shape[0])
+
+    def test_knnConvergence(self):
+        reducer = humap.HUMAP(n_neighbors=15)
+        reducer.fit(self.X)
+
+        updates, recall = reducer.knn_convergence()
+
+        self.assertTrue(0 < len(updates) <= 30, "NNDescent rounds were not reported")
+        self.assertEqual(len(updates), len(recall), "every round needs an update count and a recall estimate")
+        self.assertTrue(updates[-1] <= 0.001 * self.X.shape[0] * 15 or len(updates) == 30, "NNDescent stopped before converging")
+        self.assertGreater(recall[-1], 0.8, "estimated recall of the knn graph is too low")
+
+    def test_exactKnn(self):
+        X = np.random.RandomState(0).rand(1000, 50)
+        reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='Exact')
+        reducer.fit(X)
+
+        indices, distances = reducer.knn_graph()
+        expected = brute_force_distances(X)
+        expected_indices = np.argsort(expected, axis=1)[:, :14]
+
+        np.testing.assert_array_equal(indices[:, 0], np.arange(X.shape[0]), "each point must be its own first neighbor")
+        np.testing.assert_array_equal(indices[:, 1:], expected_indices, "exact kNN differs from brute force")
+        np.testing.assert_allclose(distances[:, 1:], np.take_along_axis(expected, expected_indices, axis=1), rtol=1e-9, atol=1e-9)
+
+    def test_simdCap(self):
+        script = ("import sys, numpy as np, humap\n"
+                  "reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='Exact')\n"
+                  "reducer.fit(np.load(sys.argv[1]))\n"
+                  "indices, distances = reducer.knn_graph()\n"
+                  "np.save(sys.argv[2], indices)\n"
+                  "np.save(sys.argv[3], distances)\n")
+
+        with tempfile.TemporaryDirectory() as directory:
+            data = os.path.join(directory, "X.npy")
+            np.save(data, self.X[:2000])
+
+            graphs = []
+            for cap in ("scalar", None):
+                indices, distances = os.path.join(directory, "indices.npy"), os.path.join(directory, "distances.npy")
+                environment = {"HUMAP_SIMD": cap} if cap else {}
+                output = run_script(script, [data, indices, distances], **environment)
+                if cap:
+                    self.assertIn("distance kernels: scalar", output, "HUMAP_SIMD did not cap the distance kernels")
+                graphs.append((np.load(indices), np.load(distances)))
+
+        np.testing.assert_array_equal(graphs[0][0], graphs[1][0], "kNN graph depends on the distance kernels")
+        np.testing.assert_allclose(graphs[0][1], graphs[1][1], atol=1e-5)
+
+    def test_hnswKnn(self):
+        X = self.X[:2000]
+        reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='HNSW')
+        reducer.fit(X)
+
+        indices, _ = reducer.knn_graph()
+
+        self.assertGreater(knn_recall(indices, brute_force_distances(X)), 0.99, "recall of the HNSW kNN graph is too low")
+
+    def test_knnMetrics(self):
+        X = self.X[:2000]
+        # rows of different norms, so cosine has to normalise them and inner_product clamps the distances of large dot products
+        scaled = X * np.random.RandomState(0).uniform(1.0, 10.0, size=(X.shape[0], 1))
+
+        for metric, data in (('cosine', scaled), ('manhattan', X), ('inner_product', X), ('inner_product', scaled)):
+            expected = brute_force_distances(data, metric)
+
+            reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='Exact', metric=metric)
+            reducer.fit(data)
+            _, distances = reducer.knn_graph()
+
+            np.testing.assert_allclose(np.sort(distances[:, 1:], axis=1), np.sort(expected, axis=1)[:, :14], atol=1e-6,
+                                       err_msg="exact {} distances differ from brute force".format(metric))
+
+            reducer = humap.HUMAP(n_neighbors=15, metric=metric)
+            reducer.fit(data)
+            indices, _ = reducer.knn_graph()
+
+            self.assertGreater(knn_recall(indices, expected), 0.9, "recall of the {} kNN graph is too low".format(metric))
+
+    def test_unknownMetric(self):
+        self.assertRaises(ValueError, humap.HUMAP, metric='hamming')
+
+    def test_sparseInput(self):
+        X = self.X[:2000]
+        expected = brute_force_distances(X)
+
+        dense = humap.HUMAP(n_neighbors=15)
+        dense.fit(X)
+        sparse = humap.HUMAP(n_neighbors=15)
+        sparse.fit(scipy.sparse.csr_matrix(X))
+
+        dense_recall = knn_recall(dense.knn_graph()[0], expected)
+        sparse_recall = knn_recall(sparse.knn_graph()[0], expected)
+
+        self.assertGreater(sparse_recall, 0.9, "recall of the sparse kNN graph is too low")
+        self.assertGreater(sparse_recall, dense_recall - 0.03, "sparse input gives worse neighbors than the same dense rows")
+
+    def test_sparseInputNotCanonical(self):
+        X = self.X[:2000]
+        canonical = scipy.sparse.csr_matrix(X)
+
+        # every row lists its columns in reverse order, each twice with half the value
+        data, indices, indptr = [], [], [0]
+        for i in range(X.shape[0]):
+            row = slice(canonical.indptr[i], canonical.indptr[i+1])
+            data.append(np.tile(canonical.data[row][::-1] / 2, 2))
+            indices.append(np.tile(canonical.indices[row][::-1], 2))
+            indptr.append(indptr[-1] + 2 * (canonical.indptr[i+1] - canonical.indptr[i]))
+        duplicated = scipy.sparse.csr_matrix((np.concatenate(data), np.concatenate(indices), np.array(indptr)), shape=X.shape)
+        original_indices = duplicated.indices.copy()
+
+        reducer = humap.HUMAP(n_neighbors=15)
+        reducer.fit(duplicated)
+
+        np.testing.assert_array_equal(duplicated.indices, original_indices, "fit modified the caller's matrix")
+        self.assertGreater(knn_recall(reducer.knn_graph()[0], brute_force_distances(X)), 0.9, "duplicate columns were not summed")
+
+    def test_sparseInputNeedsNNDescent(self):
+        reducer = humap.HUMAP(n_neighbors=15, knn_algorithm='HNSW')
+
+        self.assertRaises(ValueError, reducer.fit, scipy.sparse.csr_matrix(self.X))
+
+    def test_int8Knn(self):
+        X = self.X[:2000]
+        expected = brute_force_distances(X)
+
+        exact_rows = humap.HUMAP(n_neighbors=15)
+        exact_rows.fit(X)
+        quantized = humap.HUMAP(n_neighbors=15)
+        quantized.set_knn_quantization('int8')
+        quantized.fit(X)
+
+        exact_recall = knn_recall(exact_rows.knn_graph()[0], expected)
+        quantized_recall = knn_recall(quantized.knn_graph()[0], expected)
+
+        self.assertGreater(quantized_recall, exact_recall - 0.03, "int8 candidate distances lose too much recall")
+
+    def test_transformNew(self):
+        X, X_new = self.X[:-1000], self.X[-1000:]
+        reducer = humap.HUMAP(n_neighbors=15)
+        reducer.fit(X)
+        level0 = reducer.transform(0)
+
+        embedding = reducer.transform_new(X_new, 0)
+
+        self.assertEqual(embedding.shape, (X_new.shape[0], level0.shape[1]), "wrong shape of the new points")
+        self.assertTrue(np.all(np.isfinite(embedding)), "new points are not finite")
+        self.assertTrue(np.all(embedding >= level0.min(axis=0) - 1.0) and np.all(embedding <= level0.max(axis=0) + 1.0),
+                        "new points were placed away from the fitted embedding")
+
+    def test_insert(self):
+        X, X_new = self.X[:-1000], self.X[-1000:]
+        reducer = humap.HUMAP(levels=np.array([0.2, 0.2]), n_neighbors=15)
+        reducer.fit(X)
+        reducer.set_drift_threshold(1.0)
+
+        reselected = reducer.insert(X_new)
+
+        self.assertFalse(reselected, "landmarks were selected again below the drift threshold")
+        self.assertEqual(reducer.influence(1).sum(), self.X.shape[0], "new points were not associated to landmarks")
+        self.assertEqual(reducer.transform(0).shape[0], self.X.shape[0], "new points are missing from the first level")
+
+        # rows far from every fitted point drift
+        reducer.set_drift_threshold(0.0)
+        reselected = reducer.insert(self.X[:100] + 10.0)
+
+        self.assertTrue(reselected, "landmarks were not selected again above the drift threshold")
+        self.assertEqual(reducer.drift(), 0.0, "drift was not reset by the new landmark selection")
+        self.assertEqual(reducer.influence(1).sum(), self.X.shape[0] + 100, "landmarks do not cover the first level")
+
+    def test_knnCache(self):
+        with tempfile.TemporaryDirectory() as directory:
+            reducer = humap.HUMAP(n_neighbors=15)
+            reducer.set_knn_cache(directory)
+            reducer.fit(self.X)
+
+            self.assertEqual(len(os.listdir(directory)), 1, "kNN graph was not cached")
+
+            reducer = humap.HUMAP(levels=np.array([0.3, 0.3]), n_neighbors=15)
+            reducer.set_knn_cache(directory)
+            reducer.fit(self.X)
+
+            self.assertEqual(len(os.listdir(directory)), 1, "cached kNN graph was not reused")
+
+    def test_knnTargetRecall(self):
+        with tempfile.TemporaryDirectory() as directory:
+            reducer = humap.HUMAP(n_neighbors=15)
+            reducer.set_knn_cache(directory)
+            reducer.set_knn_target_recall(0.9)
+            reducer.fit(self.X)
+
+            self.assertTrue(any(name.startswith("knn-params-") for name in os.listdir(directory)), "tuned kNN parameters were not cached")
+            self.assertEqual(reducer.transform(0).shape[0], self.X.shape[0], "tuned kNN graph does not cover the first level")
+
+        reducer = humap.HUMAP(n_neighbors=15)
+        self.assertRaises(ValueError, reducer.set_knn_target_recall, 1.5)
+
     def test_dimensionality2(self):
 
         X = np.random.rand(1000, 1)